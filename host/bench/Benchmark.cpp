@@ -0,0 +1,260 @@
+
+//
+// RTOS に依存しないモジュールのベンチマーク
+//
+// ホストでの所要時間なので実機の値ではない。変更の前後を比べるために使う。
+// --quick を付けると回数を減らし、動くことだけを確かめる。
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ButtonDebouncer.hpp"
+#include "HTTPResponseParser.hpp"
+#include "PublishRingBuffer.hpp"
+#include "PublishCoalescer.hpp"
+#include "TopicRouter.hpp"
+#include "JpegScaler.hpp"
+#include "HostJpeg.hpp"
+
+namespace {
+
+size_t s_Divisor = 1;
+// 最適化で処理が消えないよう結果を流し込む
+volatile size_t s_Sink = 0;
+
+template <class Function>
+void measure( const char* name, size_t iterations, Function&& function )
+{
+    iterations = (iterations / s_Divisor) ? (iterations / s_Divisor) : 1;
+
+    // 1 割を慣らしに使う
+    for( size_t i = 0; i < iterations / 10; ++i ){
+        function();
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    for( size_t i = 0; i < iterations; ++i ){
+        function();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>( end - begin ).count() / iterations;
+    std::printf( "%-44s %12.1f ns/op  (%zu ops)\n", name, ns, iterations );
+}
+
+void benchButtonDebouncer()
+{
+    // 跳ね返り 4 回の後にロックアウトが終わる 1 回の押下
+    static const bool sk_Bounce[] = { true, false, true, false, true };
+    ButtonDebouncer debouncer( true );
+    measure( "ButtonDebouncer press+release", 1000000, [&debouncer](){
+        bool pressed = false;
+        size_t count = 0;
+        for( bool level : sk_Bounce ){
+            debouncer.OnEdge( level, &pressed );
+            count += pressed;
+        }
+        debouncer.OnSettled( true, &pressed );
+        debouncer.OnEdge( false, &pressed );
+        debouncer.OnSettled( false, &pressed );
+        s_Sink = s_Sink + count;
+    } );
+}
+
+void benchHTTPResponseParser()
+{
+    static constexpr std::string_view sk_Header =
+        "HTTP/1.1 200 OK\r\n"
+        "x-amz-id-2: 2nWbPBwa4zhf8hYCnw5sU2bNcBQ/z4KkuTPc4cHNNyFTXqt0Dh6zX5kxAmq6bFe3\r\n"
+        "x-amz-request-id: 7C5F3A6B1D2E4F50\r\n"
+        "Date: Sat, 17 Oct 2026 09:00:00 GMT\r\n"
+        "ETag: \"d41d8cd98f00b204e9800998ecf8427e\"\r\n"
+        "Server: AmazonS3\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+    measure( "HTTPResponseParser::Parse (S3 PUT)", 1000000, [](){
+        HTTPResponse response;
+        bool has_length = false;
+        bool is_chunked = false;
+        HTTPResponseParser::Parse( sk_Header, &response, &has_length, &is_chunked );
+        s_Sink = s_Sink + response.StatusCode;
+    } );
+}
+
+void benchPublishRingBuffer()
+{
+    PublishRingBuffer ring;
+    ring.Allocate( 16, 384 );
+
+    measure( "PublishRingBuffer reserve/commit/consume", 2000000, [&ring](){
+        PublishRingBuffer::Slot* slot = ring.TryReserve();
+        slot->Length = 64;
+        ring.Commit( slot );
+        slot = ring.TryConsume();
+        s_Sink = s_Sink + slot->Length;
+        ring.Release( slot );
+    } );
+
+    // 4 タスクから書き込み、1 タスクで読み出す
+    static const int sk_Producers = 4;
+    std::atomic<bool> running( true );
+    std::thread consumer( [&ring, &running](){
+        while( running.load( std::memory_order_relaxed ) || ring.Size() > 0 ){
+            PublishRingBuffer::Slot* slot = ring.TryConsume();
+            if( slot ){
+                ring.Release( slot );
+            }
+        }
+    } );
+
+    std::atomic<size_t> dropped( 0 );
+    measure( "PublishRingBuffer 4 producers x 1000 msgs", 200, [&ring, &dropped](){
+        std::vector<std::thread> producers;
+        for( int i = 0; i < sk_Producers; ++i ){
+            producers.emplace_back( [&ring, &dropped](){
+                for( int n = 0; n < 1000; ++n ){
+                    PublishRingBuffer::Slot* slot = ring.TryReserve();
+                    if( slot == nullptr ){
+                        dropped.fetch_add( 1, std::memory_order_relaxed );
+                        continue;
+                    }
+                    slot->Length = 64;
+                    ring.Commit( slot );
+                }
+            } );
+        }
+        for( std::thread& producer : producers ){
+            producer.join();
+        }
+    } );
+    running.store( false );
+    consumer.join();
+    std::printf( "%-44s %12zu dropped\n", "", dropped.load() );
+}
+
+void benchPublishCoalescer()
+{
+    PublishCoalescer coalescer;
+    coalescer.Allocate( 4, 384 );
+
+    static constexpr MQTTTopic sk_Topics[] = { "esp32/pub/telemetry", "esp32/pub/url", "esp32/pub/status", "esp32/pub/motion" };
+    size_t index = 0;
+    measure( "PublishCoalescer acquire/commit/take", 1000000, [&coalescer, &index](){
+        const MQTTTopic& topic = sk_Topics[index++ % 4];
+        bool replaced = false;
+        PublishCoalescer::Entry* entry = coalescer.Acquire( topic, &replaced );
+        std::memset( entry->Scratch, 0x20, 128 );
+        coalescer.Commit( entry, 128, true );
+
+        MQTTTopic sent;
+        const uint8_t* payload = nullptr;
+        size_t length = 0;
+        if( coalescer.TakePending( index % 4, &sent, &payload, &length ) ){
+            s_Sink = s_Sink + length;
+        }
+    } );
+}
+
+void benchTopicRouter()
+{
+    class NullListener : public I_SubscribeViewListener
+    {
+    public:
+        void SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload ) override
+        {
+            s_Sink = s_Sink + payload.size();
+        }
+    };
+
+    // SDK のコールバックにノードを渡すので、配信はフィルタの数に依らない
+    static const int sk_FilterCount = 500;
+    TopicRouter router;
+    NullListener listener;
+    std::vector<std::string> filters;
+    std::vector<TopicRouter::Node*> nodes;
+    filters.reserve( sk_FilterCount );
+    for( int i = 0; i < sk_FilterCount; ++i ){
+        filters.push_back( "devices/" + std::to_string( i % 50 ) + "/sensor/" + std::to_string( i ) );
+        bool is_new = false;
+        nodes.push_back( router.Add( filters.back().c_str(), &listener, &is_new ) );
+    }
+
+    static const uint8_t sk_Payload[] = "{\"v\":1}";
+    size_t index = 0;
+    measure( "TopicRouter::Dispatch (500 filters)", 2000000, [&nodes, &filters, &index](){
+        size_t i = index++ % sk_FilterCount;
+        TopicRouter::Dispatch( nodes[i], filters[i], SubscribePayloadView( sk_Payload, sizeof(sk_Payload) - 1 ) );
+    } );
+
+    // 登録済みのフィルタにリスナーを足して外す (Subscribe / Unsubscribe 時の探索)
+    NullListener other;
+    measure( "TopicRouter Add+Remove (500 filters)", 500000, [&router, &filters, &other, &index](){
+        const std::string& filter = filters[index++ % sk_FilterCount];
+        bool flag = false;
+        router.Add( filter.c_str(), &other, &flag );
+        router.Remove( filter.c_str(), &other, &flag );
+    } );
+}
+
+void benchJpegScaler()
+{
+    // UXGA の JPEG は 150KB 前後
+    std::vector<uint8_t> jpeg = MakeHostJpeg( 1600, 1200, 150 * 1024 );
+
+    FrameTransform crop;
+    crop.Scale   = FrameScale::Half;
+    crop.Quality = 30;
+    crop.Crop    = { 400, 300, 800, 600 };
+    measure( "TransformJpeg UXGA half, crop 800x600", 200, [&jpeg, &crop](){
+        CameraFrameDerivative derivative = {};
+        if( TransformJpeg( jpeg.data(), jpeg.size(), crop, &derivative ) ){
+            s_Sink = s_Sink + derivative.Length;
+            std::free( derivative.Buffer );
+        }
+    } );
+
+    measure( "ScaleJpeg UXGA eighth", 500, [&jpeg](){
+        CameraFrameDerivative derivative = {};
+        if( ScaleJpeg( jpeg.data(), jpeg.size(), FrameScale::Eighth, 0, &derivative ) ){
+            s_Sink = s_Sink + derivative.Length;
+            std::free( derivative.Buffer );
+        }
+    } );
+
+    std::vector<uint8_t> luma( 200 * 150 );
+    measure( "ExtractLumaMap UXGA", 500, [&jpeg, &luma](){
+        uint16_t width = 0;
+        uint16_t height = 0;
+        if( ExtractLumaMap( jpeg.data(), jpeg.size(), luma.data(), luma.size(), &width, &height ) ){
+            s_Sink = s_Sink + width;
+        }
+    } );
+}
+
+}
+
+int main( int argc, char** argv )
+{
+    if( argc > 1 && std::strcmp( argv[1], "--quick" ) == 0 ){
+        s_Divisor = 100;
+    }
+
+    benchButtonDebouncer();
+    benchHTTPResponseParser();
+    benchPublishRingBuffer();
+    benchPublishCoalescer();
+    benchTopicRouter();
+    benchJpegScaler();
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef     HOST_JPEG_HPP_INCLUDED
+#define     HOST_JPEG_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//
+// ホストの esp_jpg_decode() が読む画像
+//
+// "HJ" + 幅 + 高さ (16bit little endian) の後ろは読み飛ばすだけのデータ。
+// 画素はデコード時に座標から作る (R = x, G = y, B = x ^ y の下位 8bit)。
+//
+static constexpr size_t sk_HostJpegHeaderSize = 6;
+
+std::vector<uint8_t> MakeHostJpeg( uint16_t width, uint16_t height, size_t length );
+bool ReadHostJpegHeader( const uint8_t* data, size_t length, uint16_t* width, uint16_t* height );
+
+#endif    // HOST_JPEG_HPP_INCLUDED
@@ -0,0 +1,175 @@
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+#include "img_converters.h"
+
+#include "HostJpeg.hpp"
+
+namespace {
+
+// 4:2:0 の MCU は 16x16
+const uint16_t sk_McuSize = 16;
+
+TickType_t tickCount()
+{
+    using namespace std::chrono;
+    return static_cast<TickType_t>(duration_cast<milliseconds>( steady_clock::now().time_since_epoch() ).count());
+}
+
+}
+
+//
+// FreeRTOS
+//
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new std::timed_mutex();
+}
+
+BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t wait )
+{
+    std::timed_mutex* mutex = reinterpret_cast<std::timed_mutex*>(semaphore);
+    if( wait == portMAX_DELAY ){
+        mutex->lock();
+        return pdTRUE;
+    }
+    return mutex->try_lock_for( std::chrono::milliseconds( wait * portTICK_PERIOD_MS ) ) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore )
+{
+    reinterpret_cast<std::timed_mutex*>(semaphore)->unlock();
+    return pdTRUE;
+}
+
+TickType_t xTaskGetTickCount()
+{
+    return tickCount();
+}
+
+void vTaskDelay( TickType_t ticks )
+{
+    std::this_thread::sleep_for( std::chrono::milliseconds( ticks * portTICK_PERIOD_MS ) );
+}
+
+//
+// heap_caps
+//
+
+void* heap_caps_malloc( size_t size, uint32_t caps )
+{
+    return std::malloc( size );
+}
+
+void heap_caps_free( void* ptr )
+{
+    std::free( ptr );
+}
+
+//
+// JPEG
+//
+
+std::vector<uint8_t> MakeHostJpeg( uint16_t width, uint16_t height, size_t length )
+{
+    if( length < sk_HostJpegHeaderSize ){
+        length = sk_HostJpegHeaderSize;
+    }
+    std::vector<uint8_t> data( length, 0xA5 );
+    data[0] = 'H';
+    data[1] = 'J';
+    data[2] = static_cast<uint8_t>(width);
+    data[3] = static_cast<uint8_t>(width >> 8);
+    data[4] = static_cast<uint8_t>(height);
+    data[5] = static_cast<uint8_t>(height >> 8);
+    return data;
+}
+
+bool ReadHostJpegHeader( const uint8_t* data, size_t length, uint16_t* width, uint16_t* height )
+{
+    if( length < sk_HostJpegHeaderSize || data[0] != 'H' || data[1] != 'J' ){
+        return false;
+    }
+    *width  = static_cast<uint16_t>(data[2] | (data[3] << 8));
+    *height = static_cast<uint16_t>(data[4] | (data[5] << 8));
+    return true;
+}
+
+esp_err_t esp_jpg_decode( size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void* arg )
+{
+    uint8_t header[sk_HostJpegHeaderSize];
+    if( reader( arg, 0, header, sizeof(header) ) != sizeof(header) ){
+        return ESP_FAIL;
+    }
+    uint16_t width = 0;
+    uint16_t height = 0;
+    if( !ReadHostJpegHeader( header, sizeof(header), &width, &height ) ){
+        return ESP_FAIL;
+    }
+    // 本物と同じく、圧縮データは全て読む
+    if( len > sizeof(header) && reader( arg, sizeof(header), nullptr, len - sizeof(header) ) != len - sizeof(header) ){
+        return ESP_FAIL;
+    }
+
+    uint8_t shift = static_cast<uint8_t>(scale);
+    uint16_t out_width  = width >> shift;
+    uint16_t out_height = height >> shift;
+    uint16_t block = sk_McuSize >> shift;
+
+    // 本物のデコーダも開始時の戻り値は見ない
+    writer( arg, 0, 0, out_width, out_height, nullptr );
+
+    uint8_t data[sk_McuSize * sk_McuSize * 3];
+    for( uint16_t y = 0; y < out_height; y += block ){
+        for( uint16_t x = 0; x < out_width; x += block ){
+            uint16_t w = (x + block > out_width) ? out_width - x : block;
+            uint16_t h = (y + block > out_height) ? out_height - y : block;
+            uint8_t* p = data;
+            for( uint16_t row = 0; row < h; ++row ){
+                for( uint16_t col = 0; col < w; ++col ){
+                    uint32_t sx = static_cast<uint32_t>(x + col) << shift;
+                    uint32_t sy = static_cast<uint32_t>(y + row) << shift;
+                    *p++ = static_cast<uint8_t>(sx);
+                    *p++ = static_cast<uint8_t>(sy);
+                    *p++ = static_cast<uint8_t>(sx ^ sy);
+                }
+            }
+            if( !writer( arg, x, y, w, h, data ) ){
+                return ESP_FAIL;
+            }
+        }
+    }
+
+    writer( arg, out_width, out_height, 0, 0, nullptr );
+    return ESP_OK;
+}
+
+bool fmt2jpg( uint8_t* src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality,
+              uint8_t** out, size_t* out_len )
+{
+    if( src == nullptr || format != PIXFORMAT_RGB888 || src_len != static_cast<size_t>(width) * height * 3 ){
+        return false;
+    }
+
+    std::vector<uint8_t> header = MakeHostJpeg( width, height, sk_HostJpegHeaderSize );
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(std::malloc( header.size() + src_len ));
+    if( buffer == nullptr ){
+        return false;
+    }
+    std::memcpy( buffer, header.data(), header.size() );
+    std::memcpy( buffer + header.size(), src, src_len );
+
+    *out     = buffer;
+    *out_len = header.size() + src_len;
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef     HOST_AWS_IOT_MQTT_CLIENT_INTERFACE_H_INCLUDED
+#define     HOST_AWS_IOT_MQTT_CLIENT_INTERFACE_H_INCLUDED
+
+// PublishRingBuffer が使う QoS だけ
+typedef enum {
+    QOS0 = 0,
+    QOS1 = 1,
+} QoS;
+
+#endif    // HOST_AWS_IOT_MQTT_CLIENT_INTERFACE_H_INCLUDED
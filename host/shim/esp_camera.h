@@ -0,0 +1,42 @@
+#ifndef     HOST_ESP_CAMERA_H_INCLUDED
+#define     HOST_ESP_CAMERA_H_INCLUDED
+
+//
+// Camera.hpp の宣言を読めるだけの型。ドライバは無い。
+//
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/time.h>
+
+typedef int gpio_num_t;
+typedef enum { LEDC_TIMER_0 } ledc_timer_t;
+typedef enum { LEDC_CHANNEL_0 } ledc_channel_t;
+
+typedef enum {
+    PIXFORMAT_RGB565,
+    PIXFORMAT_YUV422,
+    PIXFORMAT_GRAYSCALE,
+    PIXFORMAT_JPEG,
+    PIXFORMAT_RGB888,
+} pixformat_t;
+
+typedef enum {
+    FRAMESIZE_QVGA,
+    FRAMESIZE_VGA,
+    FRAMESIZE_SVGA,
+    FRAMESIZE_XGA,
+    FRAMESIZE_SXGA,
+    FRAMESIZE_UXGA,
+} framesize_t;
+
+typedef struct {
+    uint8_t*       buf;
+    size_t         len;
+    size_t         width;
+    size_t         height;
+    pixformat_t    format;
+    struct timeval timestamp;
+} camera_fb_t;
+
+#endif    // HOST_ESP_CAMERA_H_INCLUDED
@@ -0,0 +1,9 @@
+#ifndef     HOST_ESP_ERR_H_INCLUDED
+#define     HOST_ESP_ERR_H_INCLUDED
+
+typedef int esp_err_t;
+
+#define ESP_OK      0
+#define ESP_FAIL    -1
+
+#endif    // HOST_ESP_ERR_H_INCLUDED
@@ -0,0 +1,13 @@
+#ifndef     HOST_ESP_HEAP_CAPS_H_INCLUDED
+#define     HOST_ESP_HEAP_CAPS_H_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+
+void* heap_caps_malloc( size_t size, uint32_t caps );
+void heap_caps_free( void* ptr );
+
+#endif    // HOST_ESP_HEAP_CAPS_H_INCLUDED
@@ -0,0 +1,28 @@
+#ifndef     HOST_ESP_JPG_DECODE_H_INCLUDED
+#define     HOST_ESP_JPG_DECODE_H_INCLUDED
+
+//
+// esp_jpg_decode() の代わり
+//
+// ホストには JPEG デコーダが無いので、HostJpeg.hpp の形式の画像を「デコード」する。
+// 書き込みコールバックの呼び方 (開始時の戻り値を見ないこと、ブロックの大きさ) は本物に合わせてある。
+//
+
+#include <cstdint>
+#include <cstddef>
+
+#include "esp_err.h"
+
+typedef enum {
+    JPG_SCALE_NONE,
+    JPG_SCALE_2X,
+    JPG_SCALE_4X,
+    JPG_SCALE_8X,
+} jpg_scale_t;
+
+typedef size_t (*jpg_reader_cb)( void* arg, size_t index, uint8_t* buf, size_t len );
+typedef bool (*jpg_writer_cb)( void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data );
+
+esp_err_t esp_jpg_decode( size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void* arg );
+
+#endif    // HOST_ESP_JPG_DECODE_H_INCLUDED
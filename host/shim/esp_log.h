@@ -0,0 +1,13 @@
+#ifndef     HOST_ESP_LOG_H_INCLUDED
+#define     HOST_ESP_LOG_H_INCLUDED
+
+#include <cstdio>
+
+// 警告とエラーだけ出す
+#define ESP_LOGE( tag, format, ... )    std::fprintf( stderr, "E (%s) " format "\n", tag, ##__VA_ARGS__ )
+#define ESP_LOGW( tag, format, ... )    std::fprintf( stderr, "W (%s) " format "\n", tag, ##__VA_ARGS__ )
+#define ESP_LOGI( tag, format, ... )    ((void)(tag))
+#define ESP_LOGD( tag, format, ... )    ((void)(tag))
+#define ESP_LOGV( tag, format, ... )    ((void)(tag))
+
+#endif    // HOST_ESP_LOG_H_INCLUDED
@@ -0,0 +1,24 @@
+#ifndef     HOST_FREERTOS_H_INCLUDED
+#define     HOST_FREERTOS_H_INCLUDED
+
+//
+// ホストでビルドするための FreeRTOS の代わり
+// RTOS に依存しないモジュールが使う型とマクロだけを用意する。
+//
+
+#include <cstdint>
+#include <cstddef>
+
+typedef uint32_t TickType_t;
+typedef TickType_t portTickType;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define portTICK_PERIOD_MS  1
+#define portMAX_DELAY       0xFFFFFFFFu
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              pdTRUE
+#define pdFAIL              pdFALSE
+
+#endif    // HOST_FREERTOS_H_INCLUDED
@@ -0,0 +1,14 @@
+#ifndef     HOST_SEMPHR_H_INCLUDED
+#define     HOST_SEMPHR_H_INCLUDED
+
+#include "freertos/FreeRTOS.h"
+
+// std::timed_mutex で代用する
+typedef void* SemaphoreHandle_t;
+typedef SemaphoreHandle_t xSemaphoreHandle;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t wait );
+BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore );
+
+#endif    // HOST_SEMPHR_H_INCLUDED
@@ -0,0 +1,9 @@
+#ifndef     HOST_TASK_H_INCLUDED
+#define     HOST_TASK_H_INCLUDED
+
+#include "freertos/FreeRTOS.h"
+
+TickType_t xTaskGetTickCount();
+void vTaskDelay( TickType_t ticks );
+
+#endif    // HOST_TASK_H_INCLUDED
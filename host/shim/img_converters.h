@@ -0,0 +1,13 @@
+#ifndef     HOST_IMG_CONVERTERS_H_INCLUDED
+#define     HOST_IMG_CONVERTERS_H_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+#include "esp_camera.h"
+
+// HostJpeg.hpp の形式で書き出す。quality は使わない。
+bool fmt2jpg( uint8_t* src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality,
+              uint8_t** out, size_t* out_len );
+
+#endif    // HOST_IMG_CONVERTERS_H_INCLUDED
@@ -0,0 +1,24 @@
+#ifndef     HOST_TEST_HPP_INCLUDED
+#define     HOST_TEST_HPP_INCLUDED
+
+#include <cstdio>
+
+//
+// ホストのテストで使う最小限の確認マクロ
+// 失敗しても続けて、main() の最後に HOST_TEST_RESULT() で終了コードを返す。
+//
+
+inline int s_HostTestFailures = 0;
+
+#define HOST_CHECK( cond ) \
+    do { \
+        if( !(cond) ){ \
+            std::fprintf( stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond ); \
+            ++s_HostTestFailures; \
+        } \
+    } while( 0 )
+
+#define HOST_TEST_RESULT() \
+    ( std::printf( "%s\n", (s_HostTestFailures == 0) ? "OK" : "FAILED" ), (s_HostTestFailures == 0) ? 0 : 1 )
+
+#endif    // HOST_TEST_HPP_INCLUDED
@@ -0,0 +1,173 @@
+
+//
+// ボタンのトリガー判定を、GPIO とタイマーを模したシミュレーションで確かめる
+//
+// ButtonTrigger と同じく、エッジ割り込みで OnEdge() を呼び、ロックアウト中は割り込みを止める。
+// タイマーが切れたら OnSettled() を呼び、その時点のレベルで状態を確定する。
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "ButtonDebouncer.hpp"
+#include "HostTest.hpp"
+
+namespace {
+
+const int64_t sk_LockoutUs = 30 * 1000;
+
+class SimulatedButton
+{
+public:
+
+    // (時刻 us, レベル) の並びで GPIO の変化を与える
+    using Waveform = std::vector<std::pair<int64_t, bool>>;
+
+    explicit SimulatedButton( const Waveform& waveform )
+        : m_Waveform( waveform ),
+          m_Debouncer( true )
+    {}
+
+    // 押されたと判定した時刻を返す
+    std::vector<int64_t> Run( int64_t until_us )
+    {
+        std::vector<int64_t> triggers;
+        bool level = false;
+        bool interrupt_enabled = true;
+        int64_t timer_deadline = -1;
+        size_t next = 0;
+
+        for( int64_t now = 0; now <= until_us; ++now ){
+            while( next < m_Waveform.size() && m_Waveform[next].first == now ){
+                bool new_level = m_Waveform[next].second;
+                ++next;
+                if( new_level == level ){
+                    continue;
+                }
+                level = new_level;
+                if( !interrupt_enabled ){
+                    // 割り込みを止めている間のエッジは取りこぼす
+                    continue;
+                }
+
+                bool pressed = false;
+                if( m_Debouncer.OnEdge( level, &pressed ) ){
+                    interrupt_enabled = false;
+                    timer_deadline = now + sk_LockoutUs;
+                }
+                if( pressed ){
+                    triggers.push_back( now );
+                }
+            }
+
+            if( timer_deadline == now ){
+                bool pressed = false;
+                if( m_Debouncer.OnSettled( level, &pressed ) ){
+                    timer_deadline = now + sk_LockoutUs;
+                }
+                else {
+                    timer_deadline = -1;
+                    interrupt_enabled = true;
+                }
+                if( pressed ){
+                    triggers.push_back( now );
+                }
+            }
+        }
+        return triggers;
+    }
+
+    bool IsPressed() const
+    {
+        return m_Debouncer.IsPressed();
+    }
+
+private:
+
+    Waveform        m_Waveform;
+    ButtonDebouncer m_Debouncer;
+};
+
+// 跳ね返りながら level に落ち着く
+void bounce( SimulatedButton::Waveform* waveform, int64_t start_us, bool level, int count )
+{
+    for( int i = 0; i < count; ++i ){
+        waveform->emplace_back( start_us + i * 200, (i % 2 == 0) ? level : !level );
+    }
+    waveform->emplace_back( start_us + count * 200, level );
+}
+
+// 跳ね返りがあっても 1 回の押下は 1 回だけ、最初のエッジの時点で通知する
+void testBouncyPress()
+{
+    SimulatedButton::Waveform waveform;
+    bounce( &waveform, 1000, true, 7 );
+    bounce( &waveform, 300000, false, 7 );
+
+    SimulatedButton button( waveform );
+    std::vector<int64_t> triggers = button.Run( 500000 );
+    HOST_CHECK( triggers.size() == 1 );
+    HOST_CHECK( !triggers.empty() && triggers[0] == 1000 );
+    HOST_CHECK( !button.IsPressed() );
+}
+
+// ロックアウトより間隔が空いていれば、続けて押しても全て数える
+void testRepeatedPresses()
+{
+    SimulatedButton::Waveform waveform;
+    for( int i = 0; i < 5; ++i ){
+        int64_t start = 1000 + i * 100000;
+        bounce( &waveform, start, true, 3 );
+        bounce( &waveform, start + 50000, false, 3 );
+    }
+
+    SimulatedButton button( waveform );
+    std::vector<int64_t> triggers = button.Run( 600000 );
+    HOST_CHECK( triggers.size() == 5 );
+}
+
+// ロックアウト中に離して押し直した場合は、ロックアウトの終わりに追いついて通知する
+void testPressDuringLockout()
+{
+    SimulatedButton::Waveform waveform;
+    bounce( &waveform, 1000, true, 3 );
+    bounce( &waveform, 100000, false, 3 );
+    // 離した直後、ロックアウト中に押し直す (エッジは取りこぼす)
+    bounce( &waveform, 110000, true, 3 );
+    bounce( &waveform, 300000, false, 3 );
+
+    SimulatedButton button( waveform );
+    std::vector<int64_t> triggers = button.Run( 500000 );
+    HOST_CHECK( triggers.size() == 2 );
+    HOST_CHECK( triggers.size() == 2 && triggers[1] == 100000 + sk_LockoutUs );
+    HOST_CHECK( !button.IsPressed() );
+}
+
+// ロックアウト中に離した短い押下は 1 回だけ通知し、離した状態に戻る
+void testShortTap()
+{
+    SimulatedButton::Waveform waveform;
+    waveform.emplace_back( 1000, true );
+    waveform.emplace_back( 6000, false );
+    bounce( &waveform, 200000, true, 3 );
+    bounce( &waveform, 250000, false, 3 );
+
+    SimulatedButton button( waveform );
+    std::vector<int64_t> triggers = button.Run( 400000 );
+    HOST_CHECK( triggers.size() == 2 );
+    HOST_CHECK( !button.IsPressed() );
+}
+
+}
+
+int main()
+{
+    testBouncyPress();
+    testRepeatedPresses();
+    testPressDuringLockout();
+    testShortTap();
+
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,200 @@
+
+//
+// PublishRingBuffer の drop-oldest と、書き込みが競合した時の遅延と取りこぼし
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "PublishRingBuffer.hpp"
+#include "HostTest.hpp"
+
+namespace {
+
+void push( PublishRingBuffer& ring, uint32_t value )
+{
+    PublishRingBuffer::Slot* slot = ring.TryReserve();
+    HOST_CHECK( slot != nullptr );
+    if( slot ){
+        std::memcpy( slot->Payload, &value, sizeof(value) );
+        slot->Length = sizeof(value);
+        ring.Commit( slot );
+    }
+}
+
+uint32_t valueOf( const PublishRingBuffer::Slot* slot )
+{
+    uint32_t value = 0;
+    std::memcpy( &value, slot->Payload, sizeof(value) );
+    return value;
+}
+
+// 満杯の時に捨てるのは最も古い 1 件だけ
+void testDropOldestDropsOne()
+{
+    PublishRingBuffer ring;
+    HOST_CHECK( ring.Allocate( 4, 16 ) );
+    for( uint32_t i = 0; i < 4; ++i ){
+        push( ring, i );
+    }
+
+    std::vector<uint32_t> dropped_values;
+    bool dropped = false;
+    PublishRingBuffer::Slot* slot = ring.TryReserveDropOldest( [&dropped_values]( PublishRingBuffer::Slot* oldest ){
+        dropped_values.push_back( valueOf( oldest ) );
+    }, &dropped );
+    HOST_CHECK( slot != nullptr );
+    HOST_CHECK( dropped );
+    HOST_CHECK( dropped_values.size() == 1 && dropped_values[0] == 0 );
+
+    uint32_t value = 4;
+    std::memcpy( slot->Payload, &value, sizeof(value) );
+    slot->Length = sizeof(value);
+    ring.Commit( slot );
+
+    for( uint32_t expected = 1; expected <= 4; ++expected ){
+        PublishRingBuffer::Slot* consumed = ring.TryConsume();
+        HOST_CHECK( consumed != nullptr && valueOf( consumed ) == expected );
+        if( consumed ){
+            ring.Release( consumed );
+        }
+    }
+    HOST_CHECK( ring.TryConsume() == nullptr );
+}
+
+// 読み出し側が送信中のスロットを持っていると、1 件捨てても空かないので新しい方を諦める
+void testDropOldestWithSlotInFlight()
+{
+    PublishRingBuffer ring;
+    HOST_CHECK( ring.Allocate( 4, 16 ) );
+    for( uint32_t i = 0; i < 4; ++i ){
+        push( ring, i );
+    }
+    // 0 を送信中。返却されるまでそのスロットには書けないので、キューは満杯のまま。
+    PublishRingBuffer::Slot* in_flight = ring.TryConsume();
+    HOST_CHECK( in_flight != nullptr && valueOf( in_flight ) == 0 );
+    HOST_CHECK( ring.TryReserve() == nullptr );
+
+    size_t drop_count = 0;
+    bool dropped = false;
+    PublishRingBuffer::Slot* slot = ring.TryReserveDropOldest( [&drop_count]( PublishRingBuffer::Slot* ){
+        ++drop_count;
+    }, &dropped );
+    HOST_CHECK( slot == nullptr );
+    HOST_CHECK( dropped && drop_count == 1 );
+
+    // 捨てたのは 1 だけで、2, 3 は残っている
+    HOST_CHECK( ring.Size() == 2 );
+    ring.Release( in_flight );
+    for( uint32_t expected = 2; expected <= 3; ++expected ){
+        PublishRingBuffer::Slot* consumed = ring.TryConsume();
+        HOST_CHECK( consumed != nullptr && valueOf( consumed ) == expected );
+        if( consumed ){
+            ring.Release( consumed );
+        }
+    }
+}
+
+// 4 タスクが drop-oldest で書き込み、1 タスクが読み出す。
+// 書き込んだ数 = 読み出した数 + 捨てた数 で、Publish 1 回で捨てるのは 1 件まで。
+void testContention()
+{
+    static const int      sk_Producers = 4;
+    static const uint32_t sk_MessagesPerProducer = 50000;
+
+    PublishRingBuffer ring;
+    HOST_CHECK( ring.Allocate( 16, 16 ) );
+
+    std::atomic<bool>     running( true );
+    std::atomic<uint64_t> consumed( 0 );
+    std::atomic<uint64_t> committed( 0 );
+    std::atomic<uint64_t> dropped_oldest( 0 );
+    std::atomic<uint64_t> dropped_newest( 0 );
+    std::atomic<uint32_t> max_drops_per_call( 0 );
+
+    std::thread consumer( [&](){
+        while( running.load() || ring.Size() > 0 ){
+            PublishRingBuffer::Slot* slot = ring.TryConsume();
+            if( slot == nullptr ){
+                continue;
+            }
+            if( slot->Length != sizeof(uint32_t) ){
+                HOST_CHECK( slot->Length == sizeof(uint32_t) );
+            }
+            // 送信に掛かる時間の代わり
+            std::this_thread::yield();
+            consumed.fetch_add( 1 );
+            ring.Release( slot );
+        }
+    } );
+
+    std::vector<std::vector<double>> latencies( sk_Producers );
+    std::vector<std::thread> producers;
+    for( int p = 0; p < sk_Producers; ++p ){
+        producers.emplace_back( [&, p](){
+            latencies[p].reserve( sk_MessagesPerProducer );
+            for( uint32_t i = 0; i < sk_MessagesPerProducer; ++i ){
+                uint32_t drops = 0;
+                bool dropped = false;
+                auto begin = std::chrono::steady_clock::now();
+                PublishRingBuffer::Slot* slot = ring.TryReserveDropOldest( [&drops]( PublishRingBuffer::Slot* ){
+                    ++drops;
+                }, &dropped );
+                if( slot ){
+                    std::memcpy( slot->Payload, &i, sizeof(i) );
+                    slot->Length = sizeof(i);
+                    ring.Commit( slot );
+                }
+                auto end = std::chrono::steady_clock::now();
+                latencies[p].push_back( std::chrono::duration<double, std::micro>( end - begin ).count() );
+
+                dropped_oldest.fetch_add( drops );
+                uint32_t max = max_drops_per_call.load();
+                while( drops > max && !max_drops_per_call.compare_exchange_weak( max, drops ) ){
+                }
+                if( slot ){
+                    committed.fetch_add( 1 );
+                }
+                else {
+                    dropped_newest.fetch_add( 1 );
+                }
+            }
+        } );
+    }
+    for( std::thread& producer : producers ){
+        producer.join();
+    }
+    running.store( false );
+    consumer.join();
+
+    HOST_CHECK( committed.load() + dropped_newest.load() == static_cast<uint64_t>(sk_Producers) * sk_MessagesPerProducer );
+    HOST_CHECK( committed.load() == consumed.load() + dropped_oldest.load() );
+    HOST_CHECK( max_drops_per_call.load() <= 1 );
+
+    std::vector<double> all;
+    for( const std::vector<double>& l : latencies ){
+        all.insert( all.end(), l.begin(), l.end() );
+    }
+    std::sort( all.begin(), all.end() );
+    std::printf( "contention: committed=%llu consumed=%llu dropped_oldest=%llu dropped_newest=%llu\n",
+                 static_cast<unsigned long long>(committed.load()), static_cast<unsigned long long>(consumed.load()),
+                 static_cast<unsigned long long>(dropped_oldest.load()), static_cast<unsigned long long>(dropped_newest.load()) );
+    std::printf( "enqueue latency: p50=%.2fus p99=%.2fus max=%.2fus\n",
+                 all[all.size() / 2], all[all.size() * 99 / 100], all.back() );
+}
+
+}
+
+int main()
+{
+    testDropOldestDropsOne();
+    testDropOldestWithSlotInFlight();
+    testContention();
+
+    return HOST_TEST_RESULT();
+}
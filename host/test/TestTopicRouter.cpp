@@ -0,0 +1,142 @@
+
+//
+// TopicRouter の登録、解除と、ノードを使った配信
+//
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "TopicRouter.hpp"
+#include "HostTest.hpp"
+
+namespace {
+
+class CountingListener : public I_SubscribeViewListener
+{
+public:
+
+    void SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload ) override
+    {
+        ++Count;
+        LastTopic.assign( topic.data(), topic.size() );
+    }
+
+    int         Count = 0;
+    std::string LastTopic;
+};
+
+void testValidFilter()
+{
+    HOST_CHECK( TopicRouter::IsValidFilter( "esp32/sub/url" ) );
+    HOST_CHECK( TopicRouter::IsValidFilter( "esp32/+/url" ) );
+    HOST_CHECK( TopicRouter::IsValidFilter( "esp32/#" ) );
+    HOST_CHECK( TopicRouter::IsValidFilter( "#" ) );
+    HOST_CHECK( !TopicRouter::IsValidFilter( "" ) );
+    HOST_CHECK( !TopicRouter::IsValidFilter( "esp32/#/url" ) );
+    HOST_CHECK( !TopicRouter::IsValidFilter( "esp32/sub#" ) );
+    HOST_CHECK( !TopicRouter::IsValidFilter( "esp32/s+b" ) );
+}
+
+void testAddRemove()
+{
+    TopicRouter router;
+    CountingListener first;
+    CountingListener second;
+    bool is_new = false;
+    bool is_last = false;
+
+    TopicRouter::Node* node = router.Add( "esp32/sub/url", &first, &is_new );
+    HOST_CHECK( node != nullptr && is_new );
+    HOST_CHECK( std::string( TopicRouter::FilterName( node ) ) == "esp32/sub/url" );
+
+    // 同じフィルタの 2 つ目のリスナーは SDK に登録し直さない
+    HOST_CHECK( router.Add( "esp32/sub/url", &second, &is_new ) == node && !is_new );
+    // 登録済みのリスナーは重ねない
+    HOST_CHECK( router.Add( "esp32/sub/url", &second, &is_new ) == node && !is_new );
+    HOST_CHECK( router.FilterCount() == 1 );
+
+    HOST_CHECK( TopicRouter::Dispatch( node, "esp32/sub/url", SubscribePayloadView() ) == 2 );
+    HOST_CHECK( first.Count == 1 && second.Count == 1 );
+
+    HOST_CHECK( router.Remove( "esp32/sub/url", &first, &is_last ) == node && !is_last );
+    HOST_CHECK( router.Remove( "esp32/sub/url", &first, &is_last ) == nullptr );
+    HOST_CHECK( router.Remove( "esp32/sub/url", &second, &is_last ) == node && is_last );
+    HOST_CHECK( router.FilterCount() == 0 );
+    HOST_CHECK( TopicRouter::Dispatch( node, "esp32/sub/url", SubscribePayloadView() ) == 0 );
+
+    // 解除した後もノードは残るので、SDK の登録解除まで文字列を参照できる
+    HOST_CHECK( std::string( TopicRouter::FilterName( node ) ) == "esp32/sub/url" );
+    HOST_CHECK( router.Add( "esp32/sub/url", &first, &is_new ) == node && is_new );
+
+    HOST_CHECK( router.Add( "esp32/#/url", &first, &is_new ) == nullptr );
+    HOST_CHECK( router.Add( "esp32/sub", nullptr, &is_new ) == nullptr );
+}
+
+// ワイルドカードは別のフィルタとして扱い、SDK がマッチを判定したノードのリスナーだけ呼ぶ
+void testDispatchByNode()
+{
+    TopicRouter router;
+    CountingListener exact;
+    CountingListener plus;
+    CountingListener hash;
+    bool is_new = false;
+
+    TopicRouter::Node* exact_node = router.Add( "esp32/sub/url", &exact, &is_new );
+    TopicRouter::Node* plus_node  = router.Add( "esp32/+/url", &plus, &is_new );
+    TopicRouter::Node* hash_node  = router.Add( "esp32/#", &hash, &is_new );
+    HOST_CHECK( exact_node != plus_node && plus_node != hash_node && exact_node != hash_node );
+    HOST_CHECK( router.FilterCount() == 3 );
+
+    TopicRouter::Dispatch( plus_node, "esp32/sub/url", SubscribePayloadView() );
+    HOST_CHECK( exact.Count == 0 && plus.Count == 1 && hash.Count == 0 );
+    HOST_CHECK( plus.LastTopic == "esp32/sub/url" );
+
+    HOST_CHECK( TopicRouter::Dispatch( nullptr, "esp32/sub/url", SubscribePayloadView() ) == 0 );
+}
+
+// 数百のフィルタを足しても、先に返したノードとフィルタ文字列は動かない
+void testManyFiltersKeepNodes()
+{
+    static const int sk_FilterCount = 500;
+
+    TopicRouter router;
+    CountingListener listener;
+    std::vector<std::string> filters;
+    std::vector<TopicRouter::Node*> nodes;
+    std::vector<const char*> names;
+    filters.reserve( sk_FilterCount );
+
+    for( int i = 0; i < sk_FilterCount; ++i ){
+        filters.push_back( "devices/" + std::to_string( i % 50 ) + "/sensor/" + std::to_string( i ) );
+        bool is_new = false;
+        TopicRouter::Node* node = router.Add( filters.back().c_str(), &listener, &is_new );
+        HOST_CHECK( node != nullptr && is_new );
+        nodes.push_back( node );
+        names.push_back( TopicRouter::FilterName( node ) );
+    }
+    HOST_CHECK( router.FilterCount() == static_cast<size_t>(sk_FilterCount) );
+
+    for( int i = 0; i < sk_FilterCount; ++i ){
+        HOST_CHECK( TopicRouter::FilterName( nodes[i] ) == names[i] );
+        HOST_CHECK( filters[i] == names[i] );
+
+        bool is_new = true;
+        HOST_CHECK( router.Add( filters[i].c_str(), &listener, &is_new ) == nodes[i] && !is_new );
+    }
+
+    TopicRouter::Dispatch( nodes[123], filters[123], SubscribePayloadView() );
+    HOST_CHECK( listener.Count == 1 && listener.LastTopic == filters[123] );
+}
+
+}
+
+int main()
+{
+    testValidFilter();
+    testAddRemove();
+    testDispatchByNode();
+    testManyFiltersKeepNodes();
+
+    return HOST_TEST_RESULT();
+}
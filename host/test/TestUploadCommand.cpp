@@ -0,0 +1,133 @@
+
+//
+// UploadCommandParser の旧形式、JSON、CBOR と、変換の制限
+//
+
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "UploadCommand.hpp"
+#include "HostTest.hpp"
+
+namespace {
+
+bool parse( const std::vector<uint8_t>& data, UploadCommand* command )
+{
+    return UploadCommandParser::Parse( SubscribePayloadView( data.data(), data.size() ), command );
+}
+
+// 結果はペイロードを指すので、文字列リテラルをそのまま渡す
+bool parse( const char* text, UploadCommand* command )
+{
+    return UploadCommandParser::Parse( SubscribePayloadView( reinterpret_cast<const uint8_t*>(text), strlen( text ) ), command );
+}
+
+void testLegacy()
+{
+    UploadCommand command;
+
+    HOST_CHECK( parse( "a.jpg/host.com/dir/key.jpg?X-Amz=a%2Fb", &command ) );
+    HOST_CHECK( command.Version == 0 && command.FileName == "a.jpg" && command.Host == "host.com" );
+    HOST_CHECK( command.UrlCount == 1 && command.Urls[0] == "dir/key.jpg?X-Amz=a%2Fb" );
+    HOST_CHECK( command.Transform.Scale == FrameScale::Full && command.PreCount == 0 );
+
+    HOST_CHECK( parse( "a.jpg/host.com/k1 k2/;quarter,pre=1", &command ) );
+    HOST_CHECK( command.UrlCount == 2 && command.Urls[0] == "k1" && command.Urls[1] == "k2" );
+    HOST_CHECK( command.Transform.Scale == FrameScale::Quarter && command.PreCount == 1 );
+
+    // "/;" が無ければオプションではなく URL の一部
+    HOST_CHECK( parse( "a.jpg/host.com/dir/half", &command ) );
+    HOST_CHECK( command.UrlCount == 1 && command.Urls[0] == "dir/half" );
+    HOST_CHECK( command.Transform.Scale == FrameScale::Full );
+
+    HOST_CHECK( parse( "a.jpg/host.com/k1 k2/quarter,pre=1", &command ) );
+    HOST_CHECK( command.UrlCount == 2 && command.Urls[1] == "k2/quarter,pre=1" && command.PreCount == 0 );
+
+    HOST_CHECK( !parse( "a.jpg/host.com/k/;bogus", &command ) );
+    HOST_CHECK( !parse( "a.jpg/host.com", &command ) );
+}
+
+void testJson()
+{
+    UploadCommand command;
+
+    HOST_CHECK( parse( R"( {"v":1,"id":"r-1","host":"h.com","urls":["/d/k?a=1/2","k2"],"size":"half","quality":30,)"
+                       R"("crop":[10,20,300,200],"pre":1,"extra":{"a":[1,{"b":"}"}]},"z":null} )", &command ) );
+    HOST_CHECK( command.Version == 1 && command.RequestId == "r-1" && command.Host == "h.com" );
+    HOST_CHECK( command.UrlCount == 2 && command.Urls[0] == "d/k?a=1/2" && command.Urls[1] == "k2" );
+    HOST_CHECK( command.Transform.Scale == FrameScale::Half && command.Transform.Quality == 30 );
+    HOST_CHECK( command.Transform.Crop.X == 10 && command.Transform.Crop.Y == 20 );
+    HOST_CHECK( command.Transform.Crop.Width == 300 && command.Transform.Crop.Height == 200 );
+    HOST_CHECK( command.PreCount == 1 );
+
+    HOST_CHECK( parse( R"({"v":1,"host":"h","url":"k"})", &command ) );
+    HOST_CHECK( command.UrlCount == 1 && command.Urls[0] == "k" );
+
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k\"x"})", &command ) );
+    HOST_CHECK( !parse( R"({"v":2,"host":"h","url":"k"})", &command ) );
+    HOST_CHECK( !parse( R"({"host":"h","url":"k"})", &command ) );
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k",})", &command ) );
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k"}x)", &command ) );
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k","crop":[1,2,3]})", &command ) );
+}
+
+void testCbor()
+{
+    UploadCommand command;
+
+    // {"v":1,"id":"r","host":"h","urls":["k1","k2"],"size":"eighth","crop":[0,0,800,600],"x":[1,{"a":h'00'}]}
+    std::vector<uint8_t> data = {
+        0xA7, 0x61, 'v', 0x01, 0x62, 'i', 'd', 0x61, 'r', 0x64, 'h', 'o', 's', 't', 0x61, 'h',
+        0x64, 'u', 'r', 'l', 's', 0x82, 0x62, 'k', '1', 0x62, 'k', '2',
+        0x64, 's', 'i', 'z', 'e', 0x66, 'e', 'i', 'g', 'h', 't', 'h',
+        0x64, 'c', 'r', 'o', 'p', 0x84, 0x00, 0x00, 0x19, 0x03, 0x20, 0x19, 0x02, 0x58,
+        0x61, 'x', 0x82, 0x01, 0xA1, 0x61, 'a', 0x41, 0x00 };
+    HOST_CHECK( parse( data, &command ) );
+    HOST_CHECK( command.Version == 1 && command.RequestId == "r" && command.Host == "h" );
+    HOST_CHECK( command.UrlCount == 2 && command.Urls[0] == "k1" && command.Urls[1] == "k2" );
+    HOST_CHECK( command.Transform.Scale == FrameScale::Eighth );
+    HOST_CHECK( command.Transform.Crop.Width == 800 && command.Transform.Crop.Height == 600 );
+
+    std::vector<uint8_t> truncated( data.begin(), data.end() - 1 );
+    HOST_CHECK( !parse( truncated, &command ) );
+
+    // 長さ不定の map と array
+    std::vector<uint8_t> indefinite = {
+        0xBF, 0x61, 'v', 0x01, 0x64, 'h', 'o', 's', 't', 0x61, 'h', 0x63, 'u', 'r', 'l', 0x61, 'k',
+        0x64, 's', 'i', 'z', 'e', 0x64, 'h', 'a', 'l', 'f', 0x61, 'y', 0x9F, 0xF5, 0xFF,
+        0x67, 'q', 'u', 'a', 'l', 'i', 't', 'y', 0x18, 50, 0xFF };
+    HOST_CHECK( parse( indefinite, &command ) );
+    HOST_CHECK( command.UrlCount == 1 && command.Urls[0] == "k" && command.Transform.Quality == 50 );
+
+    std::vector<uint8_t> bad_length = { 0xA1, 0x61, 'v', 0x9B, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    HOST_CHECK( !parse( bad_length, &command ) );
+}
+
+// 縮小しない変換は sk_MaxTransformPixels 以下の切り出しが必要で、切り出しは撮影する画像の中に残ること
+void testTransformLimits()
+{
+    UploadCommand command;
+
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k","quality":10})", &command ) );
+    HOST_CHECK( parse( R"({"v":1,"host":"h","url":"k","size":"half","quality":10})", &command ) );
+    HOST_CHECK( parse( R"({"v":1,"host":"h","url":"k","crop":[0,0,640,480]})", &command ) );
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k","crop":[0,0,1600,1200]})", &command ) );
+
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k","size":"half","crop":[1600,0,10,10]})", &command ) );
+    HOST_CHECK( !parse( R"({"v":1,"host":"h","url":"k","size":"eighth","crop":[1,1,2,2]})", &command ) );
+    HOST_CHECK( parse( R"({"v":1,"host":"h","url":"k","size":"eighth","crop":[1592,1192,8,8]})", &command ) );
+}
+
+}
+
+int main()
+{
+    testLegacy();
+    testJson();
+    testCbor();
+    testTransformLimits();
+
+    return HOST_TEST_RESULT();
+}
@@ -1,11 +1,11 @@
 
 #include "Tasks.hpp"
 
-#include <sstream>
-
 #include "sdkconfig.h"
 #include "AWS_IotClientWrapper.hpp"
 #include "SubscribeURLListener.hpp"
+#include "TelemetryPublisher.hpp"
+#include "TelemetryWriter.hpp"
 
 #if defined(CONFIG_EXAMPLE_EMBEDDED_CERTS)
 extern const uint8_t aws_root_ca_pem_start[] asm("_binary_aws_root_ca_pem_start");
@@ -20,6 +20,10 @@ static char s_AWS_HostAddress[] = AWS_IOT_MQTT_HOST;
 static uint32_t s_AWS_HostPort  = AWS_IOT_MQTT_PORT;
 static SubscribeURLListener* s_SubscribeListener = nullptr;
 
+static constexpr MQTTTopic sk_TopicURL( "esp32/pub/url" );
+static constexpr MQTTTopic sk_TopicTelemetry( "esp32/pub/telemetry" );
+static constexpr TelemetryKey sk_KeyId( "id" );
+
 void Initialize_AWS_IoT( void )
 {
     AWS_IoT_ClientWrapper& instance = AWS_IoT_ClientWrapper::Instance();
@@ -32,6 +36,14 @@ void Initialize_AWS_IoT( void )
     initparam.PrivatePemKeyStart        = private_pem_key_start;
     initparam.MQTTCommandTimeoutMs      = 20000;
     initparam.TLSHandshakeTimeoutMs     = 5000;
+    initparam.PublishQueueDepth         = 16;
+    // テレメトリを 1 通にまとめるので、その分の大きさを取る
+    initparam.PublishPayloadMaxLen      = 384;
+    initparam.OverflowPolicy            = AWS_IoT_ClientWrapper::PublishOverflowPolicy::DropOldest;
+    initparam.PublishBlockTimeoutMs     = 0;
+    initparam.CoalesceTopicCount        = 4;
+    initparam.QoS1InFlightWindow        = 8;
+    initparam.QoS1MaxRetry              = 3;
 
     if( !instance.Initialize( initparam ) ){
         ESP_LOGE( AWS_IoT_ClientWrapper::sk_InfoTag, "AWS_IoT_ClientWrapper initalize failed." );
@@ -51,27 +63,58 @@ void Initialize_AWS_IoT( void )
     subparam.Topic      = "esp32/sub/url";
     subparam.QOS        = QOS0;
     subparam.Listener   = s_SubscribeListener;
-    instance.Subscribe( subparam );
+    if( !instance.Subscribe( subparam ) ){
+        ESP_LOGE( AWS_IoT_ClientWrapper::sk_InfoTag, "AWS_IoT_ClientWrapper subscribe failed." );
+        abort();
+    }
+
+#if CONFIG_TELEMETRY_INTERVAL_SEC > 0
+    // 間隔や項目は "interval=60,sample=5,metrics=heap+rssi+latency,format=cbor" で変えられる
+    // Initialize_Telemetry() で Start() するまでに届いた設定は無視される。
+    subparam.Topic      = "esp32/sub/telemetry";
+    subparam.QOS        = QOS0;
+    subparam.Listener   = &TelemetryPublisher::Instance();
+    if( !instance.Subscribe( subparam ) ){
+        ESP_LOGE( TelemetryPublisher::sk_Tag, "Subscribe telemetry config failed." );
+    }
+#endif
     ESP_LOGI( AWS_IoT_ClientWrapper::sk_InfoTag, "Subscribe complete!" );
 
+    // 以降の SDK 呼び出しは MQTT タスクだけが行う
     instance.StartEventLoop();
 }
 
 void PublishHelloWorld( void )
 {
-    AWS_IoT_ClientWrapper::PublishTopicParam publish_data;
-    
-    publish_data.Topic   = "esp32/pub/url";
-    publish_data.QOS     = QOS0;
-    
-    std::ostringstream os;
-    os << "{\"id\": \"" << CONFIG_AWS_EXAMPLE_CLIENT_ID << "\"}";
-    
-    std::string message = os.str();
-    AWS_IoT_ClientWrapper::PublishPayloadArray message_payload( message.length() );
-    std::copy( message.begin(), message.end(), message_payload.begin() );
-    publish_data.Payload = message_payload;
-
-    AWS_IoT_ClientWrapper::Instance().Publish( publish_data );
+    // 送信キューのスロットへ直接書き込む
+    AWS_IoT_ClientWrapper::Instance().PublishLatest( sk_TopicURL, []( uint8_t* buf, size_t capacity ) -> size_t {
+        TelemetryWriter writer( buf, capacity );
+        writer.BeginObject();
+        writer.Field( sk_KeyId, CONFIG_AWS_EXAMPLE_CLIENT_ID );
+        writer.EndObject();
+        return writer.PayloadLength();
+    } );
 }
 
+void Initialize_Telemetry( void )
+{
+#if CONFIG_TELEMETRY_INTERVAL_SEC > 0
+    TelemetryPublisher& telemetry = TelemetryPublisher::Instance();
+    TelemetryPublisher::Config config;
+    config.IntervalSec       = CONFIG_TELEMETRY_INTERVAL_SEC;
+    config.SampleIntervalSec = CONFIG_TELEMETRY_SAMPLE_INTERVAL_SEC;
+    config.MetricMask        = TelemetryPublisher::MetricBit( TelemetryPublisher::Metric::FreeHeap ) |
+                               TelemetryPublisher::MetricBit( TelemetryPublisher::Metric::WifiRssi ) |
+                               TelemetryPublisher::MetricBit( TelemetryPublisher::Metric::JobQueue ) |
+                               TelemetryPublisher::MetricBit( TelemetryPublisher::Metric::PublishQueue ) |
+                               TelemetryPublisher::MetricBit( TelemetryPublisher::Metric::UploadMs ) |
+                               TelemetryPublisher::MetricBit( TelemetryPublisher::Metric::Reconnects );
+    config.PayloadFormat     = TelemetryWriter::Format::JSON;
+    config.Topic             = sk_TopicTelemetry;
+    config.ClientId          = CONFIG_AWS_EXAMPLE_CLIENT_ID;
+    if( !telemetry.Start( config ) ){
+        ESP_LOGE( TelemetryPublisher::sk_Tag, "Start telemetry failed." );
+        return;
+    }
+#endif
+}
@@ -4,6 +4,7 @@
 
 void Initialize_AWS_IoT( void );
 void PublishHelloWorld( void );
+void Initialize_Telemetry( void );
 
 
 #endif    // I_TASKS_HPP_INCLUDED
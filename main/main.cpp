@@ -27,13 +27,20 @@
 #include "nvs_flash.h"
 
 #include "Camera.hpp"
+#include "CaptureCoordinator.hpp"
+#include "MotionDetector.hpp"
+#include "FrameHistory.hpp"
 #include "HTTPServer.hpp"
+#include "JobExecutor.hpp"
+#include "TriggerQueue.hpp"
+#include "ButtonTrigger.hpp"
 #include "Tasks.hpp"
 
 //
 // static variables
 //
 static const gpio_num_t sk_Button_IONum = GPIO_NUM_34;
+static const uint32_t sk_ButtonDebounceMs = 30;
 static const char WifiLogInfoTag[] = "Wifi";
 static const char AppInfoTag[] = "App";
 
@@ -45,8 +52,6 @@ static const uint8_t sk_DNS_Server[] = { 192, 168, 24, 1};
 static esp_netif_t* s_NetIf = NULL;
 static EventGroupHandle_t s_WifiEventGroup;
 static uint8_t m_BaseMacAddr[6] = {0};
-static int s_ButtonPressedDown = 0;
-static int s_ButtonTrigger = 0;
 
 static httpd_handle_t s_WebServerHandle;
 
@@ -63,7 +68,15 @@ const int DISCONNECTED_BIT = BIT1;
 static void Initialize_App( void );
 static void Initialize_Wifi( void );
 static void WifiEventHandler( void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data );
+static void Initialize_JobExecutor( void );
 static void Initialize_AWS_IoTClient( void );
+static void Initialize_FrameHistory( void );
+static void Initialize_Trigger( void );
+static void Initialize_MotionDetector( void );
+static void TriggerHandler( void* arg, const TriggerQueue::Trigger& trigger );
+#if defined(CONFIG_MOTION_DETECTION)
+static void MotionHandler( void* arg, const MotionDetector::MotionEvent& event );
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -89,41 +102,20 @@ void app_main(void)
 
     Initialize_App();
     Initialize_Wifi();
+    Initialize_JobExecutor();
     Initialize_AWS_IoTClient();
 
     if( !Camera::Initialize() ){
         ESP_LOGE( Camera::sk_CameraTag, "Initialize camera failed." );
     }
     s_WebServerHandle = StartWebServer();
+    Initialize_FrameHistory();
+    Initialize_Trigger();
+    Initialize_MotionDetector();
+    Initialize_Telemetry();
 
-    /* Wait for WiFI to show as connected */
-    xEventGroupWaitBits( s_WifiEventGroup, CONNECTED_BIT, false, true, portMAX_DELAY );
-
-    TickType_t last_wake_time = xTaskGetTickCount();
-    while( 1 )
-    {
-        if( gpio_get_level(sk_Button_IONum) && !s_ButtonPressedDown ){
-            s_ButtonPressedDown = true;
-            s_ButtonTrigger = false;
-        }
-        if( !gpio_get_level(sk_Button_IONum) && s_ButtonPressedDown ){
-            s_ButtonPressedDown = false;
-            s_ButtonTrigger = true;
-        }
-        if( s_ButtonTrigger ){
-            Camera::Instance().Capture();
-            PublishHelloWorld();
-            s_ButtonTrigger = false;
-        }
-
-        vTaskDelayUntil( &last_wake_time, 10 / portTICK_PERIOD_MS );
-    }
-    
-    StopWebServer( s_WebServerHandle );
-    
-    printf("Restarting now.\n");
-    fflush(stdout);
-    esp_restart();
+    // 以降はボタンの割り込みと各タスクが動くので、メインタスクは終了してよい
+    ESP_LOGI( AppInfoTag, "Initialized. Free heap: %u", static_cast<unsigned>(esp_get_free_heap_size()) );
 }
 
 #ifdef __cplusplus
@@ -140,20 +132,6 @@ static void Initialize_App( void )
     }
     ESP_ERROR_CHECK( err );
 
-    gpio_config_t io_conf;
-    //disable interrupt
-    io_conf.intr_type = (gpio_int_type_t)(GPIO_PIN_INTR_DISABLE);
-    //set as input mode
-    io_conf.mode = GPIO_MODE_INPUT;
-    //bit mask of the pins that you want to set
-    io_conf.pin_bit_mask = (1ULL << sk_Button_IONum);
-    //disable pull-down mode
-    io_conf.pull_down_en = (gpio_pulldown_t)(0);
-    //disable pull-up mode
-    io_conf.pull_up_en = (gpio_pullup_t)(0);
-    //configure GPIO with the given settings
-    gpio_config(&io_conf);
-
     esp_err_t ret = ESP_OK;
     esp_efuse_mac_get_default( m_BaseMacAddr );
 
@@ -249,7 +227,102 @@ static void WifiEventHandler( void* arg, esp_event_base_t event_base, int32_t ev
     }
 }
 
+static void Initialize_JobExecutor( void )
+{
+    JobExecutor::Config config;
+    config.WorkerCount  = 1;
+    // WiFi / lwIP は PRO CPU(core 0) で動くので、重い処理は APP CPU に寄せる
+    config.CoreId       = 1;
+    config.StackSize    = 1024 * 8;
+    config.TaskPriority = tskIDLE_PRIORITY + 5;
+    config.QueueDepth   = 4;
+
+    if( !JobExecutor::Initialize( config ) ){
+        ESP_LOGE( AppInfoTag, "Initialize job executor failed." );
+        abort();
+    }
+}
+
 static void Initialize_AWS_IoTClient( void )
 {
     Initialize_AWS_IoT();
 }
+
+static void Initialize_FrameHistory( void )
+{
+#if CONFIG_FRAME_HISTORY_SIZE_KB > 0
+    FrameHistory::Config config;
+    config.CapacityBytes = CONFIG_FRAME_HISTORY_SIZE_KB * 1024;
+    config.MaxFrames     = 64;
+    config.IntervalMs    = CONFIG_FRAME_HISTORY_INTERVAL_MS;
+
+    if( !FrameHistory::Instance().Start( config ) ){
+        ESP_LOGE( AppInfoTag, "Start frame history failed." );
+    }
+#endif
+}
+
+static void Initialize_Trigger( void )
+{
+    TriggerQueue::Config config;
+    config.QueueDepth   = 4;
+    config.StackSize    = 1024 * 4;
+    config.TaskPriority = tskIDLE_PRIORITY + 6;
+    config.CoreId       = 1;
+    config.Handler      = TriggerHandler;
+    config.HandlerArg   = nullptr;
+
+    if( !TriggerQueue::Initialize( config ) ){
+        ESP_LOGE( AppInfoTag, "Initialize trigger queue failed." );
+        abort();
+    }
+
+    ButtonTrigger::Config button;
+    button.Pin         = sk_Button_IONum;
+    button.ActiveLevel = true;
+    button.DebounceMs  = sk_ButtonDebounceMs;
+
+    if( !ButtonTrigger::Instance().Start( button ) ){
+        ESP_LOGE( AppInfoTag, "Start button trigger failed." );
+    }
+}
+
+static void TriggerHandler( void* arg, const TriggerQueue::Trigger& trigger )
+{
+    // きっかけの時点のフレームを履歴に残し、そこまでをイベントとして区切る
+    CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( 0 );
+    if( !fb.IsValid() || !FrameHistory::Instance().Record( fb ) ){
+        ESP_LOGW( AppInfoTag, "Trigger frame was not recorded." );
+    }
+    fb.Release();
+
+    uint32_t sequence = FrameHistory::Instance().MarkEvent();
+    ESP_LOGI( AppInfoTag, "Trigger event at frame %u.", static_cast<unsigned>(sequence) );
+    PublishHelloWorld();
+}
+
+static void Initialize_MotionDetector( void )
+{
+#if defined(CONFIG_MOTION_DETECTION)
+    MotionDetector::Config config;
+    config.PixelThreshold  = 24;
+    config.TriggerPermille = CONFIG_MOTION_TRIGGER_PERMILLE;
+    config.LearningShift   = 4;
+    config.WarmupFrames    = 16;
+    config.CooldownMs      = CONFIG_MOTION_COOLDOWN_MS;
+    config.Handler         = MotionHandler;
+    config.HandlerArg      = nullptr;
+
+    if( !MotionDetector::Instance().Start( config ) ){
+        ESP_LOGE( AppInfoTag, "Start motion detector failed." );
+    }
+#endif
+}
+
+#if defined(CONFIG_MOTION_DETECTION)
+static void MotionHandler( void* arg, const MotionDetector::MotionEvent& event )
+{
+    // 検知タスクを止めないよう、ボタンと同じキューで処理する
+    TriggerQueue::Instance().Post( TriggerQueue::Source::Motion );
+}
+#endif
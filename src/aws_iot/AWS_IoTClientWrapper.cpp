@@ -1,13 +1,18 @@
 
 #include "AWS_IoTClientWrapper.hpp"
+#include "Metrics.hpp"
 
 #include <cstring>
+#include <algorithm>
+#include <new>
 
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "esp_log.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ssl.h"
 
 #include "aws_iot_config.h"
 #include "aws_iot_log.h"
@@ -18,16 +23,37 @@ AWS_IoT_ClientWrapper::AWS_IoT_ClientWrapper()
     : m_Initialized( false ),
       m_Connected( false ),
       m_NeedToRunTask( false ),
-      m_PublishDataQueue()
+      m_Router(),
+      m_WakeupSocket( -1 ),
+      m_WakeupPort( 0 ),
+      m_WakeupPending( false ),
+      m_PublishRing(),
+      m_OverflowPolicy( PublishOverflowPolicy::DropOldest ),
+      m_PublishBlockTimeout( 0 ),
+      m_Coalescer(),
+      m_SentCount( 0 ),
+      m_FailedCount( 0 ),
+      m_CoalescedCount( 0 ),
+      m_DroppedCount( 0 ),
+      m_DisconnectCount( 0 ),
+      m_InFlightWindow( 0 ),
+      m_MaxRetry( 0 ),
+      m_InFlightCount( 0 ),
+      m_Retry()
 {
-    m_TaskMutex  = xSemaphoreCreateMutex();
-    m_QueueMutex = xSemaphoreCreateMutex();
+    m_TaskMutex   = xSemaphoreCreateMutex();
+    m_RouterMutex = xSemaphoreCreateMutex();
+    m_SubscribeQueue = xQueueCreate( sk_SubscribeQueueDepth, sizeof(SubscribeRequest) );
 
     xTaskCreate( AWS_IoTTask, "AWS_IoTTask", sk_TaskStackSize, this, sk_TaskPriority, &m_TaskHandle );
 }
 
 AWS_IoT_ClientWrapper::~AWS_IoT_ClientWrapper()
-{}
+{
+    if( m_WakeupSocket >= 0 ){
+        close( m_WakeupSocket );
+    }
+}
 
 AWS_IoT_ClientWrapper& AWS_IoT_ClientWrapper::Instance()
 {
@@ -43,6 +69,28 @@ bool AWS_IoT_ClientWrapper::Initialize( const ClientInitParam& param )
         return false;
     }
 
+    if( !instance.m_PublishRing.Allocate( param.PublishQueueDepth, param.PublishPayloadMaxLen ) ){
+        ESP_LOGE( sk_InfoTag, "Failed to allocate publish queue. depth=%u payload=%u", param.PublishQueueDepth, param.PublishPayloadMaxLen );
+        return false;
+    }
+    if( param.CoalesceTopicCount > 0 &&
+        !instance.m_Coalescer.Allocate( param.CoalesceTopicCount, param.PublishPayloadMaxLen ) ){
+        ESP_LOGE( sk_InfoTag, "Failed to allocate coalescing table. topics=%u", param.CoalesceTopicCount );
+        return false;
+    }
+    instance.m_Retry.Payload.reset( new (std::nothrow) uint8_t[param.PublishPayloadMaxLen] );
+    if( !instance.m_Retry.Payload ){
+        ESP_LOGE( sk_InfoTag, "Failed to allocate retry buffer. payload=%u", param.PublishPayloadMaxLen );
+        return false;
+    }
+    if( !instance.openWakeupSocket() ){
+        return false;
+    }
+    instance.m_InFlightWindow      = param.QoS1InFlightWindow;
+    instance.m_MaxRetry            = param.QoS1MaxRetry;
+    instance.m_OverflowPolicy      = param.OverflowPolicy;
+    instance.m_PublishBlockTimeout = param.PublishBlockTimeoutMs / portTICK_PERIOD_MS;
+
     bool result = instance.initializeMQTTClient( param );
     instance.m_Initialized = result;
     instance.m_HostURL  = param.HostURL;
@@ -101,26 +149,100 @@ void AWS_IoT_ClientWrapper::StartEventLoop()
 void AWS_IoT_ClientWrapper::StopEventLoop()
 {
     runAWSIoTEventLoop( false );
+    signalWakeup();
 }
 
 bool AWS_IoT_ClientWrapper::Subscribe( const SubscribeTopicParam& param )
 {
-    IoT_Error_t rc = FAILURE;
-    
-    ESP_LOGI( sk_InfoTag, "Subscribing..." );
-    rc = aws_iot_mqtt_subscribe( &m_Client, param.Topic, std::strlen(param.Topic), param.QOS, SubscribeCallbackHandler, param.Listener );
+    bool is_new_filter = false;
+    TopicRouter::Node* node = nullptr;
 
-    if( SUCCESS != rc ) {
-        ESP_LOGE( sk_InfoTag, "Error subscribing : %d ", rc );
-        abort();
+    if( xSemaphoreTake( m_RouterMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        node = m_Router.Add( param.Topic, param.Listener, &is_new_filter );
+
+        if( xSemaphoreGive( m_RouterMutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    if( node == nullptr ){
+        ESP_LOGE( sk_InfoTag, "Invalid topic filter or router is busy." );
+        return false;
+    }
+    if( !is_new_filter ){
+        // SDK にはフィルタ単位で登録済み
+        return true;
     }
 
-    return rc == SUCCESS;
+    SubscribeRequest request;
+    request.IsSubscribe = true;
+    request.Node        = node;
+    request.QOS         = param.QOS;
+    request.Listener    = param.Listener;
+    if( !requestSubscribe( request ) ){
+        removeListener( node, param.Listener );
+        return false;
+    }
+
+    return true;
+}
+
+bool AWS_IoT_ClientWrapper::Unsubscribe( const SubscribeTopicParam& param )
+{
+    TopicRouter::Node* node = nullptr;
+    bool is_last = false;
+
+    if( xSemaphoreTake( m_RouterMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        node = m_Router.Remove( param.Topic, param.Listener, &is_last );
+
+        if( xSemaphoreGive( m_RouterMutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    if( node == nullptr ){
+        return false;
+    }
+    if( !is_last ){
+        return true;
+    }
+
+    SubscribeRequest request;
+    request.IsSubscribe = false;
+    request.Node        = node;
+    request.QOS         = param.QOS;
+    request.Listener    = param.Listener;
+
+    return requestSubscribe( request );
+}
+
+AWS_IoT_ClientWrapper::PublishResult AWS_IoT_ClientWrapper::Publish( const PublishTopicParam& txdata )
+{
+    auto writer = [&txdata]( uint8_t* buf, size_t capacity ) -> size_t {
+        size_t length = txdata.Payload.size();
+        if( length <= capacity ){
+            std::copy( txdata.Payload.begin(), txdata.Payload.end(), buf );
+        }
+        return length;
+    };
+
+    if( txdata.Coalesce && txdata.QOS == QOS0 ){
+        return PublishLatest( txdata.Topic, writer );
+    }
+    return Publish( txdata.Topic, txdata.QOS, writer, txdata.OnComplete, txdata.CompleteContext );
 }
 
-bool AWS_IoT_ClientWrapper::Publish( const PublishTopicParam& txdata )
+AWS_IoT_ClientWrapper::PublishStatistics AWS_IoT_ClientWrapper::GetPublishStatistics() const
 {
-    return queuePublishData( txdata );
+    PublishStatistics stat;
+    stat.Sent      = m_SentCount.load( std::memory_order_relaxed );
+    stat.Failed    = m_FailedCount.load( std::memory_order_relaxed );
+    stat.Coalesced = m_CoalescedCount.load( std::memory_order_relaxed );
+    stat.Dropped   = m_DroppedCount.load( std::memory_order_relaxed );
+    stat.Queued    = static_cast<uint32_t>(m_PublishRing.Size());
+    stat.Disconnects = m_DisconnectCount.load( std::memory_order_relaxed );
+
+    return stat;
 }
 
 
@@ -128,6 +250,7 @@ void AWS_IoT_ClientWrapper::DisconnectCallbackHandler( AWS_IoT_Client *client, v
 {
     ESP_LOGW( sk_InfoTag, "MQTT Disconnect" );
     IoT_Error_t rc = FAILURE;
+    Instance().m_DisconnectCount.fetch_add( 1, std::memory_order_relaxed );
 
     if( client == nullptr ) {
         return;
@@ -152,19 +275,92 @@ void AWS_IoT_ClientWrapper::SubscribeCallbackHandler(
 {
     ESP_LOGI( sk_InfoTag, "SubscribeCallbackHandler Invoked." );
 
-    if( data ){
-        I_SubscribeListener* listener = reinterpret_cast<I_SubscribeListener*>(data);
+    if( data == nullptr ){
+        return;
+    }
+    AWS_IoT_ClientWrapper& instance = Instance();
+    const TopicRouter::Node* node = reinterpret_cast<const TopicRouter::Node*>(data);
+
+    // AWS IoT SDKの受信バッファを指すビューをそのまま渡す。
+    // コールバックを抜けた後は無効になるので、保持が必要なリスナーは Retain() すること。
+    std::string_view topic( topic_name, topic_name_len );
+    SubscribePayloadView payload( reinterpret_cast<const uint8_t*>(params->payload), params->payloadLen );
 
-        // AWS IoT SDKからコールバックされる。
-        // このコールバックを抜けた後、確保した変数領域そのまま維持されるか不明なので
-        // 自前のメモリに内容をコピーしておく。
-        std::string topic_name_string( topic_name, topic_name_len );
-        uint8_t* payload_src = reinterpret_cast<uint8_t*>(params->payload);
-        std::vector<uint8_t> payload_dst( params->payloadLen );
+    // SDK はマッチした登録の数だけ同じメッセージでコールバックしてくるので、
+    // 1 回のコールバックではそのフィルタのリスナーにだけ配信する。
+    if( xSemaphoreTake( instance.m_RouterMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        TopicRouter::Dispatch( node, topic, payload );
 
-        std::copy( payload_src, payload_src + (params->payloadLen), payload_dst.begin() );
-        
-        listener->SubscribeHandler( topic_name_string, payload_dst );
+        if( xSemaphoreGive( instance.m_RouterMutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+}
+
+bool AWS_IoT_ClientWrapper::requestSubscribe( const SubscribeRequest& request )
+{
+    if( !getNeedToRunAWSIoTEventLoop() ){
+        // MQTT タスクが SDK を使っていないので、その場で実行する
+        return executeSubscribeRequest( request );
+    }
+
+    if( xQueueSend( m_SubscribeQueue, &request, 0 ) != pdTRUE ){
+        ESP_LOGE( sk_InfoTag, "Subscribe request queue is full." );
+        return false;
+    }
+    signalWakeup();
+
+    return true;
+}
+
+bool AWS_IoT_ClientWrapper::executeSubscribeRequest( const SubscribeRequest& request )
+{
+    // SDK はフィルタ文字列のポインタを保持し続けるので、ルーターが持つ文字列を渡す。
+    // 受信時にそのフィルタのリスナーだけへ探索なしで配信するよう、コールバックにはノードを渡す。
+    const char* filter = TopicRouter::FilterName( request.Node );
+    uint16_t length = static_cast<uint16_t>(std::strlen( filter ));
+    IoT_Error_t rc = FAILURE;
+
+    if( request.IsSubscribe ){
+        ESP_LOGI( sk_InfoTag, "Subscribing %s", filter );
+        rc = aws_iot_mqtt_subscribe( &m_Client, filter, length, request.QOS, SubscribeCallbackHandler, request.Node );
+        if( SUCCESS != rc ) {
+            ESP_LOGE( sk_InfoTag, "Error subscribing : %d ", rc );
+        }
+    }
+    else {
+        ESP_LOGI( sk_InfoTag, "Unsubscribing %s", filter );
+        rc = aws_iot_mqtt_unsubscribe( &m_Client, filter, length );
+        if( SUCCESS != rc ) {
+            ESP_LOGE( sk_InfoTag, "Error unsubscribing : %d ", rc );
+        }
+    }
+
+    return rc == SUCCESS;
+}
+
+void AWS_IoT_ClientWrapper::processSubscribeRequests()
+{
+    SubscribeRequest request;
+    while( xQueueReceive( m_SubscribeQueue, &request, 0 ) == pdTRUE ){
+        if( !executeSubscribeRequest( request ) && request.IsSubscribe ){
+            // 登録できなかったフィルタには配信されないので、ルーターからも外す
+            removeListener( request.Node, request.Listener );
+        }
+    }
+}
+
+void AWS_IoT_ClientWrapper::removeListener( TopicRouter::Node* node, I_SubscribeViewListener* listener )
+{
+    bool is_last = false;
+    if( xSemaphoreTake( m_RouterMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        m_Router.Remove( MQTTTopic( TopicRouter::FilterName( node ) ), listener, &is_last );
+
+        if( xSemaphoreGive( m_RouterMutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
     }
 }
 
@@ -195,9 +391,10 @@ void AWS_IoT_ClientWrapper::AWS_IoTTaskImpl( void* param )
     
     AWS_IoT_ClientWrapper* instance = reinterpret_cast<AWS_IoT_ClientWrapper*>(param);
     IoT_Error_t rc = SUCCESS;
-    PublishTopicParam txdata;
+    portTickType last_yield_tick = xTaskGetTickCount();
 
-    while((NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc || SUCCESS == rc)) {
+    // MQTT_CLIENT_NOT_IDLE_ERROR は他の SDK 呼び出しと重なっただけなので、次の周回でやり直す
+    while((NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc || SUCCESS == rc || MQTT_CLIENT_NOT_IDLE_ERROR == rc)) {
 
         bool need_running_task = instance->getNeedToRunAWSIoTEventLoop();
         if( !need_running_task ){
@@ -205,28 +402,35 @@ void AWS_IoT_ClientWrapper::AWS_IoTTaskImpl( void* param )
             break;
         }
 
-        //Max time the yield function will wait for read messages
-        rc = aws_iot_mqtt_yield( &(instance->m_Client), 100 );
-        if(NETWORK_ATTEMPTING_RECONNECT == rc) {
-            // If the client is attempting to reconnect we will skip the rest of the loop.
+        if( !aws_iot_mqtt_is_client_connected( &(instance->m_Client) ) ){
+            // 再接続処理は yield の中で行われる
+            rc = instance->yield( sk_ReconnectYieldTimeoutMs );
             continue;
         }
 
-        while( 1 ){
-            bool is_empty = true;
-            bool result = instance->isEmptyPublishDataQueue( &is_empty );
-            if( !result || is_empty ){
-                break;
-            }
-            
-            if( instance->getQueuedPublishData( &txdata ) ){
-                instance->sendPublishData( txdata );
+        // 受信データが届くか、Publish() から起こされるまで待つ。
+        // タイムアウトした場合も keepalive のために yield する。
+        uint32_t events = instance->waitForEvent( sk_EventWaitPeriodMs );
+        bool keepalive_due = (xTaskGetTickCount() - last_yield_tick) >= (sk_EventWaitPeriodMs / portTICK_PERIOD_MS);
+        if( (events & EventReadable) || keepalive_due ){
+            last_yield_tick = xTaskGetTickCount();
+
+            //Max time the yield function will wait for read messages
+            rc = instance->yield( sk_YieldTimeoutMs );
+            if(NETWORK_ATTEMPTING_RECONNECT == rc) {
+                // If the client is attempting to reconnect we will skip the rest of the loop.
+                continue;
             }
         }
 
-        vTaskDelay( sk_TaskDelayMs );
+        // SDK の呼び出しは全てこのタスクから行い、yield と重ならないようにする
+        instance->processSubscribeRequests();
+        instance->sendQueuedPublishData();
     }
     
+    // 停止後の Subscribe / Unsubscribe はその場で実行されるので、順序が入れ替わらないよう残りを片付ける
+    instance->processSubscribeRequests();
+
     ESP_LOGI( sk_InfoTag, "Stop AWS_IoTTaskImpl()" );    
 }
 
@@ -257,6 +461,118 @@ void AWS_IoT_ClientWrapper::runAWSIoTEventLoop( bool run_start_or_stop )
     }
 }
 
+bool AWS_IoT_ClientWrapper::openWakeupSocket()
+{
+    if( m_WakeupSocket >= 0 ){
+        return true;
+    }
+
+    int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( sock < 0 ){
+        ESP_LOGE( sk_InfoTag, "Failed to allocate wakeup socket. errno=%d", errno );
+        return false;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port        = 0;
+
+    socklen_t addrlen = sizeof(addr);
+    if( bind( sock, (struct sockaddr*)&addr, sizeof(addr) ) != 0 ||
+        getsockname( sock, (struct sockaddr*)&addr, &addrlen ) != 0 ){
+        ESP_LOGE( sk_InfoTag, "Failed to bind wakeup socket. errno=%d", errno );
+        close( sock );
+        return false;
+    }
+
+    fcntl( sock, F_SETFL, fcntl( sock, F_GETFL, 0 ) | O_NONBLOCK );
+
+    m_WakeupSocket = sock;
+    m_WakeupPort   = ntohs( addr.sin_port );
+    return true;
+}
+
+void AWS_IoT_ClientWrapper::signalWakeup()
+{
+    if( m_WakeupSocket < 0 ){
+        return;
+    }
+    // 既に起床要求が出ている間は送らない
+    if( m_WakeupPending.exchange( true ) ){
+        return;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port        = htons( m_WakeupPort );
+
+    const uint8_t token = 0;
+    if( sendto( m_WakeupSocket, &token, sizeof(token), 0, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ){
+        m_WakeupPending.store( false );
+    }
+}
+
+uint32_t AWS_IoT_ClientWrapper::waitForEvent( uint32_t timeout_ms )
+{
+    TLSDataParams& tls = m_Client.networkStack.tlsDataParams;
+    int mqtt_sock = tls.server_fd.fd;
+
+    // TLS 層で復号済みのデータが残っている場合はソケットを見ても分からない
+    if( mbedtls_ssl_get_bytes_avail( &tls.ssl ) > 0 ){
+        return EventReadable;
+    }
+
+    fd_set readfds;
+    FD_ZERO( &readfds );
+    int maxfd = -1;
+    if( mqtt_sock >= 0 ){
+        FD_SET( mqtt_sock, &readfds );
+        maxfd = mqtt_sock;
+    }
+    if( m_WakeupSocket >= 0 ){
+        FD_SET( m_WakeupSocket, &readfds );
+        maxfd = std::max( maxfd, m_WakeupSocket );
+    }
+    if( maxfd < 0 ){
+        vTaskDelay( timeout_ms / portTICK_PERIOD_MS );
+        return EventNone;
+    }
+
+    struct timeval tv;
+    tv.tv_sec  = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    uint32_t events = EventNone;
+    if( select( maxfd + 1, &readfds, nullptr, nullptr, &tv ) > 0 ){
+        if( mqtt_sock >= 0 && FD_ISSET( mqtt_sock, &readfds ) ){
+            events |= EventReadable;
+        }
+        if( m_WakeupSocket >= 0 && FD_ISSET( m_WakeupSocket, &readfds ) ){
+            // フラグを先に落としてから読み捨てる(取りこぼし防止)
+            m_WakeupPending.store( false );
+
+            uint8_t drain[8];
+            while( recv( m_WakeupSocket, drain, sizeof(drain), 0 ) > 0 ){}
+            events |= EventWakeup;
+        }
+    }
+
+    return events;
+}
+
+IoT_Error_t AWS_IoT_ClientWrapper::yield( uint32_t timeout_ms )
+{
+    StageTimer timer( MetricStage::MQTTYield );
+    IoT_Error_t rc = aws_iot_mqtt_yield( &m_Client, timeout_ms );
+    // 正の値は再接続中などの状態通知
+    if( rc < SUCCESS ){
+        timer.Failed();
+    }
+    return rc;
+}
+
 bool AWS_IoT_ClientWrapper::initializeMQTTClient( const ClientInitParam& param  )
 {
     if( m_Initialized ){
@@ -329,75 +645,212 @@ bool AWS_IoT_ClientWrapper::initializeMQTTConnection( const ConnectParam& param
     return rc == SUCCESS;
 }
 
-bool AWS_IoT_ClientWrapper::isEmptyPublishDataQueue( bool* is_empty_result ) const
+PublishRingBuffer::Slot* AWS_IoT_ClientWrapper::reservePublishSlot( PublishResult* result )
 {
-    if( is_empty_result == nullptr ){
-        return false;
+    if( !m_PublishRing.IsAllocated() ){
+        *result = PublishResult::NotInitialized;
+        return nullptr;
     }
 
-    bool result = false;
-    if( xSemaphoreTake( m_QueueMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
-        *is_empty_result = m_PublishDataQueue.empty();
+    *result = PublishResult::Queued;
+    PublishRingBuffer::Slot* slot = m_PublishRing.TryReserve();
+    if( slot ){
+        return slot;
+    }
 
-        if( xSemaphoreGive( m_QueueMutex ) != pdTRUE ){
-            // IT MUST BE BUG
-            abort();
+    switch( m_OverflowPolicy ){
+    case PublishOverflowPolicy::DropOldest:
+        {
+            // 1 回の Publish で捨てるのは最古の 1 件まで。
+            // MQTT タスクが送信中のスロットや他タスクとの競合で空かない場合は諦める。
+            bool dropped = false;
+            slot = m_PublishRing.TryReserveDropOldest( [this]( PublishRingBuffer::Slot* oldest ){
+                completePublish( oldest, PublishDeliveryStatus::Dropped );
+            }, &dropped );
+            if( dropped ){
+                m_DroppedCount.fetch_add( 1, std::memory_order_relaxed );
+            }
+            if( slot ){
+                *result = dropped ? PublishResult::QueuedDroppedOldest : PublishResult::Queued;
+            }
+            else {
+                *result = PublishResult::DroppedNewest;
+            }
         }
-        result = true;
+        break;
+
+    case PublishOverflowPolicy::BlockWithTimeout:
+        {
+            portTickType start = xTaskGetTickCount();
+            while( slot == nullptr ){
+                if( (xTaskGetTickCount() - start) >= m_PublishBlockTimeout ){
+                    *result = PublishResult::Timeout;
+                    break;
+                }
+                vTaskDelay( sk_PublishBlockPollPeriod );
+                slot = m_PublishRing.TryReserve();
+            }
+        }
+        break;
+
+    case PublishOverflowPolicy::DropNewest:
+    default:
+        *result = PublishResult::DroppedNewest;
+        break;
     }
 
-    return result;
+    if( slot == nullptr ){
+        m_DroppedCount.fetch_add( 1, std::memory_order_relaxed );
+        ESP_LOGW( sk_InfoTag, "Publish queue overflow. Data dropped." );
+    }
+    return slot;
 }
 
-bool AWS_IoT_ClientWrapper::queuePublishData( const PublishTopicParam& data )
+void AWS_IoT_ClientWrapper::commitPublishSlot( PublishRingBuffer::Slot* slot, const MQTTTopic& topic, QoS qos, size_t length,
+                                               PublishCompleteCallback on_complete, void* context )
 {
-    bool result = false;
-    if( xSemaphoreTake( m_QueueMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
-        m_PublishDataQueue.push( data );
+    slot->Valid  = topic.IsValid();
+    slot->Topic  = topic;
+    slot->QOS    = qos;
+    slot->Length = length;
+    slot->OnComplete      = on_complete;
+    slot->CompleteContext = context;
+
+    m_PublishRing.Commit( slot );
+    signalWakeup();
+}
 
-        if( xSemaphoreGive( m_QueueMutex ) != pdTRUE ){
-            // IT MUST BE BUG
-            abort();
+bool AWS_IoT_ClientWrapper::acquireInFlight()
+{
+    uint32_t count = m_InFlightCount.load( std::memory_order_relaxed );
+    do {
+        if( count >= m_InFlightWindow ){
+            return false;
         }
-        result = true;
+    } while( !m_InFlightCount.compare_exchange_weak( count, count + 1, std::memory_order_relaxed ) );
+
+    return true;
+}
+
+void AWS_IoT_ClientWrapper::completePublish( PublishRingBuffer::Slot* slot, PublishDeliveryStatus status )
+{
+    if( !slot->Valid ){
+        return;
     }
+    completePublish( slot->QOS, slot->OnComplete, slot->CompleteContext, status );
+}
 
-    return result;
+void AWS_IoT_ClientWrapper::completePublish( QoS qos, PublishCompleteCallback on_complete, void* context, PublishDeliveryStatus status )
+{
+    if( qos == QOS1 ){
+        m_InFlightCount.fetch_sub( 1, std::memory_order_relaxed );
+    }
+    if( on_complete ){
+        on_complete( status, context );
+    }
 }
 
-bool AWS_IoT_ClientWrapper::getQueuedPublishData( PublishTopicParam* queued_data )
+void AWS_IoT_ClientWrapper::sendQueuedPublishData()
 {
-    bool result = false;
-    if( xSemaphoreTake( m_QueueMutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
-        if( !m_PublishDataQueue.empty() ){
-            const PublishTopicParam& data = m_PublishDataQueue.front();
-            *queued_data = data;
-            m_PublishDataQueue.pop();
+    PublishRingBuffer::Slot* slot = nullptr;
+
+    // 前回 PUBACK を受け取れなかった QOS1 メッセージを先に再送する。
+    // 送信順序を保つため、再送が成功するまで後続は送らない。
+    if( m_Retry.Pending && !sendRetryEntry() ){
+        return;
+    }
 
-            result = true;
+    // スロットから直接送信し、送信後にスロットを返却する
+    while( (slot = m_PublishRing.TryConsume()) != nullptr ){
+        if( !sendPendingSlot( slot ) ){
+            return;
         }
+    }
 
-        if( xSemaphoreGive( m_QueueMutex ) != pdTRUE ){
-            // IT MUST BE BUG
-            abort();
+    // 最新値テーブル
+    MQTTTopic topic;
+    const uint8_t* payload = nullptr;
+    size_t length = 0;
+    for( size_t i = 0; i < m_Coalescer.EntryCount(); ++i ){
+        if( m_Coalescer.TakePending( i, &topic, &payload, &length ) ){
+            sendPublishData( topic, QOS0, payload, length );
         }
     }
+}
 
-    return result;
+bool AWS_IoT_ClientWrapper::sendPendingSlot( PublishRingBuffer::Slot* slot )
+{
+    if( !slot->Valid ){
+        m_PublishRing.Release( slot );
+        return true;
+    }
+
+    bool result = sendPublishData( slot->Topic, slot->QOS, slot->Payload, slot->Length );
+    if( result ){
+        completePublish( slot, slot->QOS == QOS1 ? PublishDeliveryStatus::Acknowledged : PublishDeliveryStatus::Sent );
+        m_PublishRing.Release( slot );
+        return true;
+    }
+
+    if( slot->QOS == QOS1 && m_MaxRetry > 0 ){
+        // 写しを取ってスロットは返却し、次回(再接続後)に再送する
+        RetryEntry& retry = m_Retry;
+        retry.Pending         = true;
+        retry.Topic           = slot->Topic;
+        retry.QOS             = slot->QOS;
+        retry.Length          = slot->Length;
+        retry.RetryCount      = 1;
+        retry.OnComplete      = slot->OnComplete;
+        retry.CompleteContext = slot->CompleteContext;
+        memcpy( retry.Payload.get(), slot->Payload, slot->Length );
+        m_PublishRing.Release( slot );
+        ESP_LOGW( sk_InfoTag, "QOS1 publish not acknowledged. Retry %u/%u", retry.RetryCount, m_MaxRetry );
+        return false;
+    }
+
+    completePublish( slot, PublishDeliveryStatus::Failed );
+    m_PublishRing.Release( slot );
+    return true;
+}
+
+bool AWS_IoT_ClientWrapper::sendRetryEntry()
+{
+    RetryEntry& retry = m_Retry;
+    if( sendPublishData( retry.Topic, retry.QOS, retry.Payload.get(), retry.Length ) ){
+        retry.Pending = false;
+        completePublish( retry.QOS, retry.OnComplete, retry.CompleteContext, PublishDeliveryStatus::Acknowledged );
+        return true;
+    }
+
+    if( retry.RetryCount < m_MaxRetry ){
+        ++retry.RetryCount;
+        ESP_LOGW( sk_InfoTag, "QOS1 publish not acknowledged. Retry %u/%u", retry.RetryCount, m_MaxRetry );
+        return false;
+    }
+
+    retry.Pending = false;
+    completePublish( retry.QOS, retry.OnComplete, retry.CompleteContext, PublishDeliveryStatus::Failed );
+    return true;
 }
 
-bool AWS_IoT_ClientWrapper::sendPublishData( const PublishTopicParam& txdata )
+bool AWS_IoT_ClientWrapper::sendPublishData( const MQTTTopic& topic, QoS qos, const uint8_t* payload, size_t length )
 {
     IoT_Error_t rc = FAILURE;
     IoT_Publish_Message_Params msgparam;
 
-    msgparam.qos        = txdata.QOS;
-    msgparam.payload    = (void *)txdata.Payload.data();
+    msgparam.qos        = qos;
+    msgparam.payload    = (void *)payload;
     msgparam.isRetained = 0;
-    msgparam.payloadLen = txdata.Payload.size();
+    msgparam.payloadLen = length;
 
     // ESP_LOGI(TAG, "Stack remaining for task '%s' is %d bytes", pcTaskGetTaskName(NULL), uxTaskGetStackHighWaterMark(NULL));
-    rc = aws_iot_mqtt_publish( &m_Client, txdata.Topic, std::strlen(txdata.Topic), &msgparam );
+    {
+        StageTimer timer( MetricStage::MQTTPublish );
+        rc = aws_iot_mqtt_publish( &m_Client, topic.Name, topic.Length, &msgparam );
+        if( rc != SUCCESS && !(rc == MQTT_REQUEST_TIMEOUT_ERROR && qos == QOS0) ){
+            timer.Failed();
+        }
+    }
     
     if( rc == SUCCESS ){
         ESP_LOGI( sk_InfoTag, "Publishing Data!" );
@@ -405,11 +858,17 @@ bool AWS_IoT_ClientWrapper::sendPublishData( const PublishTopicParam& txdata )
     else {
         ESP_LOGW( sk_InfoTag, "Publishing Data failed. ErrorCode(%d)", rc );
     }
-    if (rc == MQTT_REQUEST_TIMEOUT_ERROR) {
+    if (rc == MQTT_REQUEST_TIMEOUT_ERROR && qos == QOS0) {
         ESP_LOGW( sk_InfoTag, "QOS0 publish ack not received." );
         rc = SUCCESS;
     }
 
+    if( rc == SUCCESS ){
+        m_SentCount.fetch_add( 1, std::memory_order_relaxed );
+    }
+    else {
+        m_FailedCount.fetch_add( 1, std::memory_order_relaxed );
+    }
 
     return rc == SUCCESS;
 }
\ No newline at end of file
@@ -3,20 +3,46 @@
 
 #include <cstdint>
 #include <vector>
-#include <queue>
 #include <string>
+#include <atomic>
+#include <memory>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 
 #include "aws_iot_mqtt_client_interface.h"
 
 #include "I_SubscribeListener.hpp"
+#include "PublishRingBuffer.hpp"
+#include "PublishCoalescer.hpp"
+#include "MQTTTopic.hpp"
+#include "TopicRouter.hpp"
 
 class AWS_IoT_ClientWrapper
 {
 public:
 
+    // 送信キューが満杯の時の振る舞い
+    enum class PublishOverflowPolicy
+    {
+        DropOldest,         // 最も古い未送信データを捨てて格納
+        DropNewest,         // 新しいデータを捨てる
+        BlockWithTimeout,   // 空きが出るまで待つ(PublishBlockTimeoutMs まで)
+    };
+
+    enum class PublishResult
+    {
+        Queued,
+        QueuedDroppedOldest,
+        Coalesced,          // 未送信の古いデータを置き換えた
+        DroppedNewest,
+        Timeout,
+        PayloadTooLarge,
+        WindowFull,         // QOS1 の未確認メッセージ数が上限に達している
+        NotInitialized,
+    };
+
     struct ClientInitParam
     {
         char* HostURL;
@@ -26,6 +52,15 @@ public:
         const uint8_t* PrivatePemKeyStart;
         uint32_t MQTTCommandTimeoutMs;
         uint32_t TLSHandshakeTimeoutMs;
+
+        // 送信キューの設定
+        uint32_t PublishQueueDepth;
+        uint32_t PublishPayloadMaxLen;
+        PublishOverflowPolicy OverflowPolicy;
+        uint32_t PublishBlockTimeoutMs;
+        uint32_t CoalesceTopicCount;        // 最新値のみ送信するトピックの最大数
+        uint32_t QoS1InFlightWindow;        // PUBACK 未受信の QOS1 メッセージの最大数
+        uint32_t QoS1MaxRetry;              // QOS1 の再送回数上限
     };
 
     struct ConnectParam
@@ -36,17 +71,32 @@ public:
 
     struct SubscribeTopicParam 
     {
-        const char* Topic;
+        MQTTTopic Topic;
         QoS QOS;
-        I_SubscribeListener* Listener;
+        I_SubscribeViewListener* Listener;
     };
 
     using PublishPayloadArray = std::vector<uint8_t>;
     struct PublishTopicParam
     {
-        const char* Topic;
+        MQTTTopic Topic;
         QoS QOS;
         PublishPayloadArray Payload;
+        // true の場合、同じトピックの未送信データを上書きする(QOS0 のみ)
+        bool Coalesce = false;
+        // 配送結果の通知先(省略可)。Coalesce 指定時は呼ばれない。
+        PublishCompleteCallback OnComplete = nullptr;
+        void* CompleteContext = nullptr;
+    };
+
+    struct PublishStatistics
+    {
+        uint32_t Sent;
+        uint32_t Failed;
+        uint32_t Coalesced;
+        uint32_t Dropped;
+        uint32_t Queued;            // 送信待ちの数
+        uint32_t Disconnects;       // 切断を検知した回数 (再接続を試みた回数)
     };
 
     static inline constexpr char sk_InfoTag[] = "AWS_IoTWrap";
@@ -66,8 +116,27 @@ public:
 
     void StartEventLoop();
     void StopEventLoop();
+    // 同じフィルタに複数のリスナーを登録できる。
+    // イベントループの動作中は SDK の呼び出しを MQTT タスクへ依頼するので、戻り値は受け付けたかどうかになる。
+    // (yield / publish と同時に SDK を呼ぶと MQTT_CLIENT_NOT_IDLE_ERROR になるため)
+    // リスナーのハンドラ内から Subscribe / Unsubscribe を呼ばないこと。
     bool Subscribe( const SubscribeTopicParam& param );
-    bool Publish( const PublishTopicParam& txdata );
+    bool Unsubscribe( const SubscribeTopicParam& param );
+    PublishResult Publish( const PublishTopicParam& txdata );
+
+    // 送信キューのスロットへ直接ペイロードを書き込む
+    // writer は size_t( uint8_t* buf, size_t capacity ) の形で、書き込んだ長さを返す。
+    // capacity を超える値を返した場合は PayloadTooLarge として破棄される。
+    // QOS1 の場合、PUBACK を受信するか再送をあきらめた時点で on_complete が呼ばれる。
+    template <class PayloadWriter>
+    PublishResult Publish( const MQTTTopic& topic, QoS qos, PayloadWriter&& writer,
+                           PublishCompleteCallback on_complete = nullptr, void* context = nullptr );
+
+    // 同じトピックの未送信データがあれば置き換える QOS0 Publish
+    template <class PayloadWriter>
+    PublishResult PublishLatest( const MQTTTopic& topic, PayloadWriter&& writer );
+
+    PublishStatistics GetPublishStatistics() const;
 
 private:
 
@@ -75,7 +144,12 @@ private:
     ~AWS_IoT_ClientWrapper() noexcept;
 
     static const portTickType sk_TaskDelayMs = (50 / portTICK_PERIOD_MS);
+    static const portTickType sk_PublishBlockPollPeriod = 1;
+    static const uint32_t sk_EventWaitPeriodMs = 1000;     // keepalive 処理のため最低でもこの周期で yield する
+    static const uint32_t sk_YieldTimeoutMs    = 10;
+    static const uint32_t sk_ReconnectYieldTimeoutMs = 100;
     static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+    static const UBaseType_t  sk_SubscribeQueueDepth = 8;
     static const int sk_TaskStackSize = 1024 * 8;
     static const int sk_TaskPriority  = configMAX_PRIORITIES - 3;
 
@@ -87,13 +161,46 @@ private:
     bool getNeedToRunAWSIoTEventLoop();
     void runAWSIoTEventLoop( bool run_start_or_stop );
 
+    enum EventBits : uint32_t
+    {
+        EventNone     = 0,
+        EventReadable = (1 << 0),
+        EventWakeup   = (1 << 1),
+    };
+
+    bool openWakeupSocket();
+    void signalWakeup();
+    uint32_t waitForEvent( uint32_t timeout_ms );
+    // 受信処理。所要時間を Metrics に記録する
+    IoT_Error_t yield( uint32_t timeout_ms );
+
+    // MQTT タスクで実行する Subscribe / Unsubscribe
+    struct SubscribeRequest
+    {
+        bool                     IsSubscribe;
+        TopicRouter::Node*       Node;
+        QoS                      QOS;
+        I_SubscribeViewListener* Listener;
+    };
+
+    bool requestSubscribe( const SubscribeRequest& request );
+    bool executeSubscribeRequest( const SubscribeRequest& request );
+    void processSubscribeRequests();
+    void removeListener( TopicRouter::Node* node, I_SubscribeViewListener* listener );
+
     bool initializeMQTTClient( const ClientInitParam& param );
     bool initializeMQTTConnection( const ConnectParam& param );
 
-    bool isEmptyPublishDataQueue( bool* is_empty_result ) const;
-    bool queuePublishData( const PublishTopicParam& data );
-    bool getQueuedPublishData( PublishTopicParam* queued_data );
-    bool sendPublishData( const PublishTopicParam& txdata );
+    PublishRingBuffer::Slot* reservePublishSlot( PublishResult* result );
+    void commitPublishSlot( PublishRingBuffer::Slot* slot, const MQTTTopic& topic, QoS qos, size_t length,
+                            PublishCompleteCallback on_complete, void* context );
+    bool acquireInFlight();
+    void completePublish( PublishRingBuffer::Slot* slot, PublishDeliveryStatus status );
+    void completePublish( QoS qos, PublishCompleteCallback on_complete, void* context, PublishDeliveryStatus status );
+    void sendQueuedPublishData();
+    bool sendPendingSlot( PublishRingBuffer::Slot* slot );
+    bool sendRetryEntry();
+    bool sendPublishData( const MQTTTopic& topic, QoS qos, const uint8_t* payload, size_t length );
 
 
     AWS_IoT_Client   m_Client;
@@ -108,8 +215,103 @@ private:
     std::string      m_HostURL;
     uint32_t         m_HostPort;
 
-    xSemaphoreHandle m_QueueMutex;
-    std::queue<PublishTopicParam> m_PublishDataQueue;
+    // 受信トピックの振り分け
+    TopicRouter      m_Router;
+    xSemaphoreHandle m_RouterMutex;
+    QueueHandle_t    m_SubscribeQueue;
+
+    // Publish() から MQTT タスクを起こすためのループバック UDP ソケット
+    int                   m_WakeupSocket;
+    uint16_t              m_WakeupPort;
+    std::atomic<bool>     m_WakeupPending;
+
+    PublishRingBuffer     m_PublishRing;
+    PublishOverflowPolicy m_OverflowPolicy;
+    portTickType          m_PublishBlockTimeout;
+    PublishCoalescer      m_Coalescer;
+
+    std::atomic<uint32_t> m_SentCount;
+    std::atomic<uint32_t> m_FailedCount;
+    std::atomic<uint32_t> m_CoalescedCount;
+    std::atomic<uint32_t> m_DroppedCount;
+    std::atomic<uint32_t> m_DisconnectCount;
+
+    // PUBACK を受け取れなかった QOS1 メッセージの写し。
+    // リングのスロットはすぐに返却し、再送待ちの間も後続の Publish() がスロットを使えるようにする。
+    struct RetryEntry
+    {
+        bool        Pending;
+        MQTTTopic   Topic;
+        QoS         QOS;
+        size_t      Length;
+        uint32_t    RetryCount;
+        PublishCompleteCallback OnComplete;
+        void*       CompleteContext;
+        std::unique_ptr<uint8_t[]> Payload;
+    };
+
+    // QOS1
+    uint32_t                 m_InFlightWindow;
+    uint32_t                 m_MaxRetry;
+    std::atomic<uint32_t>    m_InFlightCount;
+    RetryEntry               m_Retry;               // MQTT タスクのみ参照
 };
 
+template <class PayloadWriter>
+AWS_IoT_ClientWrapper::PublishResult AWS_IoT_ClientWrapper::Publish( const MQTTTopic& topic, QoS qos, PayloadWriter&& writer,
+                                                                    PublishCompleteCallback on_complete, void* context )
+{
+    if( qos == QOS1 && !acquireInFlight() ){
+        return PublishResult::WindowFull;
+    }
+
+    PublishResult result = PublishResult::NotInitialized;
+    PublishRingBuffer::Slot* slot = reservePublishSlot( &result );
+    if( slot == nullptr ){
+        if( qos == QOS1 ){
+            m_InFlightCount.fetch_sub( 1, std::memory_order_relaxed );
+        }
+        return result;
+    }
+
+    size_t length = writer( slot->Payload, m_PublishRing.PayloadCapacity() );
+    if( length > m_PublishRing.PayloadCapacity() ){
+        // 予約したスロットは取り消せないので、無効データとして公開する
+        if( qos == QOS1 ){
+            m_InFlightCount.fetch_sub( 1, std::memory_order_relaxed );
+        }
+        commitPublishSlot( slot, MQTTTopic(), qos, 0, nullptr, nullptr );
+        return PublishResult::PayloadTooLarge;
+    }
+
+    commitPublishSlot( slot, topic, qos, length, on_complete, context );
+    return result;
+}
+
+template <class PayloadWriter>
+AWS_IoT_ClientWrapper::PublishResult AWS_IoT_ClientWrapper::PublishLatest( const MQTTTopic& topic, PayloadWriter&& writer )
+{
+    bool replaced = false;
+    PublishCoalescer::Entry* entry = m_Coalescer.Acquire( topic, &replaced );
+    if( entry == nullptr ){
+        // 最新値テーブルが使えない場合は通常の送信キューへ
+        return Publish( topic, QOS0, writer );
+    }
+
+    size_t length = writer( entry->Scratch, m_Coalescer.PayloadCapacity() );
+    if( length > m_Coalescer.PayloadCapacity() ){
+        // 前回の未送信データは残す
+        m_Coalescer.Commit( entry, 0, false );
+        return PublishResult::PayloadTooLarge;
+    }
+    m_Coalescer.Commit( entry, length, true );
+
+    if( replaced ){
+        m_CoalescedCount.fetch_add( 1, std::memory_order_relaxed );
+    }
+    signalWakeup();
+
+    return replaced ? PublishResult::Coalesced : PublishResult::Queued;
+}
+
 #endif      // AWS_IOT_CLIENT_WRAPPTER_HPP_INCLUDED
@@ -0,0 +1,269 @@
+
+#include "DNSResolverCache.hpp"
+#include "Metrics.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "freertos/task.h"
+
+#include "lwip/err.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "lwip/tcpip.h"
+
+#include "esp_log.h"
+
+DNSResolverCache::DNSResolverCache()
+    : m_Config(),
+      m_Entries(),
+      m_Statistics()
+{
+    m_Config.TTLSeconds      = 300;
+    m_Config.MaxStaleSeconds = 3600;
+
+    for( Entry& entry : m_Entries ){
+        entry.Address    = 0;
+        entry.ResolvedAt = 0;
+        entry.LastUsed   = 0;
+        entry.Expired    = true;
+    }
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+DNSResolverCache::~DNSResolverCache()
+{}
+
+DNSResolverCache& DNSResolverCache::Instance()
+{
+    static DNSResolverCache s_Instance;
+    return s_Instance;
+}
+
+void DNSResolverCache::Configure( const Config& config )
+{
+    DNSResolverCache::Instance().m_Config = config;
+}
+
+bool DNSResolverCache::Resolve( const std::string& host, uint32_t* address )
+{
+    if( host.empty() || address == nullptr ){
+        return false;
+    }
+
+    if( lookup( host, address, false ) ){
+        return true;
+    }
+
+    // getaddrinfo() はブロックするのでロックの外で呼ぶ
+    struct addrinfo hints = {};
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res = nullptr;
+    int err = 0;
+    {
+        StageTimer timer( MetricStage::DNSLookup );
+        err = getaddrinfo( host.c_str(), nullptr, &hints, &res );
+        if( err != 0 || res == nullptr ){
+            timer.Failed();
+        }
+    }
+    if( err == 0 && res != nullptr ){
+        *address = reinterpret_cast<struct sockaddr_in*>(res->ai_addr)->sin_addr.s_addr;
+        freeaddrinfo( res );
+        store( host, *address );
+        return true;
+    }
+
+    // DNS サーバーが応答しない場合でも、期限切れから間もないアドレスなら使う
+    if( lookup( host, address, true ) ){
+        ESP_LOGW( sk_Tag, "DNS lookup failed err=%d. Use stale address for %s", err, host.c_str() );
+        return true;
+    }
+
+    ESP_LOGE( sk_Tag, "DNS lookup failed err=%d res=%p", err, res );
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        ++m_Statistics.Failures;
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    return false;
+}
+
+void DNSResolverCache::Prefetch( const std::string& host )
+{
+    if( host.empty() ){
+        return;
+    }
+
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        Entry* entry = findEntry( host );
+        bool fresh = (entry != nullptr) && isFresh( *entry, xTaskGetTickCount() );
+        if( !fresh ){
+            ++m_Statistics.Prefetches;
+        }
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+        if( fresh ){
+            return;
+        }
+    }
+
+    // dns_gethostbyname() は tcpip スレッドから呼ぶ必要がある
+    char* name = strdup( host.c_str() );
+    if( name == nullptr ){
+        return;
+    }
+    if( tcpip_callback( prefetchInTcpip, name ) != ERR_OK ){
+        free( name );
+    }
+}
+
+void DNSResolverCache::Invalidate( const std::string& host )
+{
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        Entry* entry = findEntry( host );
+        if( entry != nullptr ){
+            // 再解決に失敗した時のために、アドレス自体は残しておく
+            entry->Expired = true;
+        }
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+}
+
+DNSResolverCache::Statistics DNSResolverCache::GetStatistics() const
+{
+    Statistics stat = {};
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        stat = m_Statistics;
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    return stat;
+}
+
+void DNSResolverCache::prefetchInTcpip( void* arg )
+{
+    char* name = reinterpret_cast<char*>(arg);
+
+    // lwIP は name を内部テーブルへコピーするので、呼び出し後すぐに解放してよい
+    ip_addr_t addr;
+    err_t err = dns_gethostbyname_addrtype( name, &addr, dnsFoundCallback, nullptr, LWIP_DNS_ADDRTYPE_IPV4 );
+    if( err == ERR_OK ){
+        dnsFoundCallback( name, &addr, nullptr );
+    }
+    else if( err != ERR_INPROGRESS ){
+        ESP_LOGW( sk_Tag, "Prefetch %s failed err=%d", name, err );
+    }
+    free( name );
+}
+
+void DNSResolverCache::dnsFoundCallback( const char* name, const ip_addr_t* ipaddr, void* arg )
+{
+    if( name == nullptr || ipaddr == nullptr || !IP_IS_V4( ipaddr ) ){
+        return;
+    }
+
+    // tcpip スレッドで呼ばれるので、ロックは短く保つ
+    DNSResolverCache::Instance().store( name, ip_2_ip4( ipaddr )->addr );
+}
+
+bool DNSResolverCache::lookup( const std::string& host, uint32_t* address, bool allow_stale )
+{
+    bool result = false;
+    if( !xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        return false;
+    }
+
+    portTickType now = xTaskGetTickCount();
+    Entry* entry = findEntry( host );
+    if( entry != nullptr ){
+        if( !allow_stale && isFresh( *entry, now ) ){
+            ++m_Statistics.Hits;
+            result = true;
+        }
+        else if( allow_stale && isServableStale( *entry, now ) ){
+            ++m_Statistics.StaleServed;
+            result = true;
+        }
+    }
+    if( result ){
+        *address = entry->Address;
+        entry->LastUsed = now;
+    }
+    else if( !allow_stale ){
+        ++m_Statistics.Misses;
+    }
+
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+    return result;
+}
+
+void DNSResolverCache::store( const std::string& host, uint32_t address )
+{
+    if( !xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        return;
+    }
+
+    portTickType now = xTaskGetTickCount();
+    Entry* entry = findEntry( host );
+    if( entry == nullptr ){
+        // 空きが無ければ最も長く使われていないエントリを置き換える
+        entry = &m_Entries[0];
+        for( Entry& e : m_Entries ){
+            if( e.Host.empty() ){
+                entry = &e;
+                break;
+            }
+            if( (now - e.LastUsed) > (now - entry->LastUsed) ){
+                entry = &e;
+            }
+        }
+        entry->Host = host;
+    }
+
+    entry->Address    = address;
+    entry->ResolvedAt = now;
+    entry->LastUsed   = now;
+    entry->Expired    = false;
+
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+}
+
+DNSResolverCache::Entry* DNSResolverCache::findEntry( const std::string& host )
+{
+    for( Entry& entry : m_Entries ){
+        if( !entry.Host.empty() && entry.Host == host ){
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool DNSResolverCache::isFresh( const Entry& entry, portTickType now ) const
+{
+    portTickType ttl = (m_Config.TTLSeconds * 1000) / portTICK_PERIOD_MS;
+    return !entry.Expired && (now - entry.ResolvedAt) < ttl;
+}
+
+bool DNSResolverCache::isServableStale( const Entry& entry, portTickType now ) const
+{
+    portTickType limit = ((m_Config.TTLSeconds + m_Config.MaxStaleSeconds) * 1000) / portTICK_PERIOD_MS;
+    return (now - entry.ResolvedAt) < limit;
+}
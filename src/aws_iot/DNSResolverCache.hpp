@@ -0,0 +1,91 @@
+#ifndef     DNS_RESOLVER_CACHE_HPP_INCLUDED
+#define     DNS_RESOLVER_CACHE_HPP_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "lwip/dns.h"
+
+//
+// アップロード先ホストの名前解決結果を保持するキャッシュ
+//
+// lwIP は応答の TTL を公開しないので、有効期間は Config.TTLSeconds で決める。
+// 期限切れ後の再解決に失敗した場合は、MaxStaleSeconds までは古いアドレスを返す。
+//
+class DNSResolverCache
+{
+public:
+
+    struct Config
+    {
+        uint32_t TTLSeconds;
+        uint32_t MaxStaleSeconds;       // 期限切れからこの時間までは失敗時に古いアドレスを使う
+    };
+
+    struct Statistics
+    {
+        uint32_t Hits;
+        uint32_t Misses;
+        uint32_t StaleServed;
+        uint32_t Failures;
+        uint32_t Prefetches;
+    };
+
+    static inline constexpr char sk_Tag[] = "DNSCache";
+
+public:
+
+    // DO NOT COPY
+    DNSResolverCache( const DNSResolverCache& ) = delete;
+    DNSResolverCache& operator=( const DNSResolverCache& ) = delete;
+
+    static DNSResolverCache& Instance();
+    static void Configure( const Config& config );
+
+    // address はネットワークバイトオーダーの IPv4 アドレス
+    bool Resolve( const std::string& host, uint32_t* address );
+
+    // 非同期で名前解決を始めておく。結果は lwIP の DNS 応答時にキャッシュへ入る。
+    void Prefetch( const std::string& host );
+
+    // 接続に失敗したアドレスは次回の Resolve() で引き直す
+    void Invalidate( const std::string& host );
+
+    Statistics GetStatistics() const;
+
+private:
+
+    DNSResolverCache();
+    ~DNSResolverCache() noexcept;
+
+    static const int sk_MaxEntries = 4;
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+
+    struct Entry
+    {
+        std::string  Host;
+        uint32_t     Address;
+        portTickType ResolvedAt;
+        portTickType LastUsed;
+        bool         Expired;
+    };
+
+    static void prefetchInTcpip( void* arg );
+    static void dnsFoundCallback( const char* name, const ip_addr_t* ipaddr, void* arg );
+
+    bool lookup( const std::string& host, uint32_t* address, bool allow_stale );
+    void store( const std::string& host, uint32_t address );
+    Entry* findEntry( const std::string& host );
+    bool isFresh( const Entry& entry, portTickType now ) const;
+    bool isServableStale( const Entry& entry, portTickType now ) const;
+
+    Config           m_Config;
+    Entry            m_Entries[sk_MaxEntries];
+    Statistics       m_Statistics;
+    xSemaphoreHandle m_Mutex;
+};
+
+#endif    // DNS_RESOLVER_CACHE_HPP_INCLUDED
@@ -0,0 +1,119 @@
+
+#include "HTTPResponseParser.hpp"
+
+//
+// class HTTPResponseParser implemantation
+//
+
+bool HTTPResponseParser::Parse( std::string_view header_block, HTTPResponse* response, bool* has_length, bool* is_chunked )
+{
+    response->StatusCode    = 0;
+    response->ContentLength = 0;
+    response->KeepAlive     = true;
+    *has_length = false;
+    *is_chunked = false;
+
+    // status line: "HTTP/1.1 200 OK"
+    std::string_view::size_type eol = header_block.find( "\r\n" );
+    if( eol == std::string_view::npos ){
+        return false;
+    }
+    std::string_view status_line = header_block.substr( 0, eol );
+    if( status_line.size() < 12 || status_line.substr( 0, 5 ) != "HTTP/" ){
+        return false;
+    }
+    if( status_line.substr( 5, 3 ) == "1.0" ){
+        // HTTP/1.0 は明示されない限り keep-alive しない
+        response->KeepAlive = false;
+    }
+
+    std::string_view::size_type sp = status_line.find( ' ' );
+    if( sp == std::string_view::npos || sp + 4 > status_line.size() ){
+        return false;
+    }
+    int code = 0;
+    for( int i = 1; i <= 3; ++i ){
+        char c = status_line[sp + i];
+        if( c < '0' || c > '9' ){
+            return false;
+        }
+        code = code * 10 + (c - '0');
+    }
+    response->StatusCode = code;
+
+    // header fields
+    std::string_view rest = header_block.substr( eol + 2 );
+    while( !rest.empty() ){
+        eol = rest.find( "\r\n" );
+        if( eol == std::string_view::npos ){
+            break;
+        }
+        std::string_view line = rest.substr( 0, eol );
+        rest = rest.substr( eol + 2 );
+        if( line.empty() ){
+            break;
+        }
+
+        std::string_view::size_type colon = line.find( ':' );
+        if( colon == std::string_view::npos ){
+            continue;
+        }
+        std::string_view name  = trim( line.substr( 0, colon ) );
+        std::string_view value = trim( line.substr( colon + 1 ) );
+
+        if( equalsIgnoreCase( name, "Content-Length" ) ){
+            size_t length = 0;
+            for( char c : value ){
+                if( c < '0' || c > '9' ){
+                    return false;
+                }
+                length = length * 10 + (c - '0');
+            }
+            response->ContentLength = length;
+            *has_length = true;
+        }
+        else if( equalsIgnoreCase( name, "Connection" ) ){
+            if( equalsIgnoreCase( value, "close" ) ){
+                response->KeepAlive = false;
+            }
+            else if( equalsIgnoreCase( value, "keep-alive" ) ){
+                response->KeepAlive = true;
+            }
+        }
+        else if( equalsIgnoreCase( name, "Transfer-Encoding" ) ){
+            if( !equalsIgnoreCase( value, "identity" ) ){
+                *is_chunked = true;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool HTTPResponseParser::equalsIgnoreCase( std::string_view lhs, std::string_view rhs )
+{
+    if( lhs.size() != rhs.size() ){
+        return false;
+    }
+    for( size_t i = 0; i < lhs.size(); ++i ){
+        char a = lhs[i];
+        char b = rhs[i];
+        if( a >= 'A' && a <= 'Z' ){ a = a - 'A' + 'a'; }
+        if( b >= 'A' && b <= 'Z' ){ b = b - 'A' + 'a'; }
+        if( a != b ){
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view HTTPResponseParser::trim( std::string_view str )
+{
+    while( !str.empty() && (str.front() == ' ' || str.front() == '\t') ){
+        str.remove_prefix( 1 );
+    }
+    while( !str.empty() && (str.back() == ' ' || str.back() == '\t') ){
+        str.remove_suffix( 1 );
+    }
+    return str;
+}
@@ -0,0 +1,33 @@
+#ifndef     HTTP_RESPONSE_PARSER_HPP_INCLUDED
+#define     HTTP_RESPONSE_PARSER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+struct HTTPResponse
+{
+    int     StatusCode;
+    size_t  ContentLength;
+    bool    KeepAlive;
+
+    bool IsSuccess() const { return StatusCode >= 200 && StatusCode < 300; }
+};
+
+//
+// HTTP レスポンスのステータス行とヘッダの解析
+//
+class HTTPResponseParser
+{
+public:
+
+    // header_block は "\r\n\r\n" までを含むこと
+    static bool Parse( std::string_view header_block, HTTPResponse* response, bool* has_length, bool* is_chunked );
+
+private:
+
+    static bool equalsIgnoreCase( std::string_view lhs, std::string_view rhs );
+    static std::string_view trim( std::string_view str );
+};
+
+#endif    // HTTP_RESPONSE_PARSER_HPP_INCLUDED
@@ -0,0 +1,488 @@
+
+#include "HTTPUploadClient.hpp"
+#include "DNSResolverCache.hpp"
+#include "Metrics.hpp"
+#include "TelemetryPublisher.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "freertos/task.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+
+#include "esp_timer.h"
+#include "esp_log.h"
+
+//
+// class HTTPUploadClient implemantation
+//
+
+HTTPUploadClient::HTTPUploadClient()
+    : m_Config(),
+      m_Connections(),
+      m_Stream()
+{
+    m_Config.IOTimeoutMs    = 5000;
+    m_Config.IdleTimeoutMs  = 30000;
+    m_Config.SendBufferSize = 0;
+
+    for( Connection& conn : m_Connections ){
+        conn.Socket   = -1;
+        conn.LastUsed = 0;
+    }
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+HTTPUploadClient::~HTTPUploadClient()
+{
+    CloseAll();
+}
+
+HTTPUploadClient& HTTPUploadClient::Instance()
+{
+    static HTTPUploadClient s_Instance;
+    return s_Instance;
+}
+
+void HTTPUploadClient::Configure( const Config& config )
+{
+    HTTPUploadClient::Instance().m_Config = config;
+}
+
+bool HTTPUploadClient::Put( const std::string& host, const std::string& path, const char* content_type,
+                            const uint8_t* body, size_t length, HTTPResponse* response )
+{
+    if( host.empty() || response == nullptr ){
+        return false;
+    }
+
+    // アップロードは直列に行う
+    if( !xSemaphoreTake( m_Mutex, portMAX_DELAY ) ){
+        return false;
+    }
+    int64_t start = esp_timer_get_time();
+
+    bool result = false;
+    // 使い回した接続はサーバー側で閉じられている場合があるので、その時は 1 度だけ新しい接続でやり直す
+    for( int attempt = 0; attempt < 2 && !result; ++attempt ){
+        bool reused = false;
+        Connection* conn = acquireConnection( host, &reused );
+        if( conn == nullptr ){
+            break;
+        }
+
+        if( !sendRequest( conn->Socket, host, path, content_type, length, body, length ) ||
+            !receiveResponse( conn->Socket, response ) ){
+            closeConnection( conn );
+            if( reused ){
+                ESP_LOGW( sk_Tag, "Reused connection failed. Retry with new connection." );
+                continue;
+            }
+            break;
+        }
+
+        result = true;
+        conn->LastUsed = xTaskGetTickCount();
+        if( !response->KeepAlive ){
+            closeConnection( conn );
+        }
+    }
+
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+
+    if( result ){
+        recordLatency( start );
+        ESP_LOGI( sk_Tag, "PUT %s -> %d", host.c_str(), response->StatusCode );
+    }
+    return result;
+}
+
+bool HTTPUploadClient::BeginPut( const std::string& host, const std::string& path, const char* content_type,
+                                 size_t content_length )
+{
+    if( host.empty() ){
+        return false;
+    }
+
+    // EndPut() まで他のアップロードを待たせる
+    if( !xSemaphoreTake( m_Mutex, portMAX_DELAY ) ){
+        return false;
+    }
+
+    Connection* conn = nullptr;
+    // ボディは再送できないので、やり直すのはヘッダの送信に失敗した時だけ
+    for( int attempt = 0; attempt < 2 && conn == nullptr; ++attempt ){
+        bool reused = false;
+        conn = acquireConnection( host, &reused );
+        if( conn == nullptr ){
+            break;
+        }
+
+        if( !sendRequest( conn->Socket, host, path, content_type, content_length, nullptr, 0 ) ){
+            closeConnection( conn );
+            conn = nullptr;
+            if( !reused ){
+                break;
+            }
+        }
+    }
+
+    if( conn == nullptr ){
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+        return false;
+    }
+
+    m_Stream.Conn      = conn;
+    m_Stream.Chunked   = (content_length == sk_UnknownLength);
+    m_Stream.Remaining = m_Stream.Chunked ? 0 : content_length;
+    m_Stream.Failed    = false;
+    m_Stream.StartUs   = esp_timer_get_time();
+    return true;
+}
+
+bool HTTPUploadClient::Write( const uint8_t* data, size_t length )
+{
+    if( m_Stream.Conn == nullptr || m_Stream.Failed ){
+        return false;
+    }
+    if( length == 0 ){
+        // chunked の場合、長さ 0 のチャンクは終端になってしまう
+        return true;
+    }
+
+    struct iovec iov[3];
+    int iovcnt = 0;
+    char size_line[16];
+    if( m_Stream.Chunked ){
+        int n = snprintf( size_line, sizeof(size_line), "%x\r\n", static_cast<unsigned>(length) );
+        iov[iovcnt].iov_base = size_line;
+        iov[iovcnt].iov_len  = n;
+        ++iovcnt;
+    }
+    else if( length > m_Stream.Remaining ){
+        ESP_LOGE( sk_Tag, "Body exceeds Content-Length." );
+        m_Stream.Failed = true;
+        return false;
+    }
+
+    iov[iovcnt].iov_base = const_cast<uint8_t*>(data);
+    iov[iovcnt].iov_len  = length;
+    ++iovcnt;
+    if( m_Stream.Chunked ){
+        iov[iovcnt].iov_base = const_cast<char*>("\r\n");
+        iov[iovcnt].iov_len  = 2;
+        ++iovcnt;
+    }
+    else {
+        m_Stream.Remaining -= length;
+    }
+
+    if( !sendAll( m_Stream.Conn->Socket, iov, iovcnt ) ){
+        m_Stream.Failed = true;
+    }
+    return !m_Stream.Failed;
+}
+
+void HTTPUploadClient::Abort()
+{
+    if( m_Stream.Conn != nullptr ){
+        m_Stream.Failed = true;
+    }
+}
+
+bool HTTPUploadClient::EndPut( HTTPResponse* response )
+{
+    Connection* conn = m_Stream.Conn;
+    if( conn == nullptr ){
+        return false;
+    }
+
+    bool result = !m_Stream.Failed && response != nullptr;
+    if( result && m_Stream.Chunked ){
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>("0\r\n\r\n");
+        iov.iov_len  = 5;
+        result = sendAll( conn->Socket, &iov, 1 );
+    }
+    else if( result && m_Stream.Remaining != 0 ){
+        ESP_LOGE( sk_Tag, "Body shorter than Content-Length." );
+        result = false;
+    }
+
+    if( result ){
+        result = receiveResponse( conn->Socket, response );
+    }
+
+    if( !result ){
+        closeConnection( conn );
+    }
+    else {
+        conn->LastUsed = xTaskGetTickCount();
+        if( !response->KeepAlive ){
+            closeConnection( conn );
+        }
+        recordLatency( m_Stream.StartUs );
+    }
+    m_Stream.Conn = nullptr;
+
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+    return result;
+}
+
+void HTTPUploadClient::CloseAll()
+{
+    for( Connection& conn : m_Connections ){
+        closeConnection( &conn );
+    }
+}
+
+HTTPUploadClient::Connection* HTTPUploadClient::acquireConnection( const std::string& host, bool* reused )
+{
+    portTickType now = xTaskGetTickCount();
+    Connection* free_conn = nullptr;
+    Connection* oldest = nullptr;
+
+    for( Connection& conn : m_Connections ){
+        if( conn.Socket >= 0 && (now - conn.LastUsed) >= (m_Config.IdleTimeoutMs / portTICK_PERIOD_MS) ){
+            closeConnection( &conn );
+        }
+
+        if( conn.Socket >= 0 && conn.Host == host ){
+            if( isAlive( conn.Socket ) ){
+                *reused = true;
+                return &conn;
+            }
+            closeConnection( &conn );
+        }
+        if( conn.Socket < 0 && free_conn == nullptr ){
+            free_conn = &conn;
+        }
+        if( conn.Socket >= 0 && (oldest == nullptr || conn.LastUsed < oldest->LastUsed) ){
+            oldest = &conn;
+        }
+    }
+
+    Connection* conn = free_conn ? free_conn : oldest;
+    closeConnection( conn );
+
+    *reused = false;
+    if( !openConnection( conn, host ) ){
+        return nullptr;
+    }
+    return conn;
+}
+
+bool HTTPUploadClient::openConnection( Connection* conn, const std::string& host )
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons( sk_Port );
+    if( !DNSResolverCache::Instance().Resolve( host, &addr.sin_addr.s_addr ) ){
+        return false;
+    }
+
+    int sock = socket( AF_INET, SOCK_STREAM, 0 );
+    if( sock < 0 ) {
+        ESP_LOGE( sk_Tag, "... Failed to allocate socket." );
+        return false;
+    }
+    setupSocket( sock );
+
+    StageTimer timer( MetricStage::TCPConnect );
+    if( connect( sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr) ) != 0 ){
+        timer.Failed();
+        ESP_LOGE( sk_Tag, "... socket connect failed errno=%d", errno );
+        close( sock );
+        // アドレスが変わっている可能性があるので、次回は引き直す
+        DNSResolverCache::Instance().Invalidate( host );
+        return false;
+    }
+
+    conn->Host     = host;
+    conn->Socket   = sock;
+    conn->LastUsed = xTaskGetTickCount();
+    ESP_LOGI( sk_Tag, "... connected to %s", host.c_str() );
+
+    return true;
+}
+
+void HTTPUploadClient::closeConnection( Connection* conn )
+{
+    if( conn->Socket >= 0 ){
+        close( conn->Socket );
+    }
+    conn->Socket = -1;
+    conn->Host.clear();
+}
+
+bool HTTPUploadClient::isAlive( int sock )
+{
+    // 待機中の接続に届くのは FIN か RST だけのはず
+    char c;
+    ssize_t n = recv( sock, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void HTTPUploadClient::setupSocket( int sock )
+{
+    struct timeval timeout;
+    timeout.tv_sec  = m_Config.IOTimeoutMs / 1000;
+    timeout.tv_usec = (m_Config.IOTimeoutMs % 1000) * 1000;
+    setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    setsockopt( sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+
+    // ヘッダとボディは writev でまとめて渡すので Nagle は不要
+    int nodelay = 1;
+    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay) );
+
+    if( m_Config.SendBufferSize > 0 ){
+        int size = m_Config.SendBufferSize;
+        setsockopt( sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+    }
+}
+
+bool HTTPUploadClient::sendRequest( int sock, const std::string& host, const std::string& path, const char* content_type,
+                                    size_t content_length, const uint8_t* body, size_t length )
+{
+    // ヘッダは固定部分と可変部分を並べて送るだけにして、まとめて整形するバッファを持たない
+    char length_line[48];
+    if( content_length == sk_UnknownLength ){
+        snprintf( length_line, sizeof(length_line), "Transfer-Encoding: chunked\r\n" );
+    }
+    else {
+        snprintf( length_line, sizeof(length_line), "Content-Length: %u\r\n", static_cast<unsigned>(content_length) );
+    }
+
+    const char* const parts[] = {
+        "PUT /", path.c_str(), " HTTP/1.1\r\nHost: ", host.c_str(), "\r\nContent-Type: ", content_type, "\r\n",
+        length_line, "Connection: keep-alive\r\n\r\n",
+    };
+    constexpr int part_count = sizeof(parts) / sizeof(parts[0]);
+
+    struct iovec iov[part_count + 1];
+    for( int i = 0; i < part_count; ++i ){
+        iov[i].iov_base = const_cast<char*>(parts[i]);
+        iov[i].iov_len  = strlen( parts[i] );
+    }
+    int iovcnt = part_count;
+    if( body != nullptr && length > 0 ){
+        iov[iovcnt].iov_base = const_cast<uint8_t*>(body);
+        iov[iovcnt].iov_len  = length;
+        ++iovcnt;
+    }
+
+    return sendAll( sock, iov, iovcnt );
+}
+
+bool HTTPUploadClient::sendAll( int sock, struct iovec* iov, int iovcnt )
+{
+    StageTimer timer( MetricStage::UploadSend );
+
+    struct iovec* cur = iov;
+    while( iovcnt > 0 ){
+        ssize_t written = writev( sock, cur, iovcnt );
+        if( written < 0 ){
+            ESP_LOGE( sk_Tag, "... socket send failed errno=%d", errno );
+            timer.Failed();
+            return false;
+        }
+
+        // 部分送信の場合は残りから再開する
+        size_t n = static_cast<size_t>(written);
+        while( iovcnt > 0 && n >= cur->iov_len ){
+            n -= cur->iov_len;
+            ++cur;
+            --iovcnt;
+        }
+        if( iovcnt > 0 ){
+            cur->iov_base = static_cast<uint8_t*>(cur->iov_base) + n;
+            cur->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+void HTTPUploadClient::recordLatency( int64_t start_us )
+{
+    // 接続からレスポンス受信までの 1 回分
+    int64_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+    TelemetryPublisher::Instance().Record( TelemetryPublisher::Metric::UploadMs, static_cast<int32_t>(elapsed_ms) );
+}
+
+bool HTTPUploadClient::receiveResponse( int sock, HTTPResponse* response )
+{
+    // サーバーの処理時間を含む
+    StageTimer timer( MetricStage::UploadResponse );
+
+    char buf[sk_ResponseBufferSize];
+    size_t received = 0;
+    size_t header_end = 0;
+
+    while( header_end == 0 ){
+        if( received >= sizeof(buf) ){
+            ESP_LOGE( sk_Tag, "Response header too long." );
+            timer.Failed();
+            return false;
+        }
+        ssize_t n = recv( sock, buf + received, sizeof(buf) - received, 0 );
+        if( n <= 0 ){
+            ESP_LOGE( sk_Tag, "... socket receive failed errno=%d", errno );
+            timer.Failed();
+            return false;
+        }
+        received += n;
+
+        std::string_view view( buf, received );
+        std::string_view::size_type pos = view.find( "\r\n\r\n" );
+        if( pos != std::string_view::npos ){
+            header_end = pos + 4;
+        }
+    }
+
+    bool has_length = false;
+    bool is_chunked = false;
+    if( !HTTPResponseParser::Parse( std::string_view( buf, header_end ), response, &has_length, &is_chunked ) ){
+        ESP_LOGE( sk_Tag, "Malformed response." );
+        timer.Failed();
+        return false;
+    }
+
+    bool no_body = (response->StatusCode == 204 || response->StatusCode == 304 || response->StatusCode < 200);
+    if( no_body ){
+        return true;
+    }
+    if( is_chunked || !has_length ){
+        // ボディの終端が分からないので、この接続は使い回さない
+        response->KeepAlive = false;
+        return true;
+    }
+
+    // 次のリクエストのためにボディを読み捨てる
+    size_t remaining = response->ContentLength;
+    size_t already = received - header_end;
+    remaining -= (already < remaining) ? already : remaining;
+    while( remaining > 0 ){
+        ssize_t n = recv( sock, buf, (remaining < sizeof(buf)) ? remaining : sizeof(buf), 0 );
+        if( n <= 0 ){
+            response->KeepAlive = false;
+            break;
+        }
+        remaining -= n;
+    }
+
+    return true;
+}
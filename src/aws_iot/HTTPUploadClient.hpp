@@ -0,0 +1,103 @@
+#ifndef     HTTP_UPLOAD_CLIENT_HPP_INCLUDED
+#define     HTTP_UPLOAD_CLIENT_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "HTTPResponseParser.hpp"
+
+//
+// HTTP/1.1 keep-alive で接続を使い回すアップロードクライアント
+//
+// ホスト毎に接続を保持し、ヘッダとボディはまとめて送信する。
+// サーバーが Connection: close を返した場合や、ボディ長が分からない場合は接続を閉じる。
+//
+class HTTPUploadClient
+{
+public:
+
+    struct Config
+    {
+        uint32_t IOTimeoutMs;
+        uint32_t IdleTimeoutMs;         // これ以上使われていない接続は再利用しない
+        int      SendBufferSize;        // 0 の場合は設定しない
+    };
+
+    static inline constexpr char sk_Tag[] = "HTTPUpload";
+
+    // BeginPut() の content_length に指定すると Transfer-Encoding: chunked で送る
+    static inline constexpr size_t sk_UnknownLength = SIZE_MAX;
+
+public:
+
+    // DO NOT COPY
+    HTTPUploadClient( const HTTPUploadClient& ) = delete;
+    HTTPUploadClient& operator=( const HTTPUploadClient& ) = delete;
+
+    static HTTPUploadClient& Instance();
+    static void Configure( const Config& config );
+
+    bool Put( const std::string& host, const std::string& path, const char* content_type,
+              const uint8_t* body, size_t length, HTTPResponse* response );
+
+    // ボディを分けて送る場合。BeginPut() が成功したら必ず EndPut() を呼ぶこと。
+    // BeginPut() から EndPut() までの間、他のアップロードは待たされる。
+    bool BeginPut( const std::string& host, const std::string& path, const char* content_type,
+                   size_t content_length );
+    bool Write( const uint8_t* data, size_t length );
+    // ボディを作れなかった場合に呼ぶ。EndPut() は終端を送らずに接続を閉じる。
+    void Abort();
+    bool EndPut( HTTPResponse* response );
+
+    void CloseAll();
+
+private:
+
+    HTTPUploadClient();
+    ~HTTPUploadClient() noexcept;
+
+    static const int    sk_MaxConnections = 2;
+    static const uint16_t sk_Port = 80;
+    static const size_t sk_ResponseBufferSize = 1024;
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+
+    struct Connection
+    {
+        std::string  Host;
+        int          Socket;
+        portTickType LastUsed;
+    };
+
+    struct Stream
+    {
+        Connection*  Conn;
+        bool         Chunked;
+        size_t       Remaining;
+        bool         Failed;
+        int64_t      StartUs;
+    };
+
+    Connection* acquireConnection( const std::string& host, bool* reused );
+    bool openConnection( Connection* conn, const std::string& host );
+    void closeConnection( Connection* conn );
+    bool isAlive( int sock );
+    void setupSocket( int sock );
+
+    bool sendRequest( int sock, const std::string& host, const std::string& path, const char* content_type,
+                      size_t content_length, const uint8_t* body, size_t length );
+    bool sendAll( int sock, struct iovec* iov, int iovcnt );
+    bool receiveResponse( int sock, HTTPResponse* response );
+    void recordLatency( int64_t start_us );
+
+    Config           m_Config;
+    Connection       m_Connections[sk_MaxConnections];
+    Stream           m_Stream;
+    xSemaphoreHandle m_Mutex;
+};
+
+#endif    // HTTP_UPLOAD_CLIENT_HPP_INCLUDED
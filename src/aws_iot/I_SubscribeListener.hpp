@@ -5,7 +5,13 @@
 #include <vector>
 #include <string>
 
-class I_SubscribeListener
+#include "I_SubscribeViewListener.hpp"
+
+//
+// 受信データを std::string / std::vector にコピーして受け取るリスナー
+// I_SubscribeViewListener のアダプタとして動作する。
+//
+class I_SubscribeListener : public I_SubscribeViewListener
 {
 public:
     using SubscribePayloadArray = std::vector<uint8_t>;
@@ -16,6 +22,14 @@ public:
     virtual ~I_SubscribeListener() noexcept {}
 
     virtual void SubscribeHandler( const std::string& topic, const SubscribePayloadArray& payload ) = 0;
+
+    virtual void SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload ) override final
+    {
+        std::string topic_string( topic );
+        SubscribePayloadArray payload_array( payload.begin(), payload.end() );
+
+        SubscribeHandler( topic_string, payload_array );
+    }
 };
 
 #endif    // I_SUBSCRIBE_LISTENER_HPP_INCLUDED
@@ -0,0 +1,61 @@
+
+#include "I_SubscribeViewListener.hpp"
+
+#include <cstring>
+#include <new>
+
+RetainedSubscribeMessage::RetainedSubscribeMessage( size_t topic_length, size_t payload_length )
+    : m_TopicLength( topic_length ),
+      m_PayloadLength( payload_length )
+{}
+
+RetainedSubscribeMessage::Ptr RetainedSubscribeMessage::Create( std::string_view topic, SubscribePayloadView payload )
+{
+    // [header][topic]\0[payload]\0
+    size_t total = sizeof(RetainedSubscribeMessage) + topic.size() + 1 + payload.size() + 1;
+    void* block = ::operator new( total, std::nothrow );
+    if( block == nullptr ){
+        return Ptr();
+    }
+
+    RetainedSubscribeMessage* message = new (block) RetainedSubscribeMessage( topic.size(), payload.size() );
+    char* p = message->storage();
+    std::memcpy( p, topic.data(), topic.size() );
+    p[topic.size()] = '\0';
+    p += topic.size() + 1;
+    if( !payload.empty() ){
+        std::memcpy( p, payload.data(), payload.size() );
+    }
+    p[payload.size()] = '\0';
+
+    return Ptr( message );
+}
+
+void RetainedSubscribeMessage::Deleter::operator()( RetainedSubscribeMessage* p ) const
+{
+    if( p ){
+        p->~RetainedSubscribeMessage();
+        ::operator delete( p );
+    }
+}
+
+std::string_view RetainedSubscribeMessage::Topic() const
+{
+    return std::string_view( storage(), m_TopicLength );
+}
+
+SubscribePayloadView RetainedSubscribeMessage::Payload() const
+{
+    const char* p = storage() + m_TopicLength + 1;
+    return SubscribePayloadView( reinterpret_cast<const uint8_t*>(p), m_PayloadLength );
+}
+
+char* RetainedSubscribeMessage::storage()
+{
+    return reinterpret_cast<char*>(this + 1);
+}
+
+const char* RetainedSubscribeMessage::storage() const
+{
+    return reinterpret_cast<const char*>(this + 1);
+}
@@ -0,0 +1,89 @@
+#ifndef     I_SUBSCRIBE_VIEW_LISTENER_HPP_INCLUDED
+#define     I_SUBSCRIBE_VIEW_LISTENER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+//
+// 受信ペイロードの非所有ビュー (std::span<const uint8_t> 相当)
+//
+class SubscribePayloadView
+{
+public:
+
+    constexpr SubscribePayloadView() : m_Data( nullptr ), m_Length( 0 ) {}
+    constexpr SubscribePayloadView( const uint8_t* data, size_t length ) : m_Data( data ), m_Length( length ) {}
+
+    constexpr const uint8_t* data() const { return m_Data; }
+    constexpr size_t size() const { return m_Length; }
+    constexpr bool empty() const { return m_Length == 0; }
+    constexpr const uint8_t* begin() const { return m_Data; }
+    constexpr const uint8_t* end() const { return m_Data + m_Length; }
+    constexpr uint8_t operator[]( size_t index ) const { return m_Data[index]; }
+
+    std::string_view AsString() const { return std::string_view( reinterpret_cast<const char*>(m_Data), m_Length ); }
+
+private:
+
+    const uint8_t* m_Data;
+    size_t         m_Length;
+};
+
+//
+// コールバックを抜けた後もデータを使いたい場合のコピー
+// トピックとペイロードを 1 回のヒープ確保にまとめて保持する。
+// どちらも NULL 終端されている。
+//
+class RetainedSubscribeMessage
+{
+public:
+
+    struct Deleter
+    {
+        void operator()( RetainedSubscribeMessage* p ) const;
+    };
+    using Ptr = std::unique_ptr<RetainedSubscribeMessage, Deleter>;
+
+    static Ptr Create( std::string_view topic, SubscribePayloadView payload );
+
+    std::string_view Topic() const;
+    SubscribePayloadView Payload() const;
+
+    // DO NOT COPY
+    RetainedSubscribeMessage( const RetainedSubscribeMessage& ) = delete;
+    RetainedSubscribeMessage& operator=( const RetainedSubscribeMessage& ) = delete;
+
+private:
+
+    RetainedSubscribeMessage( size_t topic_length, size_t payload_length );
+    ~RetainedSubscribeMessage() noexcept {}
+
+    char* storage();
+    const char* storage() const;
+
+    size_t m_TopicLength;
+    size_t m_PayloadLength;
+};
+
+//
+// 受信データをコピーせずに受け取るリスナー
+// topic / payload はコールバック中のみ有効。保持したい場合は Retain() すること。
+//
+class I_SubscribeViewListener
+{
+public:
+
+    I_SubscribeViewListener() {}
+    virtual ~I_SubscribeViewListener() noexcept {}
+
+    virtual void SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload ) = 0;
+
+    static RetainedSubscribeMessage::Ptr Retain( std::string_view topic, SubscribePayloadView payload )
+    {
+        return RetainedSubscribeMessage::Create( topic, payload );
+    }
+};
+
+#endif    // I_SUBSCRIBE_VIEW_LISTENER_HPP_INCLUDED
@@ -0,0 +1,49 @@
+#ifndef     MQTT_TOPIC_HPP_INCLUDED
+#define     MQTT_TOPIC_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+//
+// 長さとハッシュを事前計算したトピック名
+// 文字列リテラルから constexpr で構築すればコンパイル時に計算される。
+// Name の指す文字列はこのオブジェクトより長く生存していること。
+//
+struct MQTTTopic
+{
+    constexpr MQTTTopic()
+        : Name( nullptr ), Length( 0 ), Hash( Fnv1a( std::string_view() ) )
+    {}
+
+    constexpr MQTTTopic( const char* name )
+        : Name( name ),
+          Length( name ? static_cast<uint16_t>(std::char_traits<char>::length( name )) : 0 ),
+          Hash( Fnv1a( name ? std::string_view( name ) : std::string_view() ) )
+    {}
+
+    constexpr bool IsValid() const { return Name != nullptr; }
+    constexpr std::string_view View() const { return std::string_view( Name, Length ); }
+
+    constexpr bool operator==( const MQTTTopic& rhs ) const
+    {
+        return Hash == rhs.Hash && Length == rhs.Length && View() == rhs.View();
+    }
+    constexpr bool operator!=( const MQTTTopic& rhs ) const { return !(*this == rhs); }
+
+    static constexpr uint32_t Fnv1a( std::string_view str )
+    {
+        uint32_t hash = 2166136261u;
+        for( char c : str ){
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    const char* Name;
+    uint16_t    Length;
+    uint32_t    Hash;
+};
+
+#endif    // MQTT_TOPIC_HPP_INCLUDED
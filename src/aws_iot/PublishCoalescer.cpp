@@ -0,0 +1,150 @@
+
+#include "PublishCoalescer.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+PublishCoalescer::PublishCoalescer()
+    : m_Entries(),
+      m_PayloadPool(),
+      m_SendBuffer(),
+      m_EntryCount( 0 ),
+      m_PayloadCapacity( 0 )
+{
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+PublishCoalescer::~PublishCoalescer()
+{}
+
+bool PublishCoalescer::Allocate( size_t topic_count, size_t payload_capacity )
+{
+    if( IsAllocated() || topic_count == 0 || payload_capacity == 0 ){
+        return false;
+    }
+
+    m_Entries.reset( new (std::nothrow) Entry[topic_count] );
+    m_PayloadPool.reset( new (std::nothrow) uint8_t[topic_count * payload_capacity * 2] );
+    m_SendBuffer.reset( new (std::nothrow) uint8_t[payload_capacity] );
+    if( !m_Entries || !m_PayloadPool || !m_SendBuffer ){
+        m_Entries.reset();
+        m_PayloadPool.reset();
+        m_SendBuffer.reset();
+        return false;
+    }
+
+    for( size_t i = 0; i < topic_count; ++i ){
+        Entry& entry = m_Entries[i];
+        entry.Topic   = MQTTTopic();
+        entry.Pending = false;
+        entry.Length  = 0;
+        entry.Payload = &m_PayloadPool[(i * 2) * payload_capacity];
+        entry.Scratch = &m_PayloadPool[(i * 2 + 1) * payload_capacity];
+    }
+
+    m_EntryCount      = topic_count;
+    m_PayloadCapacity = payload_capacity;
+
+    return true;
+}
+
+bool PublishCoalescer::IsAllocated() const
+{
+    return m_EntryCount != 0;
+}
+
+size_t PublishCoalescer::PayloadCapacity() const
+{
+    return m_PayloadCapacity;
+}
+
+size_t PublishCoalescer::EntryCount() const
+{
+    return m_EntryCount;
+}
+
+PublishCoalescer::Entry* PublishCoalescer::Acquire( const MQTTTopic& topic, bool* replaced )
+{
+    if( !IsAllocated() || !topic.IsValid() ){
+        return nullptr;
+    }
+    if( !xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        return nullptr;
+    }
+
+    Entry* found = nullptr;
+    Entry* empty = nullptr;
+    for( size_t i = 0; i < m_EntryCount; ++i ){
+        Entry& entry = m_Entries[i];
+        if( !entry.Topic.IsValid() ){
+            if( empty == nullptr ){
+                empty = &entry;
+            }
+        }
+        else if( entry.Topic == topic ){
+            found = &entry;
+            break;
+        }
+    }
+
+    if( found == nullptr && empty != nullptr ){
+        empty->Topic = topic;
+        found = empty;
+    }
+
+    if( found == nullptr ){
+        // テーブルが埋まっている
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+        return nullptr;
+    }
+
+    *replaced = found->Pending;
+    return found;
+}
+
+void PublishCoalescer::Commit( Entry* entry, size_t length, bool valid )
+{
+    if( valid ){
+        std::swap( entry->Payload, entry->Scratch );
+        entry->Pending = true;
+        entry->Length  = length;
+    }
+
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+}
+
+bool PublishCoalescer::TakePending( size_t index, MQTTTopic* topic, const uint8_t** payload, size_t* length )
+{
+    if( index >= m_EntryCount ){
+        return false;
+    }
+
+    bool result = false;
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        Entry& entry = m_Entries[index];
+        if( entry.Pending ){
+            // 送信中に上書きされないよう、ロック内で送信用バッファへ移す
+            std::memcpy( m_SendBuffer.get(), entry.Payload, entry.Length );
+            *topic   = entry.Topic;
+            *payload = m_SendBuffer.get();
+            *length  = entry.Length;
+            entry.Pending = false;
+            result = true;
+        }
+
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+
+    return result;
+}
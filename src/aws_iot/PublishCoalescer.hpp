@@ -0,0 +1,70 @@
+#ifndef     PUBLISH_COALESCER_HPP_INCLUDED
+#define     PUBLISH_COALESCER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "MQTTTopic.hpp"
+
+//
+// トピック毎に最新値だけを保持する QoS0 用の送信テーブル
+//
+// 未送信のデータが残っているトピックに新しいデータが来た場合、その場で上書きする。
+// 送信順序はトピック間で保証しない。
+//
+class PublishCoalescer
+{
+public:
+
+    struct Entry
+    {
+        MQTTTopic   Topic;
+        bool        Pending;
+        size_t      Length;
+        uint8_t*    Payload;            // 未送信のデータ
+        uint8_t*    Scratch;            // 書き込み用。Commit() で成功した場合だけ Payload と入れ替える
+    };
+
+public:
+
+    PublishCoalescer();
+    ~PublishCoalescer() noexcept;
+
+    // DO NOT COPY
+    PublishCoalescer( const PublishCoalescer& ) = delete;
+    PublishCoalescer& operator=( const PublishCoalescer& ) = delete;
+
+    bool Allocate( size_t topic_count, size_t payload_capacity );
+    bool IsAllocated() const;
+    size_t PayloadCapacity() const;
+    size_t EntryCount() const;
+
+    // producer side
+    // 成功時はロックを保持したままエントリを返すので、Scratch にペイロードを書いて Commit() すること。
+    // valid が false の場合は書いた内容を捨て、未送信データはそのまま残す。
+    // replaced には未送信データを上書きするかどうかが入る。
+    Entry* Acquire( const MQTTTopic& topic, bool* replaced );
+    void Commit( Entry* entry, size_t length, bool valid );
+
+    // consumer side
+    // 未送信データがあれば内部の送信用バッファへ移し、その内容を返す。
+    bool TakePending( size_t index, MQTTTopic* topic, const uint8_t** payload, size_t* length );
+
+private:
+
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+
+    std::unique_ptr<Entry[]>   m_Entries;
+    std::unique_ptr<uint8_t[]> m_PayloadPool;
+    std::unique_ptr<uint8_t[]> m_SendBuffer;
+    size_t                     m_EntryCount;
+    size_t                     m_PayloadCapacity;
+
+    xSemaphoreHandle           m_Mutex;
+};
+
+#endif      // PUBLISH_COALESCER_HPP_INCLUDED
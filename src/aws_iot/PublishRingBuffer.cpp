@@ -0,0 +1,153 @@
+
+#include "PublishRingBuffer.hpp"
+
+#include <new>
+
+PublishRingBuffer::PublishRingBuffer()
+    : m_Slots(),
+      m_PayloadPool(),
+      m_SlotCount( 0 ),
+      m_Mask( 0 ),
+      m_PayloadCapacity( 0 ),
+      m_EnqueuePos( 0 ),
+      m_DequeuePos( 0 )
+{}
+
+PublishRingBuffer::~PublishRingBuffer()
+{}
+
+bool PublishRingBuffer::Allocate( size_t slot_count, size_t payload_capacity )
+{
+    if( IsAllocated() || slot_count == 0 || payload_capacity == 0 ){
+        return false;
+    }
+
+    // インデックス計算をマスクで済ませるため 2 のべき乗に切り上げる
+    size_t count = 1;
+    while( count < slot_count ){
+        count <<= 1;
+    }
+
+    m_Slots.reset( new (std::nothrow) Slot[count] );
+    m_PayloadPool.reset( new (std::nothrow) uint8_t[count * payload_capacity] );
+    if( !m_Slots || !m_PayloadPool ){
+        m_Slots.reset();
+        m_PayloadPool.reset();
+        return false;
+    }
+
+    for( size_t i = 0; i < count; ++i ){
+        Slot& slot = m_Slots[i];
+        slot.Sequence.store( static_cast<uint32_t>(i), std::memory_order_relaxed );
+        slot.Position = 0;
+        slot.Valid    = false;
+        slot.Topic    = MQTTTopic();
+        slot.QOS      = QOS0;
+        slot.Length   = 0;
+        slot.Payload  = &m_PayloadPool[i * payload_capacity];
+        slot.OnComplete = nullptr;
+        slot.CompleteContext = nullptr;
+    }
+
+    m_SlotCount       = count;
+    m_Mask            = static_cast<uint32_t>(count - 1);
+    m_PayloadCapacity = payload_capacity;
+    m_EnqueuePos.store( 0, std::memory_order_relaxed );
+    m_DequeuePos.store( 0, std::memory_order_release );
+
+    return true;
+}
+
+bool PublishRingBuffer::IsAllocated() const
+{
+    return m_SlotCount != 0;
+}
+
+size_t PublishRingBuffer::Capacity() const
+{
+    return m_SlotCount;
+}
+
+size_t PublishRingBuffer::PayloadCapacity() const
+{
+    return m_PayloadCapacity;
+}
+
+size_t PublishRingBuffer::Size() const
+{
+    uint32_t enqueue_pos = m_EnqueuePos.load( std::memory_order_relaxed );
+    uint32_t dequeue_pos = m_DequeuePos.load( std::memory_order_relaxed );
+
+    // 予約済み(未Commit)のスロットも含めた概算値
+    return static_cast<size_t>(enqueue_pos - dequeue_pos);
+}
+
+PublishRingBuffer::Slot* PublishRingBuffer::TryReserve()
+{
+    if( !IsAllocated() ){
+        return nullptr;
+    }
+
+    uint32_t pos = m_EnqueuePos.load( std::memory_order_relaxed );
+    while( 1 ){
+        Slot* slot = &m_Slots[pos & m_Mask];
+        uint32_t seq = slot->Sequence.load( std::memory_order_acquire );
+        int32_t diff = static_cast<int32_t>(seq - pos);
+
+        if( diff == 0 ){
+            if( m_EnqueuePos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ){
+                slot->Position = pos;
+                return slot;
+            }
+        }
+        else if( diff < 0 ){
+            // full
+            return nullptr;
+        }
+        else {
+            pos = m_EnqueuePos.load( std::memory_order_relaxed );
+        }
+    }
+}
+
+void PublishRingBuffer::Commit( Slot* slot )
+{
+    slot->Sequence.store( slot->Position + 1, std::memory_order_release );
+}
+
+PublishRingBuffer::Slot* PublishRingBuffer::TryConsume()
+{
+    if( !IsAllocated() ){
+        return nullptr;
+    }
+
+    uint32_t pos = m_DequeuePos.load( std::memory_order_relaxed );
+    while( 1 ){
+        Slot* slot = &m_Slots[pos & m_Mask];
+        uint32_t seq = slot->Sequence.load( std::memory_order_acquire );
+        int32_t diff = static_cast<int32_t>(seq - (pos + 1));
+
+        if( diff == 0 ){
+            if( m_DequeuePos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ){
+                slot->Position = pos;
+                return slot;
+            }
+        }
+        else if( diff < 0 ){
+            // empty (もしくは先頭スロットがまだ書き込み中)
+            return nullptr;
+        }
+        else {
+            pos = m_DequeuePos.load( std::memory_order_relaxed );
+        }
+    }
+}
+
+void PublishRingBuffer::Release( Slot* slot )
+{
+    slot->Valid  = false;
+    slot->Length = 0;
+    slot->OnComplete = nullptr;
+    slot->CompleteContext = nullptr;
+    slot->Sequence.store( slot->Position + static_cast<uint32_t>(m_SlotCount), std::memory_order_release );
+}
@@ -0,0 +1,111 @@
+#ifndef     PUBLISH_RING_BUFFER_HPP_INCLUDED
+#define     PUBLISH_RING_BUFFER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+
+#include "aws_iot_mqtt_client_interface.h"
+
+#include "MQTTTopic.hpp"
+
+enum class PublishDeliveryStatus
+{
+    Acknowledged,       // QOS1: PUBACK 受信
+    Sent,               // QOS0: 送信完了
+    Failed,             // 再送回数を超えた / 送信失敗
+    Dropped,            // 送信前にキューから捨てられた
+};
+
+using PublishCompleteCallback = void (*)( PublishDeliveryStatus status, void* context );
+
+//
+// 送信待ち Publish データの固定長リングバッファ
+//
+// 複数タスクから書き込み、MQTT タスクが 1 つで読み出す(MPSC)。
+// スロットとペイロード領域は Allocate() で一括確保し、以降ヒープ確保は行わない。
+// 書き込み側は TryReserve() で取得したスロットに直接ペイロードを書き、Commit() で公開する。
+// 読み出し側は TryConsume() で取得したスロットをそのまま送信し、Release() で返却する。
+//
+class PublishRingBuffer
+{
+public:
+
+    struct Slot
+    {
+        std::atomic<uint32_t> Sequence;
+        uint32_t    Position;
+        bool        Valid;
+        MQTTTopic   Topic;
+        QoS         QOS;
+        size_t      Length;
+        uint8_t*    Payload;
+        PublishCompleteCallback OnComplete;
+        void*       CompleteContext;
+    };
+
+public:
+
+    PublishRingBuffer();
+    ~PublishRingBuffer() noexcept;
+
+    // DO NOT COPY
+    PublishRingBuffer( const PublishRingBuffer& ) = delete;
+    PublishRingBuffer& operator=( const PublishRingBuffer& ) = delete;
+
+    bool Allocate( size_t slot_count, size_t payload_capacity );
+    bool IsAllocated() const;
+    size_t Capacity() const;
+    size_t PayloadCapacity() const;
+    size_t Size() const;
+
+    // producer side
+    Slot* TryReserve();
+    void Commit( Slot* slot );
+
+    // consumer side (drop-oldest を行う producer からも呼ばれる)
+    Slot* TryConsume();
+    void Release( Slot* slot );
+
+    // 満杯なら最も古いデータを 1 件だけ捨ててから取り直す。
+    // 捨てたスロットは on_drop( Slot* ) に渡してから返却し、*dropped を true にする。
+    // 読み出し側が送信中のスロットを持っている場合などは、捨てても空かずに nullptr を返す。
+    template <class DropHandler>
+    Slot* TryReserveDropOldest( DropHandler&& on_drop, bool* dropped );
+
+private:
+
+    std::unique_ptr<Slot[]>    m_Slots;
+    std::unique_ptr<uint8_t[]> m_PayloadPool;
+    size_t                     m_SlotCount;
+    uint32_t                   m_Mask;
+    size_t                     m_PayloadCapacity;
+
+    std::atomic<uint32_t>      m_EnqueuePos;
+    std::atomic<uint32_t>      m_DequeuePos;
+};
+
+template <class DropHandler>
+PublishRingBuffer::Slot* PublishRingBuffer::TryReserveDropOldest( DropHandler&& on_drop, bool* dropped )
+{
+    *dropped = false;
+
+    Slot* slot = TryReserve();
+    if( slot ){
+        return slot;
+    }
+
+    Slot* oldest = TryConsume();
+    if( oldest == nullptr ){
+        // 先頭がまだ書き込み中のため捨てられない
+        return nullptr;
+    }
+    on_drop( oldest );
+    Release( oldest );
+    *dropped = true;
+
+    return TryReserve();
+}
+
+#endif      // PUBLISH_RING_BUFFER_HPP_INCLUDED
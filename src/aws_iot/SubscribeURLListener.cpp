@@ -1,6 +1,8 @@
 
 #include "SubscribeURLListener.hpp"
 #include "UploadImageS3.hpp"
+#include "JobExecutor.hpp"
+#include "DNSResolverCache.hpp"
 
 #include "esp_log.h"
 
@@ -12,53 +14,83 @@ SubscribeURLListener::SubscribeURLListener()
 SubscribeURLListener::~SubscribeURLListener()
 {}
 
-void SubscribeURLListener::SubscribeHandler( const std::string& topic, const SubscribePayloadArray& payload )
+void SubscribeURLListener::SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload )
 {
+    // トピックの判定は AWS_IoT_ClientWrapper のルーターで済んでいる
     ESP_LOGI( sk_AWSSubTag, "Subscribe callback" );
-    if( topic == "esp32/sub/url" ){
-        // payload はNULL終端されていない可能性があるので、std::string にコピーしておく
-        // 無駄かもしれないけど念のため
-        std::string str;
-        std::copy( payload.begin(), payload.end(), std::back_inserter(str) );
-        ESP_LOGI( sk_AWSSubTag, "Received String: %s", str.c_str() );
 
-        cameraCaptureToUploadS3( str );
+    // payload はNULL終端されていないので、長さ指定で扱う。CBOR の場合は読めないので長さだけ出す。
+    UploadCommand command;
+    if( !UploadCommandParser::Parse( payload, &command ) ){
+        // 読めたところまでに id があれば出す
+        ESP_LOGE( sk_AWSSubTag, "Failed to parse command. length=%u, RequestId=%.*s", static_cast<unsigned>(payload.size()),
+                  (int)command.RequestId.size(), command.RequestId.data() );
+        return;
     }
-}
 
-void SubscribeURLListener::cameraCaptureToUploadS3( const std::string& str )
-{
-    const std::string delim = "/";
-    std::vector<std::string> params;
-    
-    std::string::size_type before_pos = 0;
-    std::string::size_type find_pos = std::string::npos;
+    // 撮影している間にアップロード先の名前解決を済ませておく
+    DNSResolverCache::Instance().Prefetch( std::string( command.Host ) );
 
-    while( 1 ){
-        find_pos = str.find( delim, before_pos );
-        if( find_pos == std::string::npos ){
-            params.push_back( str.substr( before_pos ) );
-            break;
-        }
-
-        params.push_back( str.substr( before_pos, find_pos - before_pos ) );
-        before_pos = find_pos + 1;
+    // 撮影とアップロードには数秒かかるので、MQTT タスクを止めないようワーカーに任せる
+    RetainedSubscribeMessage::Ptr message = Retain( topic, payload );
+    if( !message ){
+        ESP_LOGE( sk_AWSSubTag, "Failed to retain message." );
+        return;
     }
 
-    if( params.size() != 3 ){
-        ESP_LOGE( sk_AWSSubTag, "Failed to Parse URL" );
-        return;
+    JobExecutor::Job job = { UploadJob, message.get() };
+    if( JobExecutor::Instance().Submit( job, JobExecutor::Priority::Normal ) ){
+        // 所有権はジョブへ
+        message.release();
+    }
+    else {
+        ESP_LOGE( sk_AWSSubTag, "Failed to submit upload job." );
     }
+}
+
+void SubscribeURLListener::UploadJob( void* arg )
+{
+    RetainedSubscribeMessage::Ptr message( reinterpret_cast<RetainedSubscribeMessage*>(arg) );
 
-    const std::string& filename   = params[0];
-    const std::string& webserver  = params[1];
-    const std::string& url_params = params[2];
+    // command の文字列は message の中を指す
+    UploadCommand command;
+    if( UploadCommandParser::Parse( message->Payload(), &command ) ){
+        cameraCaptureToUploadS3( command );
+    }
+}
 
-    ESP_LOGI( sk_AWSSubTag, "Upload Params: FileName=%s", filename.c_str() );
-    ESP_LOGI( sk_AWSSubTag, "Upload Params: WebServer=%s", webserver.c_str() );
-    ESP_LOGI( sk_AWSSubTag, "Upload Params: URLParams=%s", url_params.c_str() );
+void SubscribeURLListener::cameraCaptureToUploadS3( const UploadCommand& command )
+{
+    const FrameTransform& transform = command.Transform;
+    const CropRegion& crop = transform.Crop;
+    ESP_LOGI( sk_AWSSubTag, "Upload Params: Version=%u, RequestId=%.*s, FileName=%.*s",
+              static_cast<unsigned>(command.Version), (int)command.RequestId.size(), command.RequestId.data(),
+              (int)command.FileName.size(), command.FileName.data() );
+    ESP_LOGI( sk_AWSSubTag, "Upload Params: WebServer=%.*s", (int)command.Host.size(), command.Host.data() );
+    for( size_t i = 0; i < command.UrlCount; ++i ){
+        ESP_LOGI( sk_AWSSubTag, "Upload Params: URL[%u]=%.*s", static_cast<unsigned>(i), (int)command.Urls[i].size(), command.Urls[i].data() );
+    }
+    ESP_LOGI( sk_AWSSubTag, "Upload Params: Size=%s, Quality=%u, Crop=(%u,%u %ux%u), Pre=%u",
+              FrameScaleName( transform.Scale ), transform.Quality, crop.X, crop.Y, crop.Width, crop.Height,
+              static_cast<unsigned>(command.PreCount) );
 
-    if( !UploadImageS3( webserver, url_params ) ){
-        ESP_LOGE( sk_AWSSubTag, "Failed to Upload Image to AWS S3." );
+    // HTTPUploadClient は接続先毎に std::string で保持するので、ここで初めて複製する
+    std::string webserver( command.Host );
+    bool result = false;
+    if( command.UrlCount > 1 || command.PreCount > 0 ){
+        std::vector<std::string> urls( command.Urls, command.Urls + command.UrlCount );
+        result = UploadImageS3Burst( webserver, urls, transform, command.PreCount );
     }
-}
\ No newline at end of file
+    else {
+        result = UploadImageS3( webserver, std::string( command.Urls[0] ), transform );
+    }
+    if( !result ){
+        // 変換できなかった場合も、元の画像で代用せずにここへ来る
+        ESP_LOGE( sk_AWSSubTag, "Failed to Upload Image to AWS S3. RequestId=%.*s",
+                  (int)command.RequestId.size(), command.RequestId.data() );
+    }
+
+    DNSResolverCache::Statistics dns = DNSResolverCache::Instance().GetStatistics();
+    ESP_LOGI( sk_AWSSubTag, "DNS cache: hit=%u miss=%u stale=%u failure=%u prefetch=%u",
+              dns.Hits, dns.Misses, dns.StaleServed, dns.Failures, dns.Prefetches );
+}
@@ -2,22 +2,25 @@
 #define     I_SUBSCRIBE_URL_LISTENNER_INCLUDED
 
 #include <cstdint>
-#include "I_SubscribeListener.hpp"
+#include <string>
+#include "I_SubscribeViewListener.hpp"
+#include "UploadCommand.hpp"
 
-class SubscribeURLListener : public I_SubscribeListener
+class SubscribeURLListener : public I_SubscribeViewListener
 {
 public:
 
     SubscribeURLListener();
     virtual ~SubscribeURLListener() noexcept;
 
-    virtual void SubscribeHandler( const std::string& topic, const SubscribePayloadArray& payload );
+    virtual void SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload ) override;
 
     static inline constexpr char sk_AWSSubTag[] = "AWS_Sub";
 
 private:
 
-    void cameraCaptureToUploadS3( const std::string& str );
+    static void UploadJob( void* arg );
+    static void cameraCaptureToUploadS3( const UploadCommand& command );
 };
 
 #endif    // I_SUBSCRIBE_URL_LISTENNER_INCLUDED
@@ -0,0 +1,377 @@
+
+#include "TelemetryPublisher.hpp"
+#include "AWS_IoTClientWrapper.hpp"
+#include "JobExecutor.hpp"
+#include "Metrics.hpp"
+
+#include <cstdlib>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+
+namespace
+{
+    constexpr TelemetryKey sk_KeyId( "id" );
+    constexpr TelemetryKey sk_KeyUptime( "uptime" );
+    constexpr TelemetryKey sk_KeyWindow( "window" );
+    constexpr TelemetryKey sk_KeyHeap( "heap" );
+    constexpr TelemetryKey sk_KeyRssi( "rssi" );
+    constexpr TelemetryKey sk_KeyJobs( "jobs" );
+    constexpr TelemetryKey sk_KeyPublishQueue( "pubq" );
+    constexpr TelemetryKey sk_KeyUpload( "upload_ms" );
+    constexpr TelemetryKey sk_KeyReconnects( "reconnects" );
+    constexpr TelemetryKey sk_KeyLatency( "p90_us" );
+
+    // 設定コマンドでの名前。Metric の順。
+    const char* const sk_MetricNames[] = {
+        "heap", "rssi", "jobs", "pubq", "upload", "reconnects", "latency",
+    };
+    static_assert( sizeof(sk_MetricNames) / sizeof(sk_MetricNames[0]) == static_cast<size_t>(TelemetryPublisher::Metric::Count), "metric names mismatch" );
+
+    // [min, max, mean, count]
+    template <size_t N>
+    void WriteGauge( TelemetryWriter* writer, const TelemetryKey<N>& key, int32_t min, int32_t max, int64_t sum, uint32_t count )
+    {
+        if( count == 0 ){
+            return;
+        }
+        writer->BeginArray( key );
+        writer->Value( min );
+        writer->Value( max );
+        writer->Value( static_cast<int32_t>(sum / count) );
+        writer->Value( count );
+        writer->EndArray();
+    }
+}
+
+TelemetryPublisher::TelemetryPublisher()
+    : m_Config(),
+      m_Task( nullptr ),
+      m_Window(),
+      m_LastDisconnects( 0 )
+{
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+TelemetryPublisher::~TelemetryPublisher()
+{}
+
+TelemetryPublisher& TelemetryPublisher::Instance()
+{
+    static TelemetryPublisher s_Instance;
+    return s_Instance;
+}
+
+bool TelemetryPublisher::Start( const Config& config )
+{
+    if( m_Task || !config.Topic.IsValid() || config.ClientId == nullptr || config.SampleIntervalSec == 0 ){
+        return false;
+    }
+
+    if( !lock() ){
+        return false;
+    }
+    m_Config = config;
+    unlock();
+
+    m_LastDisconnects = AWS_IoT_ClientWrapper::Instance().GetPublishStatistics().Disconnects;
+    if( xTaskCreatePinnedToCore( PublishTask, "Telemetry", sk_TaskStackSize, this, sk_TaskPriority, &m_Task, sk_TaskCoreId ) != pdPASS ){
+        ESP_LOGE( sk_Tag, "Failed to create publish task." );
+        m_Task = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void TelemetryPublisher::Record( Metric metric, int32_t value )
+{
+    size_t index = static_cast<size_t>(metric);
+    if( index >= static_cast<size_t>(Metric::Count) || !lock() ){
+        return;
+    }
+
+    Aggregate& aggregate = m_Window[index];
+    if( aggregate.Count == 0 || value < aggregate.Min ){
+        aggregate.Min = value;
+    }
+    if( aggregate.Count == 0 || value > aggregate.Max ){
+        aggregate.Max = value;
+    }
+    aggregate.Sum += value;
+    ++aggregate.Count;
+
+    unlock();
+}
+
+TelemetryPublisher::Config TelemetryPublisher::GetConfig() const
+{
+    Config config = {};
+    if( lock() ){
+        config = m_Config;
+        unlock();
+    }
+    return config;
+}
+
+bool TelemetryPublisher::Configure( std::string_view command )
+{
+    Config config = GetConfig();
+    if( config.ClientId == nullptr ){
+        // Start() 前
+        return false;
+    }
+
+    // "interval=60,sample=5,metrics=heap+rssi,format=json"
+    while( !command.empty() ){
+        std::string_view::size_type end = command.find( ',' );
+        std::string_view item = command.substr( 0, end );
+        command = (end == std::string_view::npos) ? std::string_view() : command.substr( end + 1 );
+
+        std::string_view::size_type eq = item.find( '=' );
+        if( eq == std::string_view::npos ){
+            ESP_LOGW( sk_Tag, "Invalid config item: %.*s", (int)item.size(), item.data() );
+            return false;
+        }
+        std::string_view key   = item.substr( 0, eq );
+        std::string_view value = item.substr( eq + 1 );
+
+        bool result = false;
+        if( key == "interval" ){
+            result = parseUnsigned( value, &config.IntervalSec ) && config.IntervalSec <= sk_MaxIntervalSec;
+        }
+        else if( key == "sample" ){
+            result = parseUnsigned( value, &config.SampleIntervalSec ) &&
+                     config.SampleIntervalSec > 0 && config.SampleIntervalSec <= sk_MaxIntervalSec;
+        }
+        else if( key == "metrics" ){
+            result = parseMetrics( value, &config.MetricMask );
+        }
+        else if( key == "format" ){
+            result = true;
+            if( value == "json" ){
+                config.PayloadFormat = TelemetryWriter::Format::JSON;
+            }
+            else if( value == "cbor" ){
+                config.PayloadFormat = TelemetryWriter::Format::CBOR;
+            }
+            else {
+                result = false;
+            }
+        }
+
+        if( !result ){
+            ESP_LOGW( sk_Tag, "Invalid config item: %.*s", (int)item.size(), item.data() );
+            return false;
+        }
+    }
+
+    if( !lock() ){
+        return false;
+    }
+    m_Config = config;
+    unlock();
+
+    ESP_LOGI( sk_Tag, "Configured. interval=%us sample=%us metrics=0x%02x format=%s",
+              static_cast<unsigned>(config.IntervalSec), static_cast<unsigned>(config.SampleIntervalSec),
+              static_cast<unsigned>(config.MetricMask),
+              (config.PayloadFormat == TelemetryWriter::Format::CBOR) ? "cbor" : "json" );
+
+    // 待っている間隔を新しい設定でやり直させる
+    if( m_Task ){
+        xTaskNotifyGive( m_Task );
+    }
+    return true;
+}
+
+void TelemetryPublisher::SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload )
+{
+    // 解釈するだけなので、MQTT タスクでそのまま処理する
+    Configure( payload.AsString() );
+}
+
+void TelemetryPublisher::PublishTask( void* param )
+{
+    TelemetryPublisher* instance = reinterpret_cast<TelemetryPublisher*>(param);
+    instance->run();
+
+    instance->m_Task = nullptr;
+    vTaskDelete( nullptr );
+}
+
+void TelemetryPublisher::run()
+{
+    int64_t window_start = esp_timer_get_time();
+
+    while( true ){
+        Config config = GetConfig();
+        portTickType wait = (config.IntervalSec == 0) ? portMAX_DELAY : (config.SampleIntervalSec * 1000 / portTICK_PERIOD_MS);
+        if( ulTaskNotifyTake( pdTRUE, wait ) != 0 ){
+            // 設定が変わった
+            continue;
+        }
+
+        sample( config.MetricMask );
+
+        int64_t now = esp_timer_get_time();
+        uint32_t window_sec = static_cast<uint32_t>((now - window_start) / 1000000);
+        if( window_sec >= config.IntervalSec ){
+            publish( config, window_sec );
+            window_start = now;
+        }
+    }
+}
+
+void TelemetryPublisher::sample( uint32_t mask )
+{
+    if( mask & MetricBit( Metric::FreeHeap ) ){
+        Record( Metric::FreeHeap, static_cast<int32_t>(esp_get_free_heap_size()) );
+    }
+    if( mask & MetricBit( Metric::WifiRssi ) ){
+        wifi_ap_record_t ap_info;
+        // 未接続の間は記録しない
+        if( esp_wifi_sta_get_ap_info( &ap_info ) == ESP_OK ){
+            Record( Metric::WifiRssi, ap_info.rssi );
+        }
+    }
+    if( mask & MetricBit( Metric::JobQueue ) ){
+        Record( Metric::JobQueue, static_cast<int32_t>(JobExecutor::Instance().PendingJobCount()) );
+    }
+    if( mask & MetricBit( Metric::PublishQueue ) ){
+        Record( Metric::PublishQueue, static_cast<int32_t>(AWS_IoT_ClientWrapper::Instance().GetPublishStatistics().Queued) );
+    }
+}
+
+void TelemetryPublisher::publish( const Config& config, uint32_t window_sec )
+{
+    // 集計を取り出して次の間隔を始める
+    Aggregate window[static_cast<size_t>(Metric::Count)];
+    if( !lock() ){
+        return;
+    }
+    for( size_t i = 0; i < static_cast<size_t>(Metric::Count); ++i ){
+        window[i] = m_Window[i];
+        m_Window[i] = Aggregate();
+    }
+    unlock();
+
+    AWS_IoT_ClientWrapper& client = AWS_IoT_ClientWrapper::Instance();
+    uint32_t disconnects = client.GetPublishStatistics().Disconnects;
+    uint32_t reconnects = disconnects - m_LastDisconnects;
+    m_LastDisconnects = disconnects;
+
+    AWS_IoT_ClientWrapper::PublishResult result = client.PublishLatest( config.Topic, [&]( uint8_t* buf, size_t capacity ) -> size_t {
+        TelemetryWriter writer( buf, capacity, config.PayloadFormat );
+        return writePayload( &writer, config, window_sec, window, reconnects );
+    } );
+    if( result == AWS_IoT_ClientWrapper::PublishResult::PayloadTooLarge ){
+        ESP_LOGW( sk_Tag, "Telemetry too large. Reduce metrics." );
+    }
+}
+
+size_t TelemetryPublisher::writePayload( TelemetryWriter* writer, const Config& config, uint32_t window_sec,
+                                         const Aggregate* window, uint32_t reconnects )
+{
+    const Aggregate& heap   = window[static_cast<size_t>(Metric::FreeHeap)];
+    const Aggregate& rssi   = window[static_cast<size_t>(Metric::WifiRssi)];
+    const Aggregate& jobs   = window[static_cast<size_t>(Metric::JobQueue)];
+    const Aggregate& pubq   = window[static_cast<size_t>(Metric::PublishQueue)];
+    const Aggregate& upload = window[static_cast<size_t>(Metric::UploadMs)];
+    uint32_t mask = config.MetricMask;
+
+    writer->BeginObject();
+    writer->Field( sk_KeyId, config.ClientId );
+    writer->Field( sk_KeyUptime, static_cast<uint32_t>(esp_timer_get_time() / 1000000) );
+    writer->Field( sk_KeyWindow, window_sec );
+    if( mask & MetricBit( Metric::FreeHeap ) ){
+        WriteGauge( writer, sk_KeyHeap, heap.Min, heap.Max, heap.Sum, heap.Count );
+    }
+    if( mask & MetricBit( Metric::WifiRssi ) ){
+        WriteGauge( writer, sk_KeyRssi, rssi.Min, rssi.Max, rssi.Sum, rssi.Count );
+    }
+    if( mask & MetricBit( Metric::JobQueue ) ){
+        WriteGauge( writer, sk_KeyJobs, jobs.Min, jobs.Max, jobs.Sum, jobs.Count );
+    }
+    if( mask & MetricBit( Metric::PublishQueue ) ){
+        WriteGauge( writer, sk_KeyPublishQueue, pubq.Min, pubq.Max, pubq.Sum, pubq.Count );
+    }
+    if( mask & MetricBit( Metric::UploadMs ) ){
+        WriteGauge( writer, sk_KeyUpload, upload.Min, upload.Max, upload.Sum, upload.Count );
+    }
+    if( mask & MetricBit( Metric::Reconnects ) ){
+        writer->Field( sk_KeyReconnects, reconnects );
+    }
+    if( mask & MetricBit( Metric::Latency ) ){
+        writer->BeginObject( sk_KeyLatency );
+        Metrics::WriteSummary( writer );
+        writer->EndObject();
+    }
+    writer->EndObject();
+
+    return writer->PayloadLength();
+}
+
+bool TelemetryPublisher::parseMetrics( std::string_view list, uint32_t* mask )
+{
+    // "heap+rssi+upload" / "all" / "none"
+    if( list == "all" ){
+        *mask = (1u << static_cast<uint32_t>(Metric::Count)) - 1;
+        return true;
+    }
+    if( list == "none" ){
+        *mask = 0;
+        return true;
+    }
+
+    uint32_t result = 0;
+    while( !list.empty() ){
+        std::string_view::size_type end = list.find( '+' );
+        std::string_view name = list.substr( 0, end );
+        list = (end == std::string_view::npos) ? std::string_view() : list.substr( end + 1 );
+
+        size_t i = 0;
+        while( i < static_cast<size_t>(Metric::Count) && name != sk_MetricNames[i] ){
+            ++i;
+        }
+        if( i == static_cast<size_t>(Metric::Count) ){
+            return false;
+        }
+        result |= 1u << i;
+    }
+
+    *mask = result;
+    return true;
+}
+
+bool TelemetryPublisher::parseUnsigned( std::string_view str, uint32_t* value )
+{
+    if( str.empty() || str.size() > 9 ){
+        return false;
+    }
+
+    uint32_t result = 0;
+    for( char c : str ){
+        if( c < '0' || c > '9' ){
+            return false;
+        }
+        result = result * 10 + static_cast<uint32_t>(c - '0');
+    }
+
+    *value = result;
+    return true;
+}
+
+bool TelemetryPublisher::lock() const
+{
+    return xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) == pdTRUE;
+}
+
+void TelemetryPublisher::unlock() const
+{
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef     TELEMETRY_PUBLISHER_HPP_INCLUDED
+#define     TELEMETRY_PUBLISHER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "I_SubscribeViewListener.hpp"
+#include "MQTTTopic.hpp"
+#include "TelemetryWriter.hpp"
+
+//
+// 端末の状態を定期的に集計して 1 通にまとめて送る
+//
+// ゲージは送信間隔の中で min / max / mean / 件数に集計し、カウンタは間隔中の増分を送る。
+// 設定は購読トピックへ "interval=60,sample=5,metrics=heap+rssi,format=cbor" の形で送ると実行中に変わる。
+//
+class TelemetryPublisher : public I_SubscribeViewListener
+{
+public:
+
+    enum class Metric : uint8_t
+    {
+        FreeHeap = 0,       // 空きヒープ (byte)
+        WifiRssi,           // 接続中の AP の RSSI (dBm)
+        JobQueue,           // JobExecutor の待ちジョブ数
+        PublishQueue,       // MQTT の送信待ち数
+        UploadMs,           // アップロード 1 回の所要時間。Record() で与える。
+        Reconnects,         // MQTT の切断回数 (カウンタ)
+        Latency,            // Metrics の段階毎の 90 パーセンタイル
+        Count
+    };
+
+    struct Config
+    {
+        uint32_t IntervalSec;           // 0 で送信しない
+        uint32_t SampleIntervalSec;
+        uint32_t MetricMask;            // 1 << Metric
+        TelemetryWriter::Format PayloadFormat;
+        MQTTTopic Topic;
+        const char* ClientId;
+    };
+
+    static inline constexpr char sk_Tag[] = "Telemetry";
+
+public:
+
+    // DO NOT COPY
+    TelemetryPublisher( const TelemetryPublisher& ) = delete;
+    TelemetryPublisher& operator=( const TelemetryPublisher& ) = delete;
+
+    static TelemetryPublisher& Instance();
+
+    bool Start( const Config& config );
+
+    // どのタスクからでも呼べる
+    void Record( Metric metric, int32_t value );
+
+    Config GetConfig() const;
+    // "key=value,..." を解釈して設定を変える。不正な項目があれば何も変えない。
+    bool Configure( std::string_view command );
+
+    virtual void SubscribeViewHandler( std::string_view topic, SubscribePayloadView payload ) override;
+
+    static uint32_t MetricBit( Metric metric )
+    {
+        return 1u << static_cast<uint32_t>(metric);
+    }
+
+private:
+
+    TelemetryPublisher();
+    virtual ~TelemetryPublisher() noexcept;
+
+    static const uint32_t sk_TaskStackSize = 4096;
+    static const UBaseType_t sk_TaskPriority = tskIDLE_PRIORITY + 2;
+    static const BaseType_t sk_TaskCoreId = 1;
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+    static const uint32_t sk_MaxIntervalSec = 86400;
+
+    struct Aggregate
+    {
+        int32_t  Min;
+        int32_t  Max;
+        int64_t  Sum;
+        uint32_t Count;
+    };
+
+    static void PublishTask( void* param );
+    void run();
+
+    void sample( uint32_t mask );
+    void publish( const Config& config, uint32_t window_sec );
+    size_t writePayload( TelemetryWriter* writer, const Config& config, uint32_t window_sec,
+                         const Aggregate* window, uint32_t reconnects );
+
+    static bool parseMetrics( std::string_view list, uint32_t* mask );
+    static bool parseUnsigned( std::string_view str, uint32_t* value );
+
+    bool lock() const;
+    void unlock() const;
+
+    Config           m_Config;
+    TaskHandle_t     m_Task;
+    Aggregate        m_Window[static_cast<size_t>(Metric::Count)];
+    uint32_t         m_LastDisconnects;
+    xSemaphoreHandle m_Mutex;
+};
+
+#endif    // TELEMETRY_PUBLISHER_HPP_INCLUDED
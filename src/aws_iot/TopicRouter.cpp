@@ -0,0 +1,233 @@
+
+#include "TopicRouter.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// "a/b/c" -> level="a", rest="b/c", has_more=true
+void splitLevel( std::string_view str, std::string_view* level, std::string_view* rest, bool* has_more )
+{
+    std::string_view::size_type pos = str.find( '/' );
+    if( pos == std::string_view::npos ){
+        *level    = str;
+        *rest     = std::string_view();
+        *has_more = false;
+    }
+    else {
+        *level    = str.substr( 0, pos );
+        *rest     = str.substr( pos + 1 );
+        *has_more = true;
+    }
+}
+
+}
+
+TopicRouter::TopicRouter()
+    : m_Nodes(),
+      m_FilterCount( 0 )
+{
+    // root
+    std::unique_ptr<Node> root( new Node() );
+    root->LevelHash = 0;
+    root->PlusChild = sk_NoNode;
+    root->HashChild = sk_NoNode;
+    m_Nodes.push_back( std::move( root ) );
+}
+
+TopicRouter::~TopicRouter()
+{}
+
+bool TopicRouter::IsValidFilter( std::string_view filter )
+{
+    if( filter.empty() || filter.size() > UINT16_MAX ){
+        return false;
+    }
+
+    std::string_view level;
+    std::string_view rest = filter;
+    bool has_more = true;
+    while( has_more ){
+        splitLevel( rest, &level, &rest, &has_more );
+
+        if( level.find( '#' ) != std::string_view::npos ){
+            // '#' は最後のレベルに単独でのみ使える
+            if( level.size() != 1 || has_more ){
+                return false;
+            }
+        }
+        if( level.find( '+' ) != std::string_view::npos && level.size() != 1 ){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+TopicRouter::Node* TopicRouter::Add( const MQTTTopic& filter, I_SubscribeViewListener* listener, bool* is_new_filter )
+{
+    *is_new_filter = false;
+    if( listener == nullptr || !filter.IsValid() || !IsValidFilter( filter.View() ) ){
+        return nullptr;
+    }
+
+    int16_t index = 0;
+    std::string_view level;
+    std::string_view rest = filter.View();
+    bool has_more = true;
+    while( has_more ){
+        splitLevel( rest, &level, &rest, &has_more );
+
+        int16_t child = sk_NoNode;
+        Node& node = *m_Nodes[index];
+        if( level == "+" ){
+            child = node.PlusChild;
+        }
+        else if( level == "#" ){
+            child = node.HashChild;
+        }
+        else {
+            child = findChild( node, level, MQTTTopic::Fnv1a( level ) );
+        }
+
+        if( child == sk_NoNode ){
+            child = addChild( index, level );
+            if( child == sk_NoNode ){
+                return nullptr;
+            }
+        }
+        index = child;
+    }
+
+    Node& node = *m_Nodes[index];
+    if( std::find( node.Listeners.begin(), node.Listeners.end(), listener ) != node.Listeners.end() ){
+        // 登録済み
+        return &node;
+    }
+
+    node.Listeners.push_back( listener );
+    if( node.Listeners.size() == 1 ){
+        if( node.Filter.empty() ){
+            node.Filter.assign( filter.Name, filter.Length );
+        }
+        ++m_FilterCount;
+        *is_new_filter = true;
+    }
+
+    return &node;
+}
+
+TopicRouter::Node* TopicRouter::Remove( const MQTTTopic& filter, I_SubscribeViewListener* listener, bool* is_last_listener )
+{
+    *is_last_listener = false;
+    if( !filter.IsValid() ){
+        return nullptr;
+    }
+
+    int16_t index = findNode( filter.View() );
+    if( index == sk_NoNode ){
+        return nullptr;
+    }
+
+    Node& node = *m_Nodes[index];
+    auto itr = std::find( node.Listeners.begin(), node.Listeners.end(), listener );
+    if( itr == node.Listeners.end() ){
+        return nullptr;
+    }
+    node.Listeners.erase( itr );
+
+    if( node.Listeners.empty() ){
+        // ノード自体は再登録に備えて残しておく。Filter は SDK の登録解除が済むまで呼び出し側が参照する。
+        --m_FilterCount;
+        *is_last_listener = true;
+    }
+
+    return &node;
+}
+
+const char* TopicRouter::FilterName( const Node* node )
+{
+    return (node != nullptr) ? node->Filter.c_str() : nullptr;
+}
+
+size_t TopicRouter::Dispatch( const Node* node, std::string_view topic, SubscribePayloadView payload )
+{
+    if( node == nullptr ){
+        return 0;
+    }
+
+    for( I_SubscribeViewListener* listener : node->Listeners ){
+        listener->SubscribeViewHandler( topic, payload );
+    }
+    return node->Listeners.size();
+}
+
+size_t TopicRouter::FilterCount() const
+{
+    return m_FilterCount;
+}
+
+int16_t TopicRouter::findNode( std::string_view filter ) const
+{
+    int16_t index = 0;
+    std::string_view level;
+    std::string_view rest = filter;
+    bool has_more = true;
+    while( has_more && index != sk_NoNode ){
+        splitLevel( rest, &level, &rest, &has_more );
+
+        const Node& node = *m_Nodes[index];
+        if( level == "+" ){
+            index = node.PlusChild;
+        }
+        else if( level == "#" ){
+            index = node.HashChild;
+        }
+        else {
+            index = findChild( node, level, MQTTTopic::Fnv1a( level ) );
+        }
+    }
+
+    return index;
+}
+
+int16_t TopicRouter::findChild( const Node& node, std::string_view level, uint32_t level_hash ) const
+{
+    for( int16_t child : node.Children ){
+        const Node& c = *m_Nodes[child];
+        if( c.LevelHash == level_hash && c.Level == level ){
+            return child;
+        }
+    }
+
+    return sk_NoNode;
+}
+
+int16_t TopicRouter::addChild( int16_t parent, std::string_view level )
+{
+    if( m_Nodes.size() >= static_cast<size_t>(INT16_MAX) ){
+        return sk_NoNode;
+    }
+
+    std::unique_ptr<Node> node( new Node() );
+    node->Level.assign( level.data(), level.size() );
+    node->LevelHash = MQTTTopic::Fnv1a( level );
+    node->PlusChild = sk_NoNode;
+    node->HashChild = sk_NoNode;
+
+    int16_t index = static_cast<int16_t>(m_Nodes.size());
+    m_Nodes.push_back( std::move( node ) );
+
+    Node& p = *m_Nodes[parent];
+    if( level == "+" ){
+        p.PlusChild = index;
+    }
+    else if( level == "#" ){
+        p.HashChild = index;
+    }
+    else {
+        p.Children.push_back( index );
+    }
+
+    return index;
+}
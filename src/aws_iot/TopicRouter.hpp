@@ -0,0 +1,76 @@
+#ifndef     TOPIC_ROUTER_HPP_INCLUDED
+#define     TOPIC_ROUTER_HPP_INCLUDED
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "MQTTTopic.hpp"
+#include "I_SubscribeViewListener.hpp"
+
+//
+// トピックフィルタのトライ木
+//
+// フィルタはレベル('/' 区切り)毎のノードとして登録され、'+' / '#' ワイルドカードに対応する。
+// 1 つのフィルタに複数のリスナーを登録できる。
+// スレッドセーフではないので、排他は呼び出し側で行うこと。
+//
+class TopicRouter
+{
+public:
+
+    // 登録したフィルタのノード。アドレスはルーターの生存中は変わらない。
+    struct Node
+    {
+        std::string     Level;
+        uint32_t        LevelHash;
+        std::vector<int16_t> Children;      // '+' '#' 以外の子ノード
+        int16_t         PlusChild;
+        int16_t         HashChild;
+        std::string     Filter;             // このノードで終わるフィルタの全体
+        std::vector<I_SubscribeViewListener*> Listeners;
+    };
+
+public:
+
+    TopicRouter();
+    ~TopicRouter() noexcept;
+
+    // DO NOT COPY
+    TopicRouter( const TopicRouter& ) = delete;
+    TopicRouter& operator=( const TopicRouter& ) = delete;
+
+    static bool IsValidFilter( std::string_view filter );
+
+    // is_new_filter には、このフィルタに初めてリスナーが付いたかどうかが入る。
+    Node* Add( const MQTTTopic& filter, I_SubscribeViewListener* listener, bool* is_new_filter );
+    // 戻り値はリスナーを外したノード (見つからなければ nullptr)。
+    // is_last_listener には、このフィルタのリスナーがいなくなったかどうかが入る。
+    Node* Remove( const MQTTTopic& filter, I_SubscribeViewListener* listener, bool* is_last_listener );
+
+    // フィルタ文字列 (ノードが保持しており、ルーターの生存中は有効)
+    static const char* FilterName( const Node* node );
+
+    // Add() が返したノードのリスナーだけを呼び出す。
+    // SDK は登録毎にマッチを判定してコールバックするので、ノードをコールバックの引数にしておけば探索は要らない。
+    // 戻り値は呼び出したリスナーの数。
+    static size_t Dispatch( const Node* node, std::string_view topic, SubscribePayloadView payload );
+
+    size_t FilterCount() const;
+
+private:
+
+    static constexpr int16_t sk_NoNode = -1;
+
+    int16_t findNode( std::string_view filter ) const;
+    int16_t findChild( const Node& node, std::string_view level, uint32_t level_hash ) const;
+    int16_t addChild( int16_t parent, std::string_view level );
+
+    // ノードのアドレスを固定するため unique_ptr で持つ (SDK が Filter を参照し続ける)
+    std::vector<std::unique_ptr<Node>> m_Nodes;
+    size_t m_FilterCount;
+};
+
+#endif    // TOPIC_ROUTER_HPP_INCLUDED
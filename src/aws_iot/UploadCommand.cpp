@@ -0,0 +1,748 @@
+#include "UploadCommand.hpp"
+
+#include <cstdint>
+
+namespace
+{
+    const uint8_t sk_CborUnsigned = 0;
+    const uint8_t sk_CborNegative = 1;
+    const uint8_t sk_CborBytes    = 2;
+    const uint8_t sk_CborText     = 3;
+    const uint8_t sk_CborArray    = 4;
+    const uint8_t sk_CborMap      = 5;
+    const uint8_t sk_CborTag      = 6;
+    const uint8_t sk_CborSimple   = 7;
+    const uint8_t sk_CborBreak    = 0xFF;
+
+    // 読み飛ばす値の入れ子の上限
+    const int sk_MaxSkipDepth = 8;
+
+    //
+    // JSON の読み取り
+    // 指示に必要な object 1 段と、その中の array 1 段だけを辿る。それより深い値は SkipValue() で飛ばす。
+    //
+    class JsonReader
+    {
+    public:
+
+        explicit JsonReader( std::string_view text )
+            : m_Text( text ),
+              m_Pos( 0 ),
+              m_First( true ),
+              m_Failed( false )
+        {}
+
+        bool EnterObject()
+        {
+            m_First = true;
+            return expect( '{' );
+        }
+
+        // object の終わりかエラーなら false
+        bool NextKey( std::string_view* key )
+        {
+            if( !beginMember( '}' ) ){
+                return false;
+            }
+            if( !ReadString( key ) || !expect( ':' ) ){
+                return false;
+            }
+            return true;
+        }
+
+        bool EnterArray()
+        {
+            m_First = true;
+            return expect( '[' );
+        }
+
+        // array の終わりかエラーなら false
+        bool NextElement()
+        {
+            return beginMember( ']' );
+        }
+
+        bool ReadString( std::string_view* str )
+        {
+            if( !expect( '"' ) ){
+                return false;
+            }
+            size_t begin = m_Pos;
+            while( m_Pos < m_Text.size() ){
+                char c = m_Text[m_Pos];
+                if( c == '"' ){
+                    *str = m_Text.substr( begin, m_Pos - begin );
+                    ++m_Pos;
+                    return true;
+                }
+                // エスケープを解くにはコピーが要るので受け付けない
+                if( c == '\\' || static_cast<uint8_t>(c) < 0x20 ){
+                    break;
+                }
+                ++m_Pos;
+            }
+            return fail();
+        }
+
+        bool ReadUnsigned( uint32_t* value )
+        {
+            skipSpace();
+            size_t begin = m_Pos;
+            uint64_t result = 0;
+            while( m_Pos < m_Text.size() && m_Text[m_Pos] >= '0' && m_Text[m_Pos] <= '9' ){
+                result = result * 10 + static_cast<uint64_t>(m_Text[m_Pos] - '0');
+                if( result > UINT32_MAX ){
+                    return fail();
+                }
+                ++m_Pos;
+            }
+            if( m_Pos == begin ){
+                return fail();
+            }
+            *value = static_cast<uint32_t>(result);
+            return true;
+        }
+
+        bool SkipValue()
+        {
+            skipSpace();
+            if( m_Pos >= m_Text.size() ){
+                return fail();
+            }
+
+            char c = m_Text[m_Pos];
+            if( c == '"' ){
+                return skipString();
+            }
+            if( c == '{' || c == '[' ){
+                // 文字列の中の括弧だけ気にして、対応する閉じ括弧まで飛ばす
+                int depth = 0;
+                while( m_Pos < m_Text.size() ){
+                    c = m_Text[m_Pos];
+                    if( c == '"' ){
+                        if( !skipString() ){
+                            return false;
+                        }
+                        continue;
+                    }
+                    ++m_Pos;
+                    if( c == '{' || c == '[' ){
+                        if( ++depth > sk_MaxSkipDepth ){
+                            return fail();
+                        }
+                    }
+                    else if( c == '}' || c == ']' ){
+                        if( --depth == 0 ){
+                            return true;
+                        }
+                    }
+                }
+                return fail();
+            }
+
+            // 数値、true, false, null
+            size_t begin = m_Pos;
+            while( m_Pos < m_Text.size() ){
+                c = m_Text[m_Pos];
+                if( c == ',' || c == '}' || c == ']' || isSpace( c ) ){
+                    break;
+                }
+                ++m_Pos;
+            }
+            return (m_Pos > begin) ? true : fail();
+        }
+
+        // object を閉じた後に余分なものがないこと
+        bool Finish()
+        {
+            skipSpace();
+            return !m_Failed && m_Pos == m_Text.size();
+        }
+
+        bool IsFailed() const
+        {
+            return m_Failed;
+        }
+
+    private:
+
+        static bool isSpace( char c )
+        {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        }
+
+        void skipSpace()
+        {
+            while( m_Pos < m_Text.size() && isSpace( m_Text[m_Pos] ) ){
+                ++m_Pos;
+            }
+        }
+
+        bool expect( char c )
+        {
+            skipSpace();
+            if( m_Pos >= m_Text.size() || m_Text[m_Pos] != c ){
+                return fail();
+            }
+            ++m_Pos;
+            return true;
+        }
+
+        bool beginMember( char close )
+        {
+            if( m_Failed ){
+                return false;
+            }
+            skipSpace();
+            if( m_Pos < m_Text.size() && m_Text[m_Pos] == close ){
+                ++m_Pos;
+                // 閉じた array は外側の object の値なので、次は ',' が要る
+                m_First = false;
+                return false;
+            }
+            if( !m_First && !expect( ',' ) ){
+                return false;
+            }
+            m_First = false;
+            return true;
+        }
+
+        bool skipString()
+        {
+            ++m_Pos;
+            while( m_Pos < m_Text.size() ){
+                char c = m_Text[m_Pos++];
+                if( c == '\\' ){
+                    ++m_Pos;
+                }
+                else if( c == '"' ){
+                    return true;
+                }
+            }
+            return fail();
+        }
+
+        bool fail()
+        {
+            m_Failed = true;
+            return false;
+        }
+
+        std::string_view m_Text;
+        size_t           m_Pos;
+        bool             m_First;
+        bool             m_Failed;
+    };
+
+    //
+    // CBOR の読み取り
+    // JsonReader と同じ使い方ができる。長さ固定と長さ不定の両方の map / array を受け付ける。
+    //
+    class CborReader
+    {
+    public:
+
+        explicit CborReader( SubscribePayloadView data )
+            : m_Data( data ),
+              m_Pos( 0 ),
+              m_ObjectRemaining( 0 ),
+              m_ArrayRemaining( 0 ),
+              m_InArray( false ),
+              m_Failed( false )
+        {}
+
+        bool EnterObject()
+        {
+            return enterContainer( sk_CborMap, &m_ObjectRemaining );
+        }
+
+        bool NextKey( std::string_view* key )
+        {
+            m_InArray = false;
+            if( !nextItem( &m_ObjectRemaining ) ){
+                return false;
+            }
+            return ReadString( key );
+        }
+
+        bool EnterArray()
+        {
+            if( !enterContainer( sk_CborArray, &m_ArrayRemaining ) ){
+                return false;
+            }
+            m_InArray = true;
+            return true;
+        }
+
+        bool NextElement()
+        {
+            if( !m_InArray || !nextItem( &m_ArrayRemaining ) ){
+                m_InArray = false;
+                return false;
+            }
+            return true;
+        }
+
+        bool ReadString( std::string_view* str )
+        {
+            uint8_t major = 0;
+            uint64_t length = 0;
+            bool indefinite = false;
+            if( !readHead( &major, &length, &indefinite ) ){
+                return false;
+            }
+            if( major != sk_CborText || indefinite || length > m_Data.size() - m_Pos ){
+                return fail();
+            }
+            *str = std::string_view( reinterpret_cast<const char*>(m_Data.data() + m_Pos), static_cast<size_t>(length) );
+            m_Pos += static_cast<size_t>(length);
+            return true;
+        }
+
+        bool ReadUnsigned( uint32_t* value )
+        {
+            uint8_t major = 0;
+            uint64_t argument = 0;
+            bool indefinite = false;
+            if( !readHead( &major, &argument, &indefinite ) ){
+                return false;
+            }
+            if( major != sk_CborUnsigned || argument > UINT32_MAX ){
+                return fail();
+            }
+            *value = static_cast<uint32_t>(argument);
+            return true;
+        }
+
+        bool SkipValue()
+        {
+            return skip( 0 );
+        }
+
+        bool Finish()
+        {
+            return !m_Failed && m_Pos == m_Data.size();
+        }
+
+        bool IsFailed() const
+        {
+            return m_Failed;
+        }
+
+    private:
+
+        // 長さ不定の map / array の残り要素数
+        static const uint64_t sk_Indefinite = UINT64_MAX;
+
+        bool readHead( uint8_t* major, uint64_t* argument, bool* indefinite )
+        {
+            if( m_Failed || m_Pos >= m_Data.size() ){
+                return fail();
+            }
+            uint8_t initial = m_Data[m_Pos++];
+            *major = initial >> 5;
+            *indefinite = false;
+
+            uint8_t info = initial & 0x1F;
+            if( info < 24 ){
+                *argument = info;
+                return true;
+            }
+            if( info == 31 ){
+                *indefinite = true;
+                *argument = 0;
+                return true;
+            }
+            if( info > 27 ){
+                return fail();
+            }
+
+            size_t bytes = static_cast<size_t>(1) << (info - 24);
+            if( bytes > m_Data.size() - m_Pos ){
+                return fail();
+            }
+            uint64_t result = 0;
+            for( size_t i = 0; i < bytes; ++i ){
+                result = (result << 8) | m_Data[m_Pos++];
+            }
+            *argument = result;
+            return true;
+        }
+
+        bool enterContainer( uint8_t expected, uint64_t* remaining )
+        {
+            uint8_t major = 0;
+            uint64_t count = 0;
+            bool indefinite = false;
+            if( !readHead( &major, &count, &indefinite ) ){
+                return false;
+            }
+            if( major != expected ){
+                return fail();
+            }
+            *remaining = indefinite ? sk_Indefinite : count;
+            return true;
+        }
+
+        bool nextItem( uint64_t* remaining )
+        {
+            if( m_Failed ){
+                return false;
+            }
+            if( *remaining == sk_Indefinite ){
+                if( m_Pos >= m_Data.size() ){
+                    return fail();
+                }
+                if( m_Data[m_Pos] == sk_CborBreak ){
+                    ++m_Pos;
+                    return false;
+                }
+                return true;
+            }
+            if( *remaining == 0 ){
+                return false;
+            }
+            --(*remaining);
+            return true;
+        }
+
+        bool skipBytes( uint64_t length )
+        {
+            if( length > m_Data.size() - m_Pos ){
+                return fail();
+            }
+            m_Pos += static_cast<size_t>(length);
+            return true;
+        }
+
+        bool skip( int depth )
+        {
+            if( depth > sk_MaxSkipDepth ){
+                return fail();
+            }
+
+            uint8_t major = 0;
+            uint64_t argument = 0;
+            bool indefinite = false;
+            if( !readHead( &major, &argument, &indefinite ) ){
+                return false;
+            }
+
+            switch( major ){
+            case sk_CborUnsigned:
+            case sk_CborNegative:
+                return !indefinite || fail();
+            case sk_CborBytes:
+            case sk_CborText:
+                if( !indefinite ){
+                    return skipBytes( argument );
+                }
+                // 長さ不定の文字列は、長さ固定の断片の並び
+                while( m_Pos < m_Data.size() && m_Data[m_Pos] != sk_CborBreak ){
+                    if( !readHead( &major, &argument, &indefinite ) || indefinite || !skipBytes( argument ) ){
+                        return fail();
+                    }
+                }
+                return skipBytes( 1 );
+            case sk_CborArray:
+            case sk_CborMap:
+                if( indefinite ){
+                    while( m_Pos < m_Data.size() && m_Data[m_Pos] != sk_CborBreak ){
+                        if( !skip( depth + 1 ) ){
+                            return false;
+                        }
+                    }
+                    return skipBytes( 1 );
+                }
+                if( major == sk_CborMap ){
+                    if( argument > m_Data.size() ){
+                        return fail();
+                    }
+                    argument *= 2;
+                }
+                for( uint64_t i = 0; i < argument; ++i ){
+                    if( !skip( depth + 1 ) ){
+                        return false;
+                    }
+                }
+                return true;
+            case sk_CborTag:
+                return !indefinite ? skip( depth + 1 ) : fail();
+            case sk_CborSimple:
+            default:
+                // 引数の読み取りで false / true / null / 浮動小数点の本体は済んでいる
+                return !indefinite || fail();
+            }
+        }
+
+        bool fail()
+        {
+            m_Failed = true;
+            return false;
+        }
+
+        SubscribePayloadView m_Data;
+        size_t               m_Pos;
+        uint64_t             m_ObjectRemaining;
+        uint64_t             m_ArrayRemaining;
+        bool                 m_InArray;
+        bool                 m_Failed;
+    };
+
+    // "/" で始まる URL も受け付ける。HTTPUploadClient は先頭に "/" を付けて送る。
+    std::string_view trimUrl( std::string_view url )
+    {
+        if( !url.empty() && url[0] == '/' ){
+            url.remove_prefix( 1 );
+        }
+        return url;
+    }
+
+    template <typename Reader>
+    bool parseFields( Reader& reader, UploadCommand* command )
+    {
+        if( !reader.EnterObject() ){
+            return false;
+        }
+
+        bool has_version = false;
+        std::string_view key;
+        while( reader.NextKey( &key ) ){
+            bool result = true;
+            if( key == "v" ){
+                uint32_t version = 0;
+                result = reader.ReadUnsigned( &version );
+                // 同じ版の中では項目を足すだけにするので、版が上がったものは解釈できない
+                if( result && (version == 0 || version > UploadCommand::sk_Version) ){
+                    return false;
+                }
+                command->Version = version;
+                has_version = true;
+            }
+            else if( key == "id" ){
+                result = reader.ReadString( &command->RequestId );
+            }
+            else if( key == "host" ){
+                result = reader.ReadString( &command->Host );
+            }
+            else if( key == "url" ){
+                if( command->UrlCount != 0 ){
+                    return false;
+                }
+                std::string_view url;
+                result = reader.ReadString( &url );
+                command->Urls[command->UrlCount++] = trimUrl( url );
+            }
+            else if( key == "urls" ){
+                if( command->UrlCount != 0 || !reader.EnterArray() ){
+                    return false;
+                }
+                while( reader.NextElement() ){
+                    std::string_view url;
+                    if( command->UrlCount >= UploadCommand::sk_MaxUrls || !reader.ReadString( &url ) ){
+                        return false;
+                    }
+                    command->Urls[command->UrlCount++] = trimUrl( url );
+                }
+            }
+            else if( key == "size" ){
+                std::string_view size;
+                result = reader.ReadString( &size ) && ParseFrameScale( size, &command->Transform.Scale );
+            }
+            else if( key == "quality" ){
+                // fmt2jpg の品質 (1 - 100)。大きいほど高画質。
+                uint32_t quality = 0;
+                result = reader.ReadUnsigned( &quality ) && quality >= 1 && quality <= 100;
+                command->Transform.Quality = static_cast<uint8_t>(quality);
+            }
+            else if( key == "crop" ){
+                uint32_t values[4] = {};
+                size_t count = 0;
+                if( !reader.EnterArray() ){
+                    return false;
+                }
+                while( reader.NextElement() ){
+                    if( count >= 4 || !reader.ReadUnsigned( &values[count] ) || values[count] > UINT16_MAX ){
+                        return false;
+                    }
+                    ++count;
+                }
+                result = (count == 4);
+                command->Transform.Crop.X      = static_cast<uint16_t>(values[0]);
+                command->Transform.Crop.Y      = static_cast<uint16_t>(values[1]);
+                command->Transform.Crop.Width  = static_cast<uint16_t>(values[2]);
+                command->Transform.Crop.Height = static_cast<uint16_t>(values[3]);
+            }
+            else if( key == "pre" ){
+                uint32_t pre_count = 0;
+                result = reader.ReadUnsigned( &pre_count );
+                command->PreCount = pre_count;
+            }
+            else {
+                result = reader.SkipValue();
+            }
+
+            if( !result || reader.IsFailed() ){
+                return false;
+            }
+        }
+
+        if( !reader.Finish() || !has_version || command->Host.empty() || command->UrlCount == 0 ){
+            return false;
+        }
+
+        // 受け付けてからデコード中に失敗させるより、ここで断る。
+        const FrameTransform& transform = command->Transform;
+        const CropRegion& crop = transform.Crop;
+        if( !crop.IsEmpty() ){
+            // 左上が撮影する画像の外にあるか、縮小すると 1 画素も残らない
+            uint8_t shift = static_cast<uint8_t>(transform.Scale);
+            uint32_t left   = crop.X;
+            uint32_t top    = crop.Y;
+            uint32_t right  = left + crop.Width;
+            uint32_t bottom = top + crop.Height;
+            if( left >= Camera::sk_FrameWidth || top >= Camera::sk_FrameHeight ||
+                (right >> shift) <= (left >> shift) || (bottom >> shift) <= (top >> shift) ){
+                return false;
+            }
+        }
+        // 元の大きさのまま再エンコードできるのは、RGB に展開できる大きさまで切り出す場合だけ
+        if( transform.Scale == FrameScale::Full && !transform.IsScaleOnly() ){
+            if( crop.IsEmpty() || static_cast<uint32_t>(crop.Width) * crop.Height > sk_MaxTransformPixels ){
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+//
+// class UploadCommandParser implemantation
+//
+
+bool UploadCommandParser::Parse( SubscribePayloadView payload, UploadCommand* command )
+{
+    *command = UploadCommand();
+
+    if( payload.empty() ){
+        return false;
+    }
+
+    // CBOR の map は major type 5 (0xA0 - 0xBF)
+    uint8_t first = payload[0];
+    if( (first >> 5) == sk_CborMap ){
+        CborReader reader( payload );
+        return parseFields( reader, command );
+    }
+
+    std::string_view str = payload.AsString();
+    std::string_view::size_type begin = str.find_first_not_of( " \t\r\n" );
+    if( begin != std::string_view::npos && str[begin] == '{' ){
+        JsonReader reader( str );
+        return parseFields( reader, command );
+    }
+
+    return parseLegacy( str, command );
+}
+
+bool UploadCommandParser::parseLegacy( std::string_view str, UploadCommand* command )
+{
+    // "filename/webserver/url[/;options]"
+    std::string_view::size_type first = str.find( '/' );
+    if( first == std::string_view::npos ){
+        return false;
+    }
+    std::string_view::size_type second = str.find( '/', first + 1 );
+    if( second == std::string_view::npos ){
+        return false;
+    }
+
+    command->Version  = 0;
+    command->FileName = str.substr( 0, first );
+    command->Host     = str.substr( first + 1, second - first - 1 );
+
+    // URL 自体が '/' で終わる "half" などを含むことがあるので、オプションは最後の "/;" の後ろだけ。
+    // オプションはカンマ区切り
+    //   half, quarter, eighth : 縮小版を送る
+    //   pre=<n>               : 先頭の n 個の URL にイベント以前の履歴のフレームを送る
+    static constexpr std::string_view sk_OptionsSeparator = "/;";
+    std::string_view url_params = str.substr( second + 1 );
+    std::string_view::size_type last = url_params.rfind( sk_OptionsSeparator );
+    if( last != std::string_view::npos ){
+        if( !parseOptions( url_params.substr( last + sk_OptionsSeparator.size() ), command ) ){
+            return false;
+        }
+        url_params = url_params.substr( 0, last );
+    }
+
+    // URL を空白区切りで複数並べた場合は、その枚数だけ連続撮影してアップロードする
+    std::string_view::size_type pos = 0;
+    while( pos < url_params.size() ){
+        std::string_view::size_type end = url_params.find( ' ', pos );
+        if( end == std::string_view::npos ){
+            end = url_params.size();
+        }
+        if( end > pos ){
+            if( command->UrlCount >= UploadCommand::sk_MaxUrls ){
+                return false;
+            }
+            command->Urls[command->UrlCount++] = url_params.substr( pos, end - pos );
+        }
+        pos = end + 1;
+    }
+
+    return !command->Host.empty() && command->UrlCount > 0;
+}
+
+bool UploadCommandParser::parseOptions( std::string_view str, UploadCommand* command )
+{
+    static constexpr std::string_view sk_PrePrefix = "pre=";
+
+    if( str.empty() ){
+        return false;
+    }
+
+    std::string_view::size_type pos = 0;
+    while( pos <= str.size() ){
+        std::string_view::size_type end = str.find( ',', pos );
+        if( end == std::string_view::npos ){
+            end = str.size();
+        }
+        std::string_view option = str.substr( pos, end - pos );
+        pos = end + 1;
+
+        if( option.empty() ){
+            continue;
+        }
+        if( option.substr( 0, sk_PrePrefix.size() ) == sk_PrePrefix ){
+            uint32_t pre_count = 0;
+            if( !parseUnsigned( option.substr( sk_PrePrefix.size() ), &pre_count ) ){
+                return false;
+            }
+            command->PreCount = pre_count;
+        }
+        else if( !ParseFrameScale( option, &command->Transform.Scale ) ){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool UploadCommandParser::parseUnsigned( std::string_view str, uint32_t* value )
+{
+    if( str.empty() || str.size() > 9 ){
+        return false;
+    }
+
+    uint32_t result = 0;
+    for( char c : str ){
+        if( c < '0' || c > '9' ){
+            return false;
+        }
+        result = result * 10 + static_cast<uint32_t>(c - '0');
+    }
+
+    *value = result;
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef     UPLOAD_COMMAND_HPP_INCLUDED
+#define     UPLOAD_COMMAND_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+#include "I_SubscribeViewListener.hpp"
+#include "JpegScaler.hpp"
+
+//
+// 撮影とアップロードの指示
+//
+// 文字列は全て受信したペイロードを指すので、ペイロードより長く使わないこと。
+//
+struct UploadCommand
+{
+    static inline constexpr uint32_t sk_Version = 1;
+    static inline constexpr size_t sk_MaxUrls = 16;
+
+    uint32_t         Version;           // 0 は旧形式 "filename/webserver/url[/;options]"
+    std::string_view RequestId;
+    std::string_view FileName;          // 旧形式のみ
+    std::string_view Host;
+    std::string_view Urls[sk_MaxUrls];
+    size_t           UrlCount;
+    FrameTransform   Transform;
+    size_t           PreCount;          // 先頭の URL に送る履歴のフレーム数
+};
+
+//
+// アップロード指示のパーサー
+//
+// ペイロードの先頭で形式を判定する。
+//   '{'              : JSON {"v":1,"id":"..","host":"..","urls":[".."],"size":"half","quality":12,"crop":[x,y,w,h],"pre":2}
+//   CBOR の map      : JSON と同じキーと値
+//   それ以外         : 旧形式 "filename/webserver/url url ...[/;half,pre=2]"
+// "url" は 1 つだけの場合に "urls" の代わりに使える。知らないキーは読み飛ばす。
+// "crop" の左上は撮影する画像 (Camera::sk_FrameWidth x sk_FrameHeight) の中にあり、縮小後も 1 画素以上残ること。
+// "size" が "full" のまま "quality" や "crop" を指定する場合は、sk_MaxTransformPixels 以下の "crop" が必要。
+// コピーしないため、JSON のエスケープを含む文字列は受け付けない (URL は既にエンコード済みのはず)。
+//
+class UploadCommandParser
+{
+public:
+
+    static bool Parse( SubscribePayloadView payload, UploadCommand* command );
+
+private:
+
+    static bool parseLegacy( std::string_view str, UploadCommand* command );
+    static bool parseOptions( std::string_view str, UploadCommand* command );
+    static bool parseUnsigned( std::string_view str, uint32_t* value );
+};
+
+#endif    // UPLOAD_COMMAND_HPP_INCLUDED
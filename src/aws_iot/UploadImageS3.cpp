@@ -1,108 +1,249 @@
 
 #include "UploadImageS3.hpp"
+#include "HTTPUploadClient.hpp"
 #include "Camera.hpp"
+#include "CaptureCoordinator.hpp"
+#include "FrameHistory.hpp"
+#include "JpegScaler.hpp"
 
-#include "lwip/err.h"
-#include "lwip/sockets.h"
-#include "lwip/sys.h"
-#include "lwip/netdb.h"
-#include "lwip/dns.h"
+#include <cstdlib>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "esp_log.h"
 
 const char sk_Tag[] = "UploadS3";
+const char sk_ContentType[] = "application/x-www-form-urlencoded";
+const int  sk_EncodeQuality = 80;
+const uint32_t sk_CaptureMaxAgeMs = 200;
+
+static bool UploadFrame( const std::string& webserver, const std::string& url, CameraFrameBuffer& fb, const FrameTransform& transform, size_t* sent );
+static bool UploadHistoryFrame( const std::string& webserver, const std::string& url, HistoryFrame& frame, const FrameTransform& transform, size_t* sent );
+static bool SelectDerivative( CameraFrameBuffer& fb, const FrameTransform& transform, const uint8_t** buffer, size_t* length,
+                              CameraFrameDerivative* owned );
+static size_t JpgEncodeUpload( void* arg, size_t index, const void* data, size_t len );
 
-bool UploadImageS3( const std::string& webserver, const std::string& url )
+bool UploadImageS3( const std::string& webserver, const std::string& url, const FrameTransform& transform )
 {
     if( webserver.empty() || url.empty() ){
         return false;
     }
 
-    CameraFrameBuffer fb = Camera::Instance().FrameBuffer();
-
-    char s3Request[2048]= {0};
-    sprintf( s3Request,
-             "PUT /%s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n", 
-              url.c_str(), webserver.c_str(), fb.Length() );
-
-    struct addrinfo hints = {};
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    // コマンドを受けた時点の画像を送る。直前に撮影済みならそれを使う。
+    CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( sk_CaptureMaxAgeMs );
+    if( !fb.IsValid() ){
+        ESP_LOGE( sk_Tag, "Camera capture failed." );
+        return false;
+    }
 
-    struct addrinfo *res = nullptr;
-    struct in_addr *addr = nullptr;
-    int sock = -1;
-    const char footer[] = "\r\n";
-    
-    int err = getaddrinfo( webserver.c_str(), "80", &hints, &res );
+    const uint8_t* buffer = fb.Buffer();
+    size_t length = fb.Length();
+    CameraFrameDerivative owned = {};
+    if( !SelectDerivative( fb, transform, &buffer, &length, &owned ) ){
+        return false;
+    }
 
-    if( err != 0 || res == NULL ) {
-        ESP_LOGE( sk_Tag, "DNS lookup failed err=%d res=%p", err, res );
+    HTTPResponse response;
+    bool result = HTTPUploadClient::Instance().Put( webserver, url, sk_ContentType, buffer, length, &response );
+    free( owned.Buffer );
+    if( !result ){
+        ESP_LOGE( sk_Tag, "... upload request failed" );
         return false;
     }
 
-    /* Code to print the resolved IP.
+    if( !response.IsSuccess() ){
+        ESP_LOGE( sk_Tag, "... upload rejected. status=%d", response.StatusCode );
+        return false;
+    }
 
-        Note: inet_ntoa is non-reentrant, look at ipaddr_ntoa_r for "real" code */
+    ESP_LOGI( sk_Tag, "... upload success. status=%d", response.StatusCode );
+    return true;
+}
 
-    addr = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
-    ESP_LOGI( sk_Tag, "DNS lookup succeeded. IP=%s", inet_ntoa(*addr) );
+bool UploadImageS3Burst( const std::string& webserver, const std::vector<std::string>& urls, const FrameTransform& transform, size_t pre_count )
+{
+    if( webserver.empty() || urls.empty() ){
+        return false;
+    }
 
-    sock = socket( res->ai_family, res->ai_socktype, 0 );
-    if( sock < 0 ) {
-        ESP_LOGE( sk_Tag, "... Failed to allocate socket." );
-        goto UploadImageS3_bailout;
+    TickType_t start = xTaskGetTickCount();
+    size_t uploaded = 0;
+    size_t total_bytes = 0;
+
+    // 先に参照しておかないと、アップロード中に履歴から捨てられる
+    std::vector<HistoryFrame> history;
+    if( pre_count > 0 ){
+        FrameHistory& instance = FrameHistory::Instance();
+        if( pre_count > urls.size() ){
+            pre_count = urls.size();
+        }
+        instance.Collect( instance.EventSequence(), pre_count, &history );
     }
-    ESP_LOGI( sk_Tag, "... allocated socket" );
 
-    if( connect(sock, res->ai_addr, res->ai_addrlen) != 0 ){
-        ESP_LOGE( sk_Tag, "... socket connect failed errno=%d", errno );
-        goto UploadImageS3_bailout;
+    for( HistoryFrame& frame : history ){
+        size_t length = 0;
+        bool result = UploadHistoryFrame( webserver, urls[uploaded], frame, transform, &length );
+        // 送り終えたものから手放し、記録を続けられるようにする
+        frame.Release();
+        if( !result ){
+            break;
+        }
+        ++uploaded;
+        total_bytes += length;
+    }
+    size_t history_count = history.size();
+    if( uploaded < history_count ){
+        ESP_LOGE( sk_Tag, "Burst upload: %u/%u frames (history)",
+                  static_cast<unsigned>(uploaded), static_cast<unsigned>(history_count) );
+        return false;
+    }
+    history.clear();
+
+    for( size_t i = history_count; i < urls.size(); ++i ){
+        const std::string& url = urls[i];
+        // 前のフレームを返した時点でドライバは次の撮影を始めているので、
+        // ここで待つのは撮影の残り時間だけになる
+        CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( 0 );
+        if( !fb.IsValid() ){
+            ESP_LOGE( sk_Tag, "Camera capture failed." );
+            break;
+        }
+
+        size_t length = 0;
+        if( !UploadFrame( webserver, url, fb, transform, &length ) ){
+            break;
+        }
+        ++uploaded;
+        total_bytes += length;
     }
 
-    ESP_LOGI( sk_Tag, "... connected" );
+    uint32_t elapsed_ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+    float fps = (elapsed_ms > 0) ? (uploaded * 1000.0f / elapsed_ms) : 0.0f;
+    ESP_LOGI( sk_Tag, "Burst upload: %u/%u frames (%u from history), %u bytes in %u ms (%.2f fps)",
+              static_cast<unsigned>(uploaded), static_cast<unsigned>(urls.size()), static_cast<unsigned>(history_count),
+              static_cast<unsigned>(total_bytes), static_cast<unsigned>(elapsed_ms), fps );
 
+    return uploaded == urls.size();
+}
 
-    if( write(sock, s3Request, strlen(s3Request)) < 0 ){
-        goto UploadImageS3_bailout;
-        ESP_LOGE( sk_Tag, "... socket send failed #1" );
+static bool UploadFrame( const std::string& webserver, const std::string& url, CameraFrameBuffer& fb, const FrameTransform& transform, size_t* sent )
+{
+    HTTPUploadClient& client = HTTPUploadClient::Instance();
+    const uint8_t* buffer = fb.Buffer();
+    size_t length = fb.Length();
+    CameraFrameDerivative owned = {};
+    if( !SelectDerivative( fb, transform, &buffer, &length, &owned ) ){
+        return false;
     }
-    
-    if( write(sock, (const char *)fb.Buffer(), fb.Length()) < 0 ){
-        ESP_LOGE( sk_Tag, "... socket send failed #2" );
-        goto UploadImageS3_bailout;
+    // 変換した場合は JPEG になっている
+    bool is_jpeg = (fb.Format() == PIXFORMAT_JPEG) || !transform.IsIdentity();
+
+    // JPEG は長さが分かっているので Content-Length、それ以外はエンコードしながら chunked で送る
+    size_t content_length = is_jpeg ? length : HTTPUploadClient::sk_UnknownLength;
+    if( !client.BeginPut( webserver, url, sk_ContentType, content_length ) ){
+        ESP_LOGE( sk_Tag, "... upload request failed" );
+        free( owned.Buffer );
+        return false;
     }
-    
 
-    if( write(sock, footer, strlen(footer)) < 0 ){
-        ESP_LOGE( sk_Tag, "... socket send failed #3" );
-        goto UploadImageS3_bailout;
+    *sent = length;
+    if( is_jpeg ){
+        client.Write( buffer, length );
+    }
+    else if( !frame2jpg_cb( fb.RawPtr(), sk_EncodeQuality, JpgEncodeUpload, &client ) ){
+        // 途中までの JPEG を正常な終端で閉じると、壊れた画像が保存されてしまう
+        ESP_LOGE( sk_Tag, "JPEG encode failed." );
+        client.Abort();
     }
 
-    ESP_LOGI( sk_Tag, "... socket send success" );
+    // レスポンスを待つ間にドライバが次の撮影に使えるよう、先にフレームを返す
+    fb.Release();
+    free( owned.Buffer );
 
-    struct timeval receiving_timeout;
-    receiving_timeout.tv_sec = 5;
-    receiving_timeout.tv_usec = 0;
-    if( setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout,
-            sizeof(receiving_timeout)) < 0 ){
-        ESP_LOGE( sk_Tag, "... failed to set socket receiving timeout" );
-        goto UploadImageS3_bailout;
+    HTTPResponse response;
+    if( !client.EndPut( &response ) ){
+        ESP_LOGE( sk_Tag, "... upload request failed" );
+        return false;
     }
-    ESP_LOGI( sk_Tag, "... set socket receiving timeout success" );
+    if( !response.IsSuccess() ){
+        ESP_LOGE( sk_Tag, "... upload rejected. status=%d", response.StatusCode );
+        return false;
+    }
+
+    return true;
+}
 
-    freeaddrinfo( res );
-    close( sock );
+static bool UploadHistoryFrame( const std::string& webserver, const std::string& url, HistoryFrame& frame, const FrameTransform& transform, size_t* sent )
+{
+    const uint8_t* buffer = frame.Buffer();
+    size_t length = frame.Length();
+
+    // 履歴のフレームはキャッシュを持たないので、縮小版はここで作って捨てる
+    CameraFrameDerivative derivative = {};
+    if( !transform.IsIdentity() ){
+        if( !TransformJpeg( buffer, length, transform, &derivative ) ){
+            ESP_LOGE( sk_Tag, "Failed to transform frame. size=%s", FrameScaleName( transform.Scale ) );
+            return false;
+        }
+        buffer = derivative.Buffer;
+        length = derivative.Length;
+    }
 
+    HTTPResponse response;
+    bool result = HTTPUploadClient::Instance().Put( webserver, url, sk_ContentType, buffer, length, &response );
+    free( derivative.Buffer );
+
+    if( !result ){
+        ESP_LOGE( sk_Tag, "... upload request failed" );
+        return false;
+    }
+    if( !response.IsSuccess() ){
+        ESP_LOGE( sk_Tag, "... upload rejected. status=%d", response.StatusCode );
+        return false;
+    }
+
+    *sent = length;
     return true;
+}
 
-UploadImageS3_bailout:
-    if( sock >= 0 ){
-        close( sock );
+// 指定された変換を適用できなかった場合は false。元のフレームで代用すると、要求と違う画像を送ってしまう。
+static bool SelectDerivative( CameraFrameBuffer& fb, const FrameTransform& transform, const uint8_t** buffer, size_t* length,
+                              CameraFrameDerivative* owned )
+{
+    if( transform.IsIdentity() ){
+        return true;
     }
-    if( res ){
-        freeaddrinfo( res );
+
+    if( transform.IsScaleOnly() ){
+        // /capture と同じフレームならキャッシュ済みの縮小版を使う
+        const CameraFrameDerivative* derivative = fb.Derivative( transform.Scale );
+        if( derivative == nullptr ){
+            ESP_LOGE( sk_Tag, "Failed to scale frame. size=%s", FrameScaleName( transform.Scale ) );
+            return false;
+        }
+
+        *buffer = derivative->Buffer;
+        *length = derivative->Length;
+        return true;
+    }
+
+    // 切り出しや画質の指定はこのアップロードだけのものなので、キャッシュせずに呼び出し側で捨てる
+    if( fb.Format() != PIXFORMAT_JPEG || !TransformJpeg( fb.Buffer(), fb.Length(), transform, owned ) ){
+        ESP_LOGE( sk_Tag, "Failed to transform frame. size=%s", FrameScaleName( transform.Scale ) );
+        return false;
     }
 
-    return false;
-}
\ No newline at end of file
+    *buffer = owned->Buffer;
+    *length = owned->Length;
+    return true;
+}
+
+static size_t JpgEncodeUpload( void* arg, size_t index, const void* data, size_t len )
+{
+    HTTPUploadClient* client = reinterpret_cast<HTTPUploadClient*>(arg);
+    if( !client->Write( reinterpret_cast<const uint8_t*>(data), len ) ){
+        return 0;
+    }
+    return len;
+}
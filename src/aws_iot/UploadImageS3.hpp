@@ -2,7 +2,18 @@
 #define     UPLOAD_IMAGE_S3_INCLUDED
 
 #include <string>
+#include <vector>
 
-bool UploadImageS3( const std::string& webserver, const std::string& url );
+#include "Camera.hpp"
+#include "JpegScaler.hpp"
+
+// transform を指定すると縮小、切り出し、画質を変えたものを送る
+bool UploadImageS3( const std::string& webserver, const std::string& url, const FrameTransform& transform = FrameTransform() );
+
+// urls の数だけ連続撮影し、1 枚ずつ対応する URL へアップロードする。
+// pre_count を指定すると、先頭の URL には最後のイベント (ボタン等) 以前の履歴のフレームを古い順に送り、
+// 残りの URL に撮影したフレームを送る。
+bool UploadImageS3Burst( const std::string& webserver, const std::vector<std::string>& urls,
+                         const FrameTransform& transform = FrameTransform(), size_t pre_count = 0 );
 
 #endif    // UPLOAD_IMAGE_S3_INCLUDED
@@ -1,5 +1,9 @@
 
 #include "Camera.hpp"
+#include "JpegScaler.hpp"
+
+#include <cstdlib>
+#include <new>
 
 #include "esp_log.h"
 
@@ -31,7 +35,9 @@ static camera_config_t s_CameraConfig = {
     .pixel_format   = Camera::sk_PixelFormat,
     .frame_size     = Camera::sk_FrameSize,
     .jpeg_quality   = Camera::sk_JpegQuality,
-    .fb_count       = Camera::sk_FrameBuffCount
+    .fb_count       = Camera::sk_FrameBuffCount,
+    .fb_location    = CAMERA_FB_IN_PSRAM,
+    .grab_mode      = CAMERA_GRAB_LATEST
 };
 
 
@@ -41,31 +47,63 @@ static camera_config_t s_CameraConfig = {
 //
 
 CameraFrameBuffer::CameraFrameBuffer()
-    : m_FrameBuffer( nullptr )
+    : m_Slot( nullptr )
 {}
 
-CameraFrameBuffer::CameraFrameBuffer( camera_fb_t* fb )
-    : m_FrameBuffer( fb, 
-        [](camera_fb_t* p) {
-            if( p ){
-                esp_camera_fb_return( p );
-            }
-        }
-    )
+CameraFrameBuffer::CameraFrameBuffer( CameraFrameSlot* slot )
+    : m_Slot( slot )
 {}
 
+CameraFrameBuffer::CameraFrameBuffer( const CameraFrameBuffer& other )
+    : m_Slot( other.m_Slot )
+{
+    if( m_Slot ){
+        m_Slot->RefCount.fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+CameraFrameBuffer::CameraFrameBuffer( CameraFrameBuffer&& other ) noexcept
+    : m_Slot( other.m_Slot )
+{
+    other.m_Slot = nullptr;
+}
+
+CameraFrameBuffer& CameraFrameBuffer::operator=( const CameraFrameBuffer& other )
+{
+    if( m_Slot != other.m_Slot ){
+        if( other.m_Slot ){
+            other.m_Slot->RefCount.fetch_add( 1, std::memory_order_relaxed );
+        }
+        Release();
+        m_Slot = other.m_Slot;
+    }
+    return *this;
+}
+
+CameraFrameBuffer& CameraFrameBuffer::operator=( CameraFrameBuffer&& other ) noexcept
+{
+    if( this != &other ){
+        Release();
+        m_Slot = other.m_Slot;
+        other.m_Slot = nullptr;
+    }
+    return *this;
+}
+
 CameraFrameBuffer::~CameraFrameBuffer()
-{}
+{
+    Release();
+}
 
 bool CameraFrameBuffer::IsValid() const
 {
-    return m_FrameBuffer.get() != nullptr;
+    return m_Slot != nullptr;
 }
 
 size_t CameraFrameBuffer::Width() const
 {
-    if( m_FrameBuffer ){
-        return m_FrameBuffer->width;
+    if( m_Slot ){
+        return frame()->width;
     }
 
     return 0;
@@ -73,8 +111,8 @@ size_t CameraFrameBuffer::Width() const
 
 size_t CameraFrameBuffer::Height() const
 {
-    if( m_FrameBuffer ){
-        return m_FrameBuffer->height;
+    if( m_Slot ){
+        return frame()->height;
     }
 
     return 0;
@@ -82,8 +120,8 @@ size_t CameraFrameBuffer::Height() const
 
 pixformat_t CameraFrameBuffer::Format() const
 {
-    if( m_FrameBuffer ){
-        return m_FrameBuffer->format;
+    if( m_Slot ){
+        return frame()->format;
     }
 
     // とりあえず適当
@@ -92,8 +130,8 @@ pixformat_t CameraFrameBuffer::Format() const
 
 size_t CameraFrameBuffer::Length() const
 {
-    if( m_FrameBuffer ){
-        return m_FrameBuffer->len;
+    if( m_Slot ){
+        return frame()->len;
     }
 
     return 0;
@@ -101,8 +139,8 @@ size_t CameraFrameBuffer::Length() const
 
 const uint8_t* CameraFrameBuffer::Buffer() const
 {
-    if( m_FrameBuffer ){
-        return m_FrameBuffer->buf;
+    if( m_Slot ){
+        return frame()->buf;
     }
 
     return nullptr;
@@ -110,19 +148,147 @@ const uint8_t* CameraFrameBuffer::Buffer() const
 
 camera_fb_t* CameraFrameBuffer::RawPtr()
 {
-    return m_FrameBuffer.get();
+    return m_Slot ? frame() : nullptr;
+}
+
+uint32_t CameraFrameBuffer::Sequence() const
+{
+    if( m_Slot ){
+        return m_Slot->Sequence;
+    }
+
+    return 0;
+}
+
+struct timeval CameraFrameBuffer::Timestamp() const
+{
+    if( m_Slot ){
+        return m_Slot->Timestamp;
+    }
+
+    return timeval{ 0, 0 };
+}
+
+CameraFrameInfo CameraFrameBuffer::Info() const
+{
+    CameraFrameInfo info = {};
+    if( m_Slot ){
+        info.Sequence  = m_Slot->Sequence;
+        info.Timestamp = m_Slot->Timestamp;
+        info.Width     = Width();
+        info.Height    = Height();
+        info.Format    = Format();
+        info.Length    = Length();
+    }
+    return info;
+}
+
+const CameraFrameDerivative* CameraFrameBuffer::Derivative( FrameScale scale )
+{
+    if( !m_Slot || scale == FrameScale::Full || Format() != PIXFORMAT_JPEG ){
+        return nullptr;
+    }
+
+    std::atomic<CameraFrameDerivative*>& cache = m_Slot->Derivatives[static_cast<size_t>(scale) - 1];
+    CameraFrameDerivative* derivative = cache.load( std::memory_order_acquire );
+    if( derivative ){
+        return derivative;
+    }
+
+    derivative = new (std::nothrow) CameraFrameDerivative();
+    if( !derivative ){
+        return nullptr;
+    }
+    if( !ScaleJpeg( Buffer(), Length(), scale, Camera::sk_DerivativeJpegQuality, derivative ) ){
+        delete derivative;
+        return nullptr;
+    }
+
+    // 同時に作った場合は先に登録された方を使う
+    CameraFrameDerivative* expected = nullptr;
+    if( !cache.compare_exchange_strong( expected, derivative, std::memory_order_acq_rel ) ){
+        free( derivative->Buffer );
+        delete derivative;
+        return expected;
+    }
+
+    return derivative;
+}
+
+void CameraFrameBuffer::Release()
+{
+    if( m_Slot && m_Slot->RefCount.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ){
+        releaseDerivatives( m_Slot );
+        // 先にスロットを空けてから返す。逆順だと、ドライバが同じバッファを渡した時に空きスロットが無くなる。
+        camera_fb_t* fb = m_Slot->Frame.exchange( nullptr, std::memory_order_acq_rel );
+        esp_camera_fb_return( fb );
+    }
+    m_Slot = nullptr;
+}
+
+camera_fb_t* CameraFrameBuffer::frame() const
+{
+    return m_Slot->Frame.load( std::memory_order_relaxed );
+}
+
+void CameraFrameBuffer::releaseDerivatives( CameraFrameSlot* slot )
+{
+    for( size_t i = 0; i < CameraFrameSlot::sk_DerivativeCount; ++i ){
+        CameraFrameDerivative* derivative = slot->Derivatives[i].exchange( nullptr, std::memory_order_acq_rel );
+        if( derivative ){
+            free( derivative->Buffer );
+            delete derivative;
+        }
+    }
 }
 
 
 // 
 // class Camera implemantation
 //
+Camera::Camera()
+    : m_Slots(),
+      m_SlotCount( 0 ),
+      m_Sequence( 0 )
+{}
+
 bool Camera::Initialize()
 {
+    Config config;
+    config.FrameBufferCount   = sk_FrameBuffCount;
+    config.FrameBufferInPSRAM = true;
+    config.GrabLatest         = true;
+
+    return Initialize( config );
+}
+
+bool Camera::Initialize( const Config& config )
+{
+    if( config.FrameBufferCount == 0 ){
+        return false;
+    }
+
+    Camera& instance = Camera::Instance();
+    instance.m_Slots.reset( new (std::nothrow) CameraFrameSlot[config.FrameBufferCount] );
+    if( !instance.m_Slots ){
+        return false;
+    }
+    for( size_t i = 0; i < config.FrameBufferCount; ++i ){
+        instance.m_Slots[i].Frame.store( nullptr, std::memory_order_relaxed );
+        instance.m_Slots[i].RefCount.store( 0, std::memory_order_relaxed );
+        for( size_t j = 0; j < CameraFrameSlot::sk_DerivativeCount; ++j ){
+            instance.m_Slots[i].Derivatives[j].store( nullptr, std::memory_order_relaxed );
+        }
+    }
+    instance.m_SlotCount = config.FrameBufferCount;
+
     if( sk_Pin_PWDN != -1 ){
         pwdnPinPowerUp();
     }
 
+    s_CameraConfig.fb_count    = config.FrameBufferCount;
+    s_CameraConfig.fb_location = config.FrameBufferInPSRAM ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    s_CameraConfig.grab_mode   = config.GrabLatest ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
     if( esp_camera_init(&s_CameraConfig) != ESP_OK ){
         ESP_LOGE( Camera::sk_CameraTag, "Camera Init Failed." );
         return false;
@@ -137,24 +303,39 @@ Camera& Camera::Instance()
     return s_Instance;
 }
 
-bool Camera::Capture()
+CameraFrameBuffer Camera::Grab()
 {
-    // すでに有効な画像があるならまず解放
-    if( m_CapturedImage.IsValid() ){
-        m_CapturedImage = CameraFrameBuffer();
+    camera_fb_t* fb = esp_camera_fb_get();
+    if( fb == nullptr ){
+        return CameraFrameBuffer();
     }
 
-    CameraFrameBuffer fb( esp_camera_fb_get() );
-    if( fb.IsValid() ){
-        m_CapturedImage = fb;
+    CameraFrameSlot* slot = acquireSlot( fb );
+    if( slot == nullptr ){
+        // ドライバが渡すフレームはバッファ数以下なので、ここには来ないはず
+        ESP_LOGE( sk_CameraTag, "No free frame slot." );
+        esp_camera_fb_return( fb );
+        return CameraFrameBuffer();
     }
 
-    return fb.IsValid();
+    // 参照カウントが 1 のうちはこのタスクしか触らないので、そのまま書いてよい
+    slot->Sequence = m_Sequence.fetch_add( 1, std::memory_order_relaxed ) + 1;
+    gettimeofday( &slot->Timestamp, nullptr );
+
+    return CameraFrameBuffer( slot );
 }
 
-CameraFrameBuffer Camera::FrameBuffer()
+CameraFrameSlot* Camera::acquireSlot( camera_fb_t* fb )
 {
-    return m_CapturedImage;
+    for( size_t i = 0; i < m_SlotCount; ++i ){
+        CameraFrameSlot& slot = m_Slots[i];
+        camera_fb_t* expected = nullptr;
+        if( slot.Frame.compare_exchange_strong( expected, fb, std::memory_order_acq_rel ) ){
+            slot.RefCount.store( 1, std::memory_order_relaxed );
+            return &slot;
+        }
+    }
+    return nullptr;
 }
 
 void Camera::pwdnPinPowerUp()
@@ -1,15 +1,82 @@
 #ifndef     I_CAMERA_HPP_INCLUDED
 #define     I_CAMERA_HPP_INCLUDED
 
+#include <atomic>
 #include <memory>
 
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+
 #include "esp_camera.h"
 
 
+//
+// 縮小版の大きさ。JPEG の DCT 領域で縮小するので、1/2, 1/4, 1/8 のみ。
+//
+enum class FrameScale : uint8_t
+{
+    Full = 0,
+    Half,
+    Quarter,
+    Eighth,
+};
+
+//
+// 縮小して JPEG にし直したフレーム
+//
+struct CameraFrameDerivative
+{
+    uint8_t* Buffer;
+    size_t   Length;
+    uint16_t Width;
+    uint16_t Height;
+};
+
+//
+// ドライバから受け取ったフレーム 1 枚分の参照カウント
+//
+struct CameraFrameSlot
+{
+    static const size_t sk_DerivativeCount = 3;     // Half, Quarter, Eighth
+
+    std::atomic<camera_fb_t*> Frame;        // nullptr なら空き
+    std::atomic<uint32_t>     RefCount;
+    uint32_t                  Sequence;
+    struct timeval            Timestamp;
+    // 初めて要求された時に作り、フレームと一緒に解放する
+    std::atomic<CameraFrameDerivative*> Derivatives[sk_DerivativeCount];
+};
+
+//
+// フレームのメタデータ。フレーム自体を返した後も参照できるよう値で持つ。
+//
+struct CameraFrameInfo
+{
+    uint32_t       Sequence;                // 起動後に取得した順の通し番号。0 は無効
+    struct timeval Timestamp;               // 取得した時刻 (gettimeofday)
+    size_t         Width;
+    size_t         Height;
+    pixformat_t    Format;
+    size_t         Length;
+};
+
+//
+// フレームへのハンドル
+//
+// コピーは参照カウントを増やすだけで、フレームのコピーや確保は行わない。
+// 最後のハンドルが解放された時点でフレームをドライバへ返す。
+//
 class CameraFrameBuffer
 {
 public:
 
+    // 無効なハンドル
+    CameraFrameBuffer();
+    CameraFrameBuffer( const CameraFrameBuffer& other );
+    CameraFrameBuffer( CameraFrameBuffer&& other ) noexcept;
+    CameraFrameBuffer& operator=( const CameraFrameBuffer& other );
+    CameraFrameBuffer& operator=( CameraFrameBuffer&& other ) noexcept;
     ~CameraFrameBuffer() noexcept;
 
     bool IsValid() const;
@@ -19,22 +86,42 @@ public:
     size_t Length() const;
     const uint8_t* Buffer() const;
     camera_fb_t* RawPtr();
+    uint32_t Sequence() const;
+    struct timeval Timestamp() const;
+    CameraFrameInfo Info() const;
+
+    // 縮小版を返す。無ければ作ってフレームと一緒にキャッシュする。
+    // Full や JPEG 以外のフレーム、メモリ不足の場合は nullptr。
+    // 返した領域はこのハンドルを保持している間だけ有効。
+    const CameraFrameDerivative* Derivative( FrameScale scale );
+
+    // 保持している参照を手放す
+    void Release();
     
 private:
     friend class Camera;
 
-    using FrameBufferSharedPtr = std::shared_ptr<camera_fb_t>;
+    explicit CameraFrameBuffer( CameraFrameSlot* slot );
 
-    CameraFrameBuffer();
-    CameraFrameBuffer( camera_fb_t* fb );
+    camera_fb_t* frame() const;
+    static void releaseDerivatives( CameraFrameSlot* slot );
 
-    FrameBufferSharedPtr m_FrameBuffer;
+    CameraFrameSlot* m_Slot;
 };
 
 class Camera
 {
 public:
-    Camera() = default;
+
+    struct Config
+    {
+        size_t FrameBufferCount;        // 同時に保持できるフレームの数
+        bool   FrameBufferInPSRAM;
+        bool   GrabLatest;              // 空きバッファを常に上書きし、最新のフレームを返す
+    };
+
+public:
+    Camera();
     ~Camera() noexcept {}
 
     // DO NOT COPY!
@@ -42,10 +129,13 @@ public:
     Camera( const Camera& ) = delete;
 
     static bool Initialize();
+    static bool Initialize( const Config& config );
     static Camera& Instance();
 
-    bool Capture();
-    CameraFrameBuffer FrameBuffer();
+    // 新しいフレームを取得する。
+    // 返したフレームを解放するとドライバが次の撮影に使う。
+    // センサーを直接読むので、通常は CaptureCoordinator::Acquire() を使うこと。
+    CameraFrameBuffer Grab();
 
     static constexpr gpio_num_t sk_Pin_PWDN    = static_cast<gpio_num_t>(26);
     static constexpr gpio_num_t sk_Pin_RESET   = static_cast<gpio_num_t>(-1);
@@ -72,8 +162,14 @@ public:
     
     static constexpr pixformat_t sk_PixelFormat = PIXFORMAT_JPEG;
     static constexpr framesize_t sk_FrameSize   = FRAMESIZE_UXGA;
+    // sk_FrameSize の画素数
+    static constexpr uint16_t sk_FrameWidth  = 1600;
+    static constexpr uint16_t sk_FrameHeight = 1200;
     static constexpr int sk_JpegQuality = 12;
-    static constexpr int sk_FrameBuffCount = 1;
+    // 縮小版をエンコードし直す時の品質 (fmt2jpg は大きいほど高品質)
+    static constexpr uint8_t sk_DerivativeJpegQuality = 80;
+    // 送信中のフレームを保持したまま撮影できるよう複数持つ
+    static constexpr int sk_FrameBuffCount = 3;
 
     static constexpr char sk_CameraTag[] = "Camera";
 
@@ -81,7 +177,11 @@ private:
 
     static void pwdnPinPowerUp();
 
-    CameraFrameBuffer m_CapturedImage;
+    CameraFrameSlot* acquireSlot( camera_fb_t* fb );
+
+    std::unique_ptr<CameraFrameSlot[]> m_Slots;
+    size_t            m_SlotCount;
+    std::atomic<uint32_t> m_Sequence;
 };
 
 #endif    // I_CAMERA_HPP_INCLUDED
@@ -0,0 +1,166 @@
+
+#include "CaptureCoordinator.hpp"
+#include "Metrics.hpp"
+
+#include <cstdlib>
+
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+CaptureCoordinator::CaptureCoordinator()
+    : m_Latest(),
+      m_LatestInfo(),
+      m_CapturedAt( 0 ),
+      m_Generation( 0 ),
+      m_InFlight( false ),
+      m_Statistics()
+{
+    m_Mutex = xSemaphoreCreateMutex();
+    m_Event = xEventGroupCreate();
+}
+
+CaptureCoordinator::~CaptureCoordinator()
+{}
+
+CaptureCoordinator& CaptureCoordinator::Instance()
+{
+    static CaptureCoordinator s_Instance;
+    return s_Instance;
+}
+
+CameraFrameBuffer CaptureCoordinator::Acquire( uint32_t max_age_ms, uint32_t timeout_ms )
+{
+    CameraFrameBuffer result;
+
+    portTickType start = xTaskGetTickCount();
+    portTickType timeout = timeout_ms / portTICK_PERIOD_MS;
+    portTickType max_age = max_age_ms / portTICK_PERIOD_MS;
+
+    while( 1 ){
+        if( !xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+            return result;
+        }
+
+        portTickType now = xTaskGetTickCount();
+        if( max_age_ms > 0 && m_Latest.IsValid() && (now - m_CapturedAt) <= max_age ){
+            result = m_Latest;
+            ++m_Statistics.Shared;
+            if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+                // IT MUST BE BUG
+                abort();
+            }
+            return result;
+        }
+
+        if( !m_InFlight ){
+            // この要求が撮影を担当する
+            m_InFlight = true;
+            // 古いフレームを保持し続けるとカメラのバッファが足りなくなるので先に手放す
+            m_Latest.Release();
+            xEventGroupClearBits( m_Event, sk_DoneBit );
+            if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+                // IT MUST BE BUG
+                abort();
+            }
+            return capture();
+        }
+
+        // 撮影中の要求に相乗りする
+        uint32_t generation = m_Generation;
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+
+        portTickType elapsed = xTaskGetTickCount() - start;
+        if( elapsed >= timeout ){
+            return result;
+        }
+        xEventGroupWaitBits( m_Event, sk_DoneBit, pdFALSE, pdTRUE, timeout - elapsed );
+
+        if( !xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+            return result;
+        }
+        bool done = (m_Generation != generation);
+        if( done ){
+            // 撮影に失敗した場合は無効なフレームを返す
+            result = m_Latest;
+            if( result.IsValid() ){
+                ++m_Statistics.Shared;
+            }
+        }
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+        if( done ){
+            return result;
+        }
+    }
+}
+
+bool CaptureCoordinator::LatestInfo( CameraFrameInfo* info, uint32_t* age_ms ) const
+{
+    bool result = false;
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        *info  = m_LatestInfo;
+        result = (m_LatestInfo.Sequence != 0);
+        if( age_ms ){
+            *age_ms = (xTaskGetTickCount() - m_CapturedAt) * portTICK_PERIOD_MS;
+        }
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    return result;
+}
+
+CaptureCoordinator::Statistics CaptureCoordinator::GetStatistics() const
+{
+    Statistics stat = {};
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        stat = m_Statistics;
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    return stat;
+}
+
+CameraFrameBuffer CaptureCoordinator::capture()
+{
+    // センサーからの取得はロックの外で行う
+    CameraFrameBuffer fb;
+    {
+        StageTimer timer( MetricStage::CameraGrab );
+        fb = Camera::Instance().Grab();
+        if( !fb.IsValid() ){
+            timer.Failed();
+            ESP_LOGE( sk_Tag, "Camera capture failed." );
+        }
+    }
+
+    // 待っている要求が必ず結果を受け取れるよう、ロックは待ち時間の上限なしで取る
+    xSemaphoreTake( m_Mutex, portMAX_DELAY );
+    m_Latest     = fb;
+    m_CapturedAt = xTaskGetTickCount();
+    ++m_Generation;
+    m_InFlight   = false;
+    if( fb.IsValid() ){
+        m_LatestInfo = fb.Info();
+        ++m_Statistics.Captures;
+    }
+    else {
+        ++m_Statistics.Failures;
+    }
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+
+    xEventGroupSetBits( m_Event, sk_DoneBit );
+    return fb;
+}
@@ -0,0 +1,69 @@
+#ifndef     CAPTURE_COORDINATOR_HPP_INCLUDED
+#define     CAPTURE_COORDINATOR_HPP_INCLUDED
+
+#include <cstdint>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include "Camera.hpp"
+
+//
+// 撮影要求の取りまとめ
+//
+// 同時に来た要求はセンサーからの 1 回の取得にまとめ、全員に同じフレームを渡す。
+// 直前に取得したフレームが max_age_ms 以内なら、撮影せずにそれを返す。
+//
+class CaptureCoordinator
+{
+public:
+
+    struct Statistics
+    {
+        uint32_t Captures;          // センサーから取得した回数
+        uint32_t Shared;            // 他の要求と同じフレームを渡した回数
+        uint32_t Failures;
+    };
+
+    static inline constexpr char sk_Tag[] = "CaptureCoord";
+    static const uint32_t sk_DefaultTimeoutMs = 5000;
+
+public:
+
+    // DO NOT COPY
+    CaptureCoordinator( const CaptureCoordinator& ) = delete;
+    CaptureCoordinator& operator=( const CaptureCoordinator& ) = delete;
+
+    static CaptureCoordinator& Instance();
+
+    // max_age_ms が 0 の場合は、呼び出し後に完了した撮影のフレームを返す
+    CameraFrameBuffer Acquire( uint32_t max_age_ms, uint32_t timeout_ms = sk_DefaultTimeoutMs );
+
+    // 最後に取得したフレームの情報。撮影は行わない。
+    // age_ms を指定すると、取得からの経過時間が入る。
+    bool LatestInfo( CameraFrameInfo* info, uint32_t* age_ms = nullptr ) const;
+
+    Statistics GetStatistics() const;
+
+private:
+
+    CaptureCoordinator();
+    ~CaptureCoordinator() noexcept;
+
+    static const EventBits_t sk_DoneBit = BIT0;
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+
+    CameraFrameBuffer capture();
+
+    CameraFrameBuffer  m_Latest;
+    CameraFrameInfo    m_LatestInfo;        // m_Latest を手放した後も残す
+    portTickType       m_CapturedAt;
+    uint32_t           m_Generation;
+    bool               m_InFlight;
+    Statistics         m_Statistics;
+    xSemaphoreHandle   m_Mutex;
+    EventGroupHandle_t m_Event;
+};
+
+#endif    // CAPTURE_COORDINATOR_HPP_INCLUDED
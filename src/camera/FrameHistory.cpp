@@ -0,0 +1,368 @@
+#include "FrameHistory.hpp"
+#include "CaptureCoordinator.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+//
+// class HistoryFrame implemantation
+//
+
+HistoryFrame::HistoryFrame()
+    : m_History( nullptr ),
+      m_Index( 0 ),
+      m_Buffer( nullptr ),
+      m_Info()
+{}
+
+HistoryFrame::HistoryFrame( HistoryFrame&& other ) noexcept
+    : m_History( other.m_History ),
+      m_Index( other.m_Index ),
+      m_Buffer( other.m_Buffer ),
+      m_Info( other.m_Info )
+{
+    other.m_History = nullptr;
+    other.m_Buffer  = nullptr;
+}
+
+HistoryFrame& HistoryFrame::operator=( HistoryFrame&& other ) noexcept
+{
+    if( this != &other ){
+        Release();
+        m_History = other.m_History;
+        m_Index   = other.m_Index;
+        m_Buffer  = other.m_Buffer;
+        m_Info    = other.m_Info;
+        other.m_History = nullptr;
+        other.m_Buffer  = nullptr;
+    }
+    return *this;
+}
+
+HistoryFrame::~HistoryFrame()
+{
+    Release();
+}
+
+bool HistoryFrame::IsValid() const
+{
+    return m_History != nullptr;
+}
+
+const uint8_t* HistoryFrame::Buffer() const
+{
+    return m_Buffer;
+}
+
+size_t HistoryFrame::Length() const
+{
+    return m_History ? m_Info.Length : 0;
+}
+
+const CameraFrameInfo& HistoryFrame::Info() const
+{
+    return m_Info;
+}
+
+void HistoryFrame::Release()
+{
+    if( m_History ){
+        m_History->unpin( m_Index );
+    }
+    m_History = nullptr;
+    m_Buffer  = nullptr;
+}
+
+
+//
+// class FrameHistory implemantation
+//
+
+FrameHistory::FrameHistory()
+    : m_Config(),
+      m_Task( nullptr ),
+      m_Running( false ),
+      m_Buffer( nullptr ),
+      m_Entries(),
+      m_First( 0 ),
+      m_Count( 0 ),
+      m_WriteOffset( 0 ),
+      m_LastSequence( 0 ),
+      m_EventSequence( 0 ),
+      m_Statistics()
+{
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+FrameHistory::~FrameHistory()
+{}
+
+FrameHistory& FrameHistory::Instance()
+{
+    static FrameHistory s_Instance;
+    return s_Instance;
+}
+
+bool FrameHistory::Start( const Config& config )
+{
+    if( m_Running || m_Buffer || config.CapacityBytes == 0 || config.MaxFrames == 0 ){
+        return false;
+    }
+
+    m_Buffer = reinterpret_cast<uint8_t*>(heap_caps_malloc( config.CapacityBytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT ));
+    if( m_Buffer == nullptr ){
+        ESP_LOGE( sk_Tag, "Failed to allocate %u bytes.", static_cast<unsigned>(config.CapacityBytes) );
+        return false;
+    }
+    m_Entries.resize( config.MaxFrames );
+    m_Config = config;
+
+    m_Running = true;
+    if( xTaskCreatePinnedToCore( RecordTask, "FrameHistory", sk_TaskStackSize, this, sk_TaskPriority, &m_Task, sk_TaskCoreId ) != pdPASS ){
+        ESP_LOGE( sk_Tag, "Failed to create record task." );
+        m_Running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void FrameHistory::Stop()
+{
+    // 記録を止めるだけで、残っているフレームは参照できる
+    m_Running = false;
+}
+
+bool FrameHistory::Record( const CameraFrameBuffer& fb )
+{
+    if( m_Buffer == nullptr || !fb.IsValid() || fb.Format() != PIXFORMAT_JPEG ){
+        return false;
+    }
+
+    size_t length = fb.Length();
+    if( length > m_Config.CapacityBytes ){
+        return false;
+    }
+
+    if( !lock() ){
+        return false;
+    }
+
+    // 記録タスクとボタンの処理が同じフレームを共有した場合は 1 度だけ残す
+    if( m_Count > 0 && static_cast<int32_t>(fb.Sequence() - m_Entries[entryIndex( 0 )].Info.Sequence) <= 0 ){
+        unlock();
+        return true;
+    }
+
+    // 末尾に入らなければ先頭に戻る。フレームは常に連続した領域に置く。
+    size_t offset = m_WriteOffset;
+    if( offset + length > m_Config.CapacityBytes ){
+        offset = 0;
+    }
+
+    // 書き込む領域と重なるものが無くなるまで古い順に捨てる
+    bool result = true;
+    while( m_Count > 0 && (m_Count == m_Entries.size() || overlaps( offset, length )) ){
+        Entry& oldest = m_Entries[m_First];
+        if( oldest.Pins > 0 ){
+            ++m_Statistics.Dropped;
+            result = false;
+            break;
+        }
+        m_Statistics.UsedBytes -= oldest.Length;
+        m_First = (m_First + 1) % m_Entries.size();
+        --m_Count;
+        ++m_Statistics.Evicted;
+    }
+
+    if( result ){
+        memcpy( m_Buffer + offset, fb.Buffer(), length );
+
+        Entry& entry = m_Entries[(m_First + m_Count) % m_Entries.size()];
+        entry.Offset = offset;
+        entry.Length = length;
+        entry.Pins   = 0;
+        entry.Info   = fb.Info();
+        ++m_Count;
+
+        m_WriteOffset = offset + length;
+        ++m_Statistics.Recorded;
+        m_Statistics.UsedBytes += length;
+    }
+    m_Statistics.Frames = m_Count;
+
+    unlock();
+    return result;
+}
+
+bool FrameHistory::Get( size_t age, HistoryFrame* frame )
+{
+    frame->Release();
+    if( !lock() ){
+        return false;
+    }
+
+    bool result = false;
+    if( age < m_Count ){
+        pin( entryIndex( age ), frame );
+        result = true;
+    }
+
+    unlock();
+    return result;
+}
+
+uint32_t FrameHistory::MarkEvent()
+{
+    uint32_t sequence = 0;
+    if( lock() ){
+        if( m_Count > 0 ){
+            sequence = m_Entries[entryIndex( 0 )].Info.Sequence;
+        }
+        m_EventSequence = sequence;
+        unlock();
+    }
+    return sequence;
+}
+
+uint32_t FrameHistory::EventSequence() const
+{
+    uint32_t sequence = 0;
+    if( lock() ){
+        sequence = m_EventSequence;
+        unlock();
+    }
+    return sequence;
+}
+
+size_t FrameHistory::Collect( uint32_t until_sequence, size_t max_count, std::vector<HistoryFrame>* frames )
+{
+    frames->clear();
+    if( !lock() ){
+        return 0;
+    }
+
+    // until_sequence より新しいものを飛ばす
+    size_t first_age = 0;
+    if( until_sequence != 0 ){
+        while( first_age < m_Count && m_Entries[entryIndex( first_age )].Info.Sequence > until_sequence ){
+            ++first_age;
+        }
+    }
+
+    size_t count = m_Count - first_age;
+    if( max_count < count ){
+        count = max_count;
+    }
+    frames->reserve( count );
+    for( size_t age = first_age + count; age > first_age; --age ){
+        HistoryFrame frame;
+        pin( entryIndex( age - 1 ), &frame );
+        frames->push_back( std::move( frame ) );
+    }
+
+    unlock();
+    return count;
+}
+
+size_t FrameHistory::GetInfo( CameraFrameInfo* infos, size_t max_count ) const
+{
+    if( !lock() ){
+        return 0;
+    }
+
+    size_t count = (max_count < m_Count) ? max_count : m_Count;
+    for( size_t age = 0; age < count; ++age ){
+        infos[age] = m_Entries[entryIndex( age )].Info;
+    }
+
+    unlock();
+    return count;
+}
+
+FrameHistory::Statistics FrameHistory::GetStatistics() const
+{
+    Statistics stats = {};
+    if( lock() ){
+        stats = m_Statistics;
+        unlock();
+    }
+    return stats;
+}
+
+void FrameHistory::RecordTask( void* param )
+{
+    FrameHistory* instance = reinterpret_cast<FrameHistory*>(param);
+    instance->run();
+
+    instance->m_Task = nullptr;
+    vTaskDelete( nullptr );
+}
+
+void FrameHistory::run()
+{
+    TickType_t last_wake_time = xTaskGetTickCount();
+
+    while( m_Running ){
+        // 配信や動体検知が撮影していれば、そのフレームを共有する
+        CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( m_Config.IntervalMs );
+        if( fb.IsValid() && fb.Sequence() != m_LastSequence ){
+            m_LastSequence = fb.Sequence();
+            Record( fb );
+        }
+        fb.Release();
+
+        vTaskDelayUntil( &last_wake_time, m_Config.IntervalMs / portTICK_PERIOD_MS );
+    }
+}
+
+void FrameHistory::pin( size_t index, HistoryFrame* frame )
+{
+    Entry& entry = m_Entries[index];
+    ++entry.Pins;
+
+    frame->m_History = this;
+    frame->m_Index   = index;
+    frame->m_Buffer  = m_Buffer + entry.Offset;
+    frame->m_Info    = entry.Info;
+}
+
+void FrameHistory::unpin( size_t index )
+{
+    // 参照が残ったままになると以降のフレームを記録できなくなるので、取れるまで待つ
+    xSemaphoreTake( m_Mutex, portMAX_DELAY );
+    --m_Entries[index].Pins;
+    unlock();
+}
+
+bool FrameHistory::overlaps( size_t offset, size_t length ) const
+{
+    for( size_t i = 0; i < m_Count; ++i ){
+        const Entry& entry = m_Entries[(m_First + i) % m_Entries.size()];
+        if( entry.Offset < offset + length && offset < entry.Offset + entry.Length ){
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t FrameHistory::entryIndex( size_t age ) const
+{
+    return (m_First + m_Count - 1 - age) % m_Entries.size();
+}
+
+bool FrameHistory::lock() const
+{
+    return xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) == pdTRUE;
+}
+
+void FrameHistory::unlock() const
+{
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef     FRAME_HISTORY_HPP_INCLUDED
+#define     FRAME_HISTORY_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "Camera.hpp"
+
+class FrameHistory;
+
+//
+// 履歴に残っている JPEG 1 枚への参照
+//
+// 保持している間は上書きされないので、コピーせずにそのまま送れる。
+// 長く保持すると新しいフレームを記録できなくなるので、送り終えたらすぐ手放すこと。
+//
+class HistoryFrame
+{
+public:
+
+    HistoryFrame();
+    HistoryFrame( HistoryFrame&& other ) noexcept;
+    HistoryFrame& operator=( HistoryFrame&& other ) noexcept;
+    ~HistoryFrame() noexcept;
+
+    // DO NOT COPY
+    HistoryFrame( const HistoryFrame& ) = delete;
+    HistoryFrame& operator=( const HistoryFrame& ) = delete;
+
+    bool IsValid() const;
+    const uint8_t* Buffer() const;
+    size_t Length() const;
+    const CameraFrameInfo& Info() const;
+
+    void Release();
+
+private:
+    friend class FrameHistory;
+
+    FrameHistory*   m_History;
+    size_t          m_Index;
+    const uint8_t*  m_Buffer;
+    CameraFrameInfo m_Info;
+};
+
+//
+// 直近のフレームを PSRAM のリングバッファに残す
+//
+// 容量はバイト数で決め、足りなくなったら古いフレームから捨てる。
+// 参照中のフレームは捨てられないので、その場合は新しいフレームの記録を諦める。
+//
+class FrameHistory
+{
+public:
+
+    struct Config
+    {
+        size_t   CapacityBytes;
+        size_t   MaxFrames;
+        uint32_t IntervalMs;        // 記録する間隔
+    };
+
+    struct Statistics
+    {
+        uint32_t Recorded;
+        uint32_t Evicted;
+        uint32_t Dropped;           // 参照中のフレームが邪魔で記録できなかった数
+        uint32_t Frames;
+        uint32_t UsedBytes;
+    };
+
+    static inline constexpr char sk_Tag[] = "History";
+
+public:
+
+    // DO NOT COPY
+    FrameHistory( const FrameHistory& ) = delete;
+    FrameHistory& operator=( const FrameHistory& ) = delete;
+
+    static FrameHistory& Instance();
+
+    bool Start( const Config& config );
+    void Stop();
+
+    bool Record( const CameraFrameBuffer& fb );
+
+    // age = 0 が最新
+    bool Get( size_t age, HistoryFrame* frame );
+    // ボタンや動体検知の時点を記録し、その時点の最新の通し番号を返す
+    uint32_t MarkEvent();
+    uint32_t EventSequence() const;
+
+    // 通し番号が until_sequence 以下のものを新しい方から max_count 枚、古い順に返す。
+    // until_sequence が 0 なら最新から。
+    size_t Collect( uint32_t until_sequence, size_t max_count, std::vector<HistoryFrame>* frames );
+    // 参照せずに情報だけを新しい順に返す
+    size_t GetInfo( CameraFrameInfo* infos, size_t max_count ) const;
+
+    Statistics GetStatistics() const;
+
+private:
+    friend class HistoryFrame;
+
+    FrameHistory();
+    ~FrameHistory() noexcept;
+
+    static const uint32_t sk_TaskStackSize = 3072;
+    static const UBaseType_t sk_TaskPriority = tskIDLE_PRIORITY + 2;
+    static const BaseType_t sk_TaskCoreId = 1;
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+
+    struct Entry
+    {
+        size_t          Offset;
+        size_t          Length;
+        uint32_t        Pins;
+        CameraFrameInfo Info;
+    };
+
+    static void RecordTask( void* param );
+    void run();
+
+    void pin( size_t index, HistoryFrame* frame );
+    void unpin( size_t index );
+    bool overlaps( size_t offset, size_t length ) const;
+    size_t entryIndex( size_t age ) const;     // age = 0 が最新
+
+    bool lock() const;
+    void unlock() const;
+
+    Config           m_Config;
+    TaskHandle_t     m_Task;
+    volatile bool    m_Running;
+    uint8_t*         m_Buffer;
+    std::vector<Entry> m_Entries;           // 古い順のリング
+    size_t           m_First;
+    size_t           m_Count;
+    size_t           m_WriteOffset;
+    uint32_t         m_LastSequence;
+    uint32_t         m_EventSequence;
+    Statistics       m_Statistics;
+    xSemaphoreHandle m_Mutex;
+};
+
+#endif    // FRAME_HISTORY_HPP_INCLUDED
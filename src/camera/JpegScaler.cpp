@@ -0,0 +1,280 @@
+#include "JpegScaler.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+#include "img_converters.h"
+#include "esp_log.h"
+
+static const char sk_Tag[] = "JpegScaler";
+// 他のタスクのデコードが終わるのを待つ時間 (UXGA の展開でも収まる程度)
+static const portTickType sk_DecodeMutexWaitPeriodMs = (2000 / portTICK_PERIOD_MS);
+
+static const char* const sk_FrameScaleNames[] = { "full", "half", "quarter", "eighth" };
+
+// デコーダへの入力。各コンテキストの先頭に置き、JpgRead を共用する。
+struct JpegInput
+{
+    const uint8_t* Data;
+    size_t         Length;
+};
+
+struct DecodeContext
+{
+    JpegInput      Input;
+    uint8_t        Shift;           // 縮小率 1/2^n
+    CropRegion     Crop;            // 元の解像度での指定
+    uint8_t*       Output;          // BGR888
+    uint16_t       Left;            // 縮小後の画像での切り出し位置
+    uint16_t       Top;
+    uint16_t       Width;
+    uint16_t       Height;
+    bool           Failed;          // 開始時の確認で中止した
+};
+
+struct LumaContext
+{
+    JpegInput      Input;
+    uint8_t*       Output;
+    size_t         Capacity;
+    uint16_t       Width;
+    uint16_t       Height;
+    bool           Failed;
+};
+
+static bool Decode( size_t length, jpg_scale_t scale, jpg_writer_cb writer, void* context );
+static size_t JpgRead( void* arg, size_t index, uint8_t* buf, size_t len );
+static bool RgbWrite( void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data );
+static bool LumaWrite( void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data );
+
+bool ScaleJpeg( const uint8_t* jpeg, size_t length, FrameScale scale, uint8_t quality, CameraFrameDerivative* derivative )
+{
+    if( scale == FrameScale::Full ){
+        return false;
+    }
+
+    FrameTransform transform;
+    transform.Scale   = scale;
+    transform.Quality = quality;
+    return TransformJpeg( jpeg, length, transform, derivative );
+}
+
+bool TransformJpeg( const uint8_t* jpeg, size_t length, const FrameTransform& transform, CameraFrameDerivative* derivative )
+{
+    jpg_scale_t jpg_scale = JPG_SCALE_NONE;
+    switch( transform.Scale ){
+    case FrameScale::Full:      jpg_scale = JPG_SCALE_NONE; break;
+    case FrameScale::Half:      jpg_scale = JPG_SCALE_2X;   break;
+    case FrameScale::Quarter:   jpg_scale = JPG_SCALE_4X;   break;
+    case FrameScale::Eighth:    jpg_scale = JPG_SCALE_8X;   break;
+    default:
+        return false;
+    }
+
+    DecodeContext context = {};
+    context.Input   = { jpeg, length };
+    context.Shift   = static_cast<uint8_t>(transform.Scale);
+    context.Crop    = transform.Crop;
+    if( !Decode( length, jpg_scale, RgbWrite, &context ) || context.Failed || context.Output == nullptr ){
+        ESP_LOGE( sk_Tag, "Decode failed. scale=%s", FrameScaleName( transform.Scale ) );
+        heap_caps_free( context.Output );
+        return false;
+    }
+
+    uint8_t quality = (transform.Quality != 0) ? transform.Quality : Camera::sk_DerivativeJpegQuality;
+    uint8_t* out = nullptr;
+    size_t out_length = 0;
+    bool result = fmt2jpg( context.Output, context.Width * context.Height * 3, context.Width, context.Height,
+                           PIXFORMAT_RGB888, quality, &out, &out_length );
+    heap_caps_free( context.Output );
+    if( !result ){
+        ESP_LOGE( sk_Tag, "Encode failed. scale=%s", FrameScaleName( transform.Scale ) );
+        return false;
+    }
+
+    derivative->Buffer = out;
+    derivative->Length = out_length;
+    derivative->Width  = context.Width;
+    derivative->Height = context.Height;
+
+    ESP_LOGD( sk_Tag, "%s (%u,%u): %ux%u q=%u, %u -> %u bytes", FrameScaleName( transform.Scale ),
+              context.Left, context.Top, context.Width, context.Height, quality,
+              static_cast<unsigned>(length), static_cast<unsigned>(out_length) );
+    return true;
+}
+
+bool ExtractLumaMap( const uint8_t* jpeg, size_t length, uint8_t* luma, size_t capacity, uint16_t* width, uint16_t* height )
+{
+    LumaContext context = { { jpeg, length }, luma, capacity, 0, 0, false };
+    if( !Decode( length, JPG_SCALE_8X, LumaWrite, &context ) || context.Failed || context.Width == 0 ){
+        return false;
+    }
+
+    *width  = context.Width;
+    *height = context.Height;
+    return true;
+}
+
+const char* FrameScaleName( FrameScale scale )
+{
+    return sk_FrameScaleNames[static_cast<size_t>(scale)];
+}
+
+bool ParseFrameScale( std::string_view name, FrameScale* scale )
+{
+    for( size_t i = 0; i < sizeof(sk_FrameScaleNames) / sizeof(sk_FrameScaleNames[0]); ++i ){
+        if( name == sk_FrameScaleNames[i] ){
+            *scale = static_cast<FrameScale>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// esp_jpg_decode() は静的な作業領域を使うので、タスクをまたいで同時にデコードしないよう排他する
+static bool Decode( size_t length, jpg_scale_t scale, jpg_writer_cb writer, void* context )
+{
+    static xSemaphoreHandle s_DecodeMutex = xSemaphoreCreateMutex();
+
+    if( !xSemaphoreTake( s_DecodeMutex, ( portTickType )sk_DecodeMutexWaitPeriodMs ) ){
+        ESP_LOGE( sk_Tag, "Decoder is busy." );
+        return false;
+    }
+
+    esp_err_t result = esp_jpg_decode( length, scale, JpgRead, writer, context );
+
+    if( xSemaphoreGive( s_DecodeMutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+    return result == ESP_OK;
+}
+
+static size_t JpgRead( void* arg, size_t index, uint8_t* buf, size_t len )
+{
+    JpegInput* input = reinterpret_cast<JpegInput*>(arg);
+    if( index >= input->Length ){
+        return 0;
+    }
+    if( index + len > input->Length ){
+        len = input->Length - index;
+    }
+    // buf が nullptr の場合は読み飛ばし
+    if( buf ){
+        memcpy( buf, input->Data + index, len );
+    }
+    return len;
+}
+
+static bool RgbWrite( void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data )
+{
+    DecodeContext* context = reinterpret_cast<DecodeContext*>(arg);
+
+    if( data == nullptr ){
+        // (0, 0) は開始で、w, h に縮小後の大きさが来る。それ以外は終了。
+        if( x == 0 && y == 0 ){
+            context->Left   = 0;
+            context->Top    = 0;
+            context->Width  = w;
+            context->Height = h;
+            if( !context->Crop.IsEmpty() ){
+                // 縮小後の座標に直し、画像からはみ出す分は削る
+                uint32_t left   = context->Crop.X >> context->Shift;
+                uint32_t top    = context->Crop.Y >> context->Shift;
+                uint32_t right  = (static_cast<uint32_t>(context->Crop.X) + context->Crop.Width) >> context->Shift;
+                uint32_t bottom = (static_cast<uint32_t>(context->Crop.Y) + context->Crop.Height) >> context->Shift;
+                if( right > w ){
+                    right = w;
+                }
+                if( bottom > h ){
+                    bottom = h;
+                }
+                if( left >= right || top >= bottom ){
+                    ESP_LOGE( sk_Tag, "Crop region is outside of %ux%u.", w, h );
+                    context->Failed = true;
+                    return false;
+                }
+                context->Left   = static_cast<uint16_t>(left);
+                context->Top    = static_cast<uint16_t>(top);
+                context->Width  = static_cast<uint16_t>(right - left);
+                context->Height = static_cast<uint16_t>(bottom - top);
+            }
+            if( static_cast<uint32_t>(context->Width) * context->Height > sk_MaxTransformPixels ){
+                ESP_LOGE( sk_Tag, "%ux%u is too large to transform.", context->Width, context->Height );
+                context->Failed = true;
+                return false;
+            }
+            context->Output = reinterpret_cast<uint8_t*>(heap_caps_malloc( context->Width * context->Height * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT ));
+            if( context->Output == nullptr ){
+                ESP_LOGE( sk_Tag, "Failed to allocate %ux%u RGB buffer.", context->Width, context->Height );
+                context->Failed = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // デコーダは開始時の戻り値を見ないので、中止した場合はここで止める
+    if( context->Failed || context->Output == nullptr ){
+        return false;
+    }
+
+    // 切り出す範囲と重なる部分だけを書く
+    uint16_t col_begin = (x < context->Left) ? context->Left : x;
+    uint16_t col_end   = (x + w > context->Left + context->Width) ? context->Left + context->Width : x + w;
+    uint16_t row_begin = (y < context->Top) ? context->Top : y;
+    uint16_t row_end   = (y + h > context->Top + context->Height) ? context->Top + context->Height : y + h;
+    if( col_begin >= col_end || row_begin >= row_end ){
+        return true;
+    }
+
+    // デコーダは RGB 順で出すが、fmt2jpg の RGB888 はカメラと同じ BGR 順を期待する
+    size_t stride = context->Width * 3;
+    size_t line = (col_end - col_begin) * 3;
+    for( uint16_t row = row_begin; row < row_end; ++row ){
+        const uint8_t* in = data + ((row - y) * w + (col_begin - x)) * 3;
+        uint8_t* out = context->Output + (row - context->Top) * stride + (col_begin - context->Left) * 3;
+        for( size_t i = 0; i < line; i += 3 ){
+            out[i]     = in[i + 2];
+            out[i + 1] = in[i + 1];
+            out[i + 2] = in[i];
+        }
+    }
+    return true;
+}
+
+static bool LumaWrite( void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data )
+{
+    LumaContext* context = reinterpret_cast<LumaContext*>(arg);
+
+    if( data == nullptr ){
+        if( x == 0 && y == 0 ){
+            if( static_cast<size_t>(w) * h > context->Capacity ){
+                ESP_LOGE( sk_Tag, "Luma map %ux%u exceeds %u bytes.", w, h, static_cast<unsigned>(context->Capacity) );
+                context->Failed = true;
+                return false;
+            }
+            context->Width  = w;
+            context->Height = h;
+        }
+        return true;
+    }
+
+    if( context->Failed || context->Output == nullptr ){
+        return false;
+    }
+
+    // BT.601 の係数を 8bit 固定小数点で
+    for( uint16_t row = 0; row < h; ++row ){
+        uint8_t* out = context->Output + (y + row) * context->Width + x;
+        for( uint16_t col = 0; col < w; ++col ){
+            out[col] = static_cast<uint8_t>((77 * data[0] + 150 * data[1] + 29 * data[2]) >> 8);
+            data += 3;
+        }
+    }
+    return true;
+}
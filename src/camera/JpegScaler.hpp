@@ -0,0 +1,61 @@
+#ifndef     JPEG_SCALER_HPP_INCLUDED
+#define     JPEG_SCALER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+#include "Camera.hpp"
+
+//
+// JPEG の縮小と切り出し
+//
+// デコード時に DCT 領域で 1/2, 1/4, 1/8 に縮小し、JPEG にエンコードし直す。
+// 縮小後の、切り出す範囲の RGB だけを一時的に PSRAM に確保するので、元の大きさの RGB は展開しない。
+//
+
+// 切り出す範囲。元の解像度の画素で指定する。Width か Height が 0 なら全体。
+struct CropRegion
+{
+    uint16_t X;
+    uint16_t Y;
+    uint16_t Width;
+    uint16_t Height;
+
+    bool IsEmpty() const { return Width == 0 || Height == 0; }
+};
+
+// 送る前にフレームに施す変換
+struct FrameTransform
+{
+    FrameScale Scale   = FrameScale::Full;
+    uint8_t    Quality = 0;         // 0 なら Camera::sk_DerivativeJpegQuality
+    CropRegion Crop    = {};
+
+    // 縮小だけなら CameraFrameBuffer::Derivative() のキャッシュを使える
+    bool IsScaleOnly() const { return Quality == 0 && Crop.IsEmpty(); }
+    // 元のフレームをそのまま送る
+    bool IsIdentity() const { return IsScaleOnly() && Scale == FrameScale::Full; }
+};
+
+// TransformJpeg() が RGB に展開できる画素数の上限 (BGR888 で約 2.3MB)
+static constexpr uint32_t sk_MaxTransformPixels = 1024 * 768;
+
+// 成功した場合、derivative->Buffer は free() で解放すること
+bool ScaleJpeg( const uint8_t* jpeg, size_t length, FrameScale scale, uint8_t quality, CameraFrameDerivative* derivative );
+
+// 縮小してから切り出し、エンコードし直す。
+// 縮小、切り出し後の大きさが sk_MaxTransformPixels を超える場合は失敗する (Full で切り出さない UXGA など)。
+// 成功した場合、derivative->Buffer は free() で解放すること
+bool TransformJpeg( const uint8_t* jpeg, size_t length, const FrameTransform& transform, CameraFrameDerivative* derivative );
+
+// 1/8 に縮小した輝度だけを luma に書く。
+// 1/8 ではデコーダが各ブロックの DC 係数から 1 画素を作るので、IDCT も RGB の展開も行わない。
+// capacity が足りない場合は false。
+bool ExtractLumaMap( const uint8_t* jpeg, size_t length, uint8_t* luma, size_t capacity, uint16_t* width, uint16_t* height );
+
+// "full", "half", "quarter", "eighth"
+const char* FrameScaleName( FrameScale scale );
+bool ParseFrameScale( std::string_view name, FrameScale* scale );
+
+#endif    // JPEG_SCALER_HPP_INCLUDED
@@ -0,0 +1,230 @@
+#include "MotionDetector.hpp"
+#include "CaptureCoordinator.hpp"
+#include "JpegScaler.hpp"
+
+#include <cstdlib>
+#include <new>
+
+#include "esp_timer.h"
+#include "esp_log.h"
+
+MotionDetector::MotionDetector()
+    : m_Config(),
+      m_Task( nullptr ),
+      m_Running( false ),
+      m_Luma(),
+      m_Background(),
+      m_Width( 0 ),
+      m_Height( 0 ),
+      m_LearnedFrames( 0 ),
+      m_Statistics(),
+      m_TotalProcessUs( 0 )
+{
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+MotionDetector::~MotionDetector()
+{}
+
+MotionDetector& MotionDetector::Instance()
+{
+    static MotionDetector s_Instance;
+    return s_Instance;
+}
+
+bool MotionDetector::Start( const Config& config )
+{
+    if( m_Running || config.LearningShift == 0 || config.LearningShift > 8 ){
+        return false;
+    }
+
+    // 前のタスクが終わる前に作ると、2 つのタスクが同じ背景を更新してしまう
+    portTickType wait_start = xTaskGetTickCount();
+    while( m_Task != nullptr ){
+        if( (xTaskGetTickCount() - wait_start) >= sk_StopWaitPeriodMs ){
+            ESP_LOGE( sk_Tag, "Previous detect task is still running." );
+            return false;
+        }
+        vTaskDelay( sk_StopPollPeriodMs );
+    }
+
+    if( !m_Luma ){
+        m_Luma.reset( new (std::nothrow) uint8_t[sk_MapCapacity] );
+        m_Background.reset( new (std::nothrow) uint16_t[sk_MapCapacity] );
+        if( !m_Luma || !m_Background ){
+            ESP_LOGE( sk_Tag, "Failed to allocate luma map." );
+            m_Luma.reset();
+            m_Background.reset();
+            return false;
+        }
+    }
+
+    m_Config        = config;
+    m_Width         = 0;
+    m_Height        = 0;
+    m_LearnedFrames = 0;
+    m_Running       = true;
+    if( xTaskCreatePinnedToCore( DetectTask, "MotionDetect", sk_TaskStackSize, this, sk_TaskPriority, &m_Task, sk_TaskCoreId ) != pdPASS ){
+        ESP_LOGE( sk_Tag, "Failed to create detect task." );
+        m_Running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void MotionDetector::Stop()
+{
+    // タスクは撮影を待ち終えた後のループで自分を削除する。終わるまでの間に Start() が呼ばれた場合はそちらで待つ。
+    m_Running = false;
+}
+
+MotionDetector::Statistics MotionDetector::GetStatistics() const
+{
+    Statistics stats = {};
+    if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+        stats = m_Statistics;
+        if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+            // IT MUST BE BUG
+            abort();
+        }
+    }
+    return stats;
+}
+
+void MotionDetector::DetectTask( void* param )
+{
+    MotionDetector* instance = reinterpret_cast<MotionDetector*>(param);
+    instance->run();
+
+    instance->m_Task = nullptr;
+    vTaskDelete( nullptr );
+}
+
+void MotionDetector::run()
+{
+    portTickType last_report = xTaskGetTickCount();
+    portTickType last_trigger = 0;
+    bool triggered = false;
+
+    while( m_Running ){
+        // MJPEG 配信中はそのフレームを共有するので、センサーからの取得は増えない
+        CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( 0 );
+        if( !fb.IsValid() ){
+            vTaskDelay( 100 / portTICK_PERIOD_MS );
+            continue;
+        }
+        if( fb.Format() != PIXFORMAT_JPEG ){
+            ESP_LOGE( sk_Tag, "Motion detection requires JPEG frames." );
+            // Start() でやり直せるようにする
+            m_Running = false;
+            break;
+        }
+
+        int64_t start = esp_timer_get_time();
+
+        uint16_t width = 0;
+        uint16_t height = 0;
+        bool decoded = ExtractLumaMap( fb.Buffer(), fb.Length(), m_Luma.get(), sk_MapCapacity, &width, &height );
+        size_t count = static_cast<size_t>(width) * height;
+
+        uint32_t changed = 0;
+        if( decoded && count > 0 ){
+            if( width != m_Width || height != m_Height ){
+                // 解像度が変わったら背景を作り直す
+                m_Width  = width;
+                m_Height = height;
+                m_LearnedFrames = 0;
+            }
+
+            if( m_LearnedFrames == 0 ){
+                for( size_t i = 0; i < count; ++i ){
+                    m_Background[i] = static_cast<uint16_t>(m_Luma[i] << 4);
+                }
+            }
+            else {
+                changed = compare( count );
+            }
+            ++m_LearnedFrames;
+        }
+
+        uint32_t elapsed_us = static_cast<uint32_t>(esp_timer_get_time() - start);
+
+        if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+            if( decoded ){
+                ++m_Statistics.Frames;
+                m_TotalProcessUs += elapsed_us;
+                m_Statistics.AverageProcessUs    = static_cast<uint32_t>(m_TotalProcessUs / m_Statistics.Frames);
+                m_Statistics.LastChangedPermille = changed;
+            }
+            else {
+                ++m_Statistics.DecodeFailures;
+            }
+            if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+                // IT MUST BE BUG
+                abort();
+            }
+        }
+
+        portTickType now = xTaskGetTickCount();
+        bool cooled = !triggered || (now - last_trigger) * portTICK_PERIOD_MS >= m_Config.CooldownMs;
+        if( m_LearnedFrames > m_Config.WarmupFrames && changed > m_Config.TriggerPermille && cooled ){
+            triggered = true;
+            last_trigger = now;
+            ESP_LOGI( sk_Tag, "Motion detected. changed=%u/1000 frame=%u",
+                      static_cast<unsigned>(changed), static_cast<unsigned>(fb.Sequence()) );
+
+            if( xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs ) ){
+                ++m_Statistics.Triggers;
+                if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+                    // IT MUST BE BUG
+                    abort();
+                }
+            }
+
+            if( m_Config.Handler ){
+                MotionEvent event = { std::move( fb ), changed };
+                m_Config.Handler( m_Config.HandlerArg, event );
+            }
+        }
+
+        if( (now - last_report) >= sk_ReportPeriodMs ){
+            Statistics stats = GetStatistics();
+            ESP_LOGI( sk_Tag, "frames=%u triggers=%u failures=%u changed=%u/1000 process=%uus",
+                      static_cast<unsigned>(stats.Frames), static_cast<unsigned>(stats.Triggers),
+                      static_cast<unsigned>(stats.DecodeFailures), static_cast<unsigned>(stats.LastChangedPermille),
+                      static_cast<unsigned>(stats.AverageProcessUs) );
+            last_report = now;
+        }
+    }
+}
+
+uint32_t MotionDetector::compare( size_t count )
+{
+    const uint8_t* luma = m_Luma.get();
+    uint16_t* background = m_Background.get();
+
+    // 露出の変化で全体が明るく/暗くなった分は動きとみなさない
+    uint32_t luma_sum = 0;
+    uint32_t background_sum = 0;
+    for( size_t i = 0; i < count; ++i ){
+        luma_sum       += luma[i];
+        background_sum += background[i];
+    }
+    int32_t offset = (static_cast<int32_t>(luma_sum) - static_cast<int32_t>(background_sum >> 4)) / static_cast<int32_t>(count);
+
+    int32_t threshold = m_Config.PixelThreshold;
+    uint8_t shift = m_Config.LearningShift;
+    uint32_t changed = 0;
+    for( size_t i = 0; i < count; ++i ){
+        int32_t value = luma[i];
+        int32_t model = background[i];
+        int32_t diff = value - (model >> 4) - offset;
+        if( diff > threshold || diff < -threshold ){
+            ++changed;
+        }
+        background[i] = static_cast<uint16_t>(model + (((value << 4) - model) >> shift));
+    }
+
+    return static_cast<uint32_t>((static_cast<uint64_t>(changed) * 1000) / count);
+}
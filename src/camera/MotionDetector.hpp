@@ -0,0 +1,104 @@
+#ifndef     MOTION_DETECTOR_HPP_INCLUDED
+#define     MOTION_DETECTOR_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "Camera.hpp"
+
+//
+// 動体検知
+//
+// フレーム毎に JPEG の DC 係数から 1/8 の輝度マップを作り、背景モデルとの差分で動きを判定する。
+// フルデコードしないので、センサーのフレームレートに 1 コアで追従できる。
+// 追いつけない場合は CaptureCoordinator が最新のフレームを返すので、間のフレームは飛ばされる。
+//
+class MotionDetector
+{
+public:
+
+    struct MotionEvent
+    {
+        CameraFrameBuffer Frame;            // 動きを検知したフレーム (フル解像度)
+        uint32_t          ChangedPermille;  // 変化した画素の割合 (‰)
+    };
+
+    // 検知タスクから呼ばれる。長い処理は JobExecutor 等へ渡すこと。
+    typedef void (*MotionHandler)( void* arg, const MotionEvent& event );
+
+    struct Config
+    {
+        uint8_t       PixelThreshold;       // 背景との差がこれを超えた画素を変化とみなす
+        uint16_t      TriggerPermille;      // 変化した画素がこの割合を超えたら検知
+        uint8_t       LearningShift;        // 背景の更新率 1/2^n
+        uint32_t      WarmupFrames;         // 背景が安定するまで検知しない
+        uint32_t      CooldownMs;           // 検知後、次の検知までの間隔
+        MotionHandler Handler;
+        void*         HandlerArg;
+    };
+
+    struct Statistics
+    {
+        uint32_t Frames;
+        uint32_t Triggers;
+        uint32_t DecodeFailures;
+        uint32_t LastChangedPermille;
+        uint32_t AverageProcessUs;
+    };
+
+    static inline constexpr char sk_Tag[] = "Motion";
+
+public:
+
+    // DO NOT COPY
+    MotionDetector( const MotionDetector& ) = delete;
+    MotionDetector& operator=( const MotionDetector& ) = delete;
+
+    static MotionDetector& Instance();
+
+    bool Start( const Config& config );
+    void Stop();
+
+    Statistics GetStatistics() const;
+
+private:
+
+    MotionDetector();
+    ~MotionDetector() noexcept;
+
+    // UXGA の 1/8 (200x150) が入る大きさ
+    static const size_t sk_MapCapacity = 200 * 150;
+    static const uint32_t sk_TaskStackSize = 4096;
+    static const UBaseType_t sk_TaskPriority = tskIDLE_PRIORITY + 3;
+    static const BaseType_t sk_TaskCoreId = 1;
+    static const portTickType sk_ReportPeriodMs = (10000 / portTICK_PERIOD_MS);
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+    // Stop() 後のタスクは撮影待ち (CaptureCoordinator::sk_DefaultTimeoutMs) から戻るまで残る
+    static const portTickType sk_StopWaitPeriodMs = (6000 / portTICK_PERIOD_MS);
+    static const portTickType sk_StopPollPeriodMs = (20 / portTICK_PERIOD_MS);
+
+    static void DetectTask( void* param );
+    void run();
+
+    // 変化した画素の割合を返し、背景を更新する
+    uint32_t compare( size_t count );
+
+    Config           m_Config;
+    TaskHandle_t     m_Task;
+    volatile bool    m_Running;
+    std::unique_ptr<uint8_t[]>  m_Luma;
+    std::unique_ptr<uint16_t[]> m_Background;   // 輝度 << 4 の固定小数点
+    uint16_t         m_Width;
+    uint16_t         m_Height;
+    uint32_t         m_LearnedFrames;
+    Statistics       m_Statistics;
+    uint64_t         m_TotalProcessUs;
+    xSemaphoreHandle m_Mutex;
+};
+
+#endif    // MOTION_DETECTOR_HPP_INCLUDED
@@ -0,0 +1,79 @@
+
+#include "ChunkedResponseWriter.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+ChunkedResponseWriter::ChunkedResponseWriter( httpd_req_t* req, size_t buffer_size )
+    : m_Request( req ),
+      m_Buffer( nullptr ),
+      m_BufferSize( 0 ),
+      m_Buffered( 0 ),
+      m_Length( 0 )
+{
+    if( buffer_size > 0 ){
+        m_Buffer = reinterpret_cast<uint8_t*>(malloc( buffer_size ));
+        if( m_Buffer ){
+            m_BufferSize = buffer_size;
+        }
+    }
+}
+
+ChunkedResponseWriter::~ChunkedResponseWriter()
+{
+    if( m_Buffer ){
+        free( m_Buffer );
+    }
+}
+
+bool ChunkedResponseWriter::Write( const void* data, size_t length )
+{
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+    m_Length += length;
+
+    while( length > 0 ){
+        // バッファが空で、1 回分以上の大きさがあるならコピーせずに送る
+        if( m_Buffered == 0 && length >= m_BufferSize ){
+            return httpd_resp_send_chunk( m_Request, reinterpret_cast<const char*>(src), length ) == ESP_OK;
+        }
+
+        size_t n = m_BufferSize - m_Buffered;
+        if( n > length ){
+            n = length;
+        }
+        std::memcpy( m_Buffer + m_Buffered, src, n );
+        m_Buffered += n;
+        src    += n;
+        length -= n;
+
+        if( m_Buffered == m_BufferSize && !flush() ){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ChunkedResponseWriter::Finish()
+{
+    if( !flush() ){
+        return false;
+    }
+    return httpd_resp_send_chunk( m_Request, nullptr, 0 ) == ESP_OK;
+}
+
+size_t ChunkedResponseWriter::Length() const
+{
+    return m_Length;
+}
+
+bool ChunkedResponseWriter::flush()
+{
+    if( m_Buffered == 0 ){
+        return true;
+    }
+
+    esp_err_t res = httpd_resp_send_chunk( m_Request, reinterpret_cast<const char*>(m_Buffer), m_Buffered );
+    m_Buffered = 0;
+    return res == ESP_OK;
+}
@@ -0,0 +1,44 @@
+#ifndef     CHUNKED_RESPONSE_WRITER_HPP_INCLUDED
+#define     CHUNKED_RESPONSE_WRITER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+#include "esp_http_server.h"
+
+//
+// httpd_resp_send_chunk() の前に置くバッファ
+//
+// エンコーダの細かい出力をまとめ、バッファが埋まった時だけチャンクとして送る。
+// バッファを確保できなかった場合は、そのまま 1 回ずつ送る。
+//
+class ChunkedResponseWriter
+{
+public:
+
+    ChunkedResponseWriter( httpd_req_t* req, size_t buffer_size );
+    ~ChunkedResponseWriter() noexcept;
+
+    // DO NOT COPY
+    ChunkedResponseWriter( const ChunkedResponseWriter& ) = delete;
+    ChunkedResponseWriter& operator=( const ChunkedResponseWriter& ) = delete;
+
+    bool Write( const void* data, size_t length );
+
+    // 残りを送り、終端チャンクを送る
+    bool Finish();
+
+    size_t Length() const;
+
+private:
+
+    bool flush();
+
+    httpd_req_t* m_Request;
+    uint8_t*     m_Buffer;
+    size_t       m_BufferSize;
+    size_t       m_Buffered;
+    size_t       m_Length;
+};
+
+#endif    // CHUNKED_RESPONSE_WRITER_HPP_INCLUDED
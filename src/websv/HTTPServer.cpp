@@ -1,17 +1,72 @@
 
 #include "HTTPServer.hpp"
 #include "Camera.hpp"
+#include "CaptureCoordinator.hpp"
+#include "FrameHistory.hpp"
+#include "MJPEGStreamer.hpp"
+#include "ChunkedResponseWriter.hpp"
+#include "JpegScaler.hpp"
+#include "Metrics.hpp"
+#include "DNSResolverCache.hpp"
+#include "AWS_IoTClientWrapper.hpp"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "lwip/sockets.h"
+
+#include "sdkconfig.h"
+#include "esp_system.h"
 #include "esp_log.h"
 
+// これより古いフレームは撮り直す
+static const uint32_t sk_CaptureMaxAgeMs = 200;
+// If-None-Match 付きの要求の既定値。手元にフレームを持つポーリングなので、撮り直さずに 304 を返せるよう長くする。
+static const uint32_t sk_ConditionalMaxAgeMs = 5000;
+// /history/ の一覧に載せる最大数
+static const size_t sk_HistoryListMax = 32;
+static const char sk_HistoryPrefix[] = "/history/";
+// エンコーダの出力をまとめて 1 チャンクにする大きさ
+static const size_t sk_ChunkBufferSize = CONFIG_HTTPD_CHUNK_BUFFER_SIZE;
+
+// フレームの識別用ヘッダ。httpd_resp_set_hdr() は文字列を参照するだけなので、送信まで保持すること。
+struct FrameHeaders
+{
+    char ETag[32];
+    char LastModified[40];
+    char Sequence[12];
+    char Timestamp[24];
+    char Length[12];
+};
 
-struct jpg_chunking_t
+// /capture のクエリ
+struct CaptureParams
 {
-    httpd_req_t* req;
-    size_t len;
+    uint32_t   MaxAgeMs;
+    FrameScale Scale;
+    bool       Conditional;     // If-None-Match 付き
 };
 
+// 再起動で通し番号が戻っても ETag が衝突しないよう、起動毎の値を混ぜる
+static uint32_t s_BootId = 0;
+
 static esp_err_t CaptureGetHandler( httpd_req_t* req );
+static esp_err_t CaptureHeadHandler( httpd_req_t* req );
+static void FormatETag( const CameraFrameInfo& info, FrameScale scale, char* etag, size_t size );
+static void SetFrameHeaders( httpd_req_t* req, const CameraFrameInfo& info, FrameScale scale, FrameHeaders* headers );
+static void SetFrameLength( httpd_req_t* req, size_t length, FrameHeaders* headers );
+static bool IsNotModified( httpd_req_t* req, const char* etag );
+static esp_err_t SendNotModified( httpd_req_t* req );
+static bool GetCaptureParams( httpd_req_t* req, CaptureParams* params );
+static esp_err_t HistoryGetHandler( httpd_req_t* req );
+static esp_err_t HistoryListHandler( httpd_req_t* req );
+static esp_err_t MetricsGetHandler( httpd_req_t* req );
+static bool WriteMetrics( void* arg, const char* data, size_t length );
+static void WriteCounter( ChunkedResponseWriter* writer, const char* name, uint32_t value );
+static esp_err_t StreamGetHandler( httpd_req_t* req );
+static void SessionCloseHandler( httpd_handle_t server, int sockfd );
 static size_t JpgEncodeStream( void * arg, size_t index, const void* data, size_t len );
 
 static httpd_uri_t s_URI_CapturedImagePage = {
@@ -21,11 +76,45 @@ static httpd_uri_t s_URI_CapturedImagePage = {
     .user_ctx   = nullptr 
 };
 
+static httpd_uri_t s_URI_CapturedImageHead = {
+    .uri        = "/capture",
+    .method     = HTTP_HEAD,
+    .handler    = CaptureHeadHandler,
+    .user_ctx   = nullptr
+};
+
+static httpd_uri_t s_URI_HistoryPage = {
+    .uri        = "/history/*",
+    .method     = HTTP_GET,
+    .handler    = HistoryGetHandler,
+    .user_ctx   = nullptr
+};
+
+static httpd_uri_t s_URI_MetricsPage = {
+    .uri        = "/metrics",
+    .method     = HTTP_GET,
+    .handler    = MetricsGetHandler,
+    .user_ctx   = nullptr
+};
+
+static httpd_uri_t s_URI_StreamPage = {
+    .uri        = "/stream",
+    .method     = HTTP_GET,
+    .handler    = StreamGetHandler,
+    .user_ctx   = nullptr
+};
+
 
 httpd_handle_t StartWebServer()
 {
     /* Generate default configuration */
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    // ストリーム配信中のソケットを配信タスクから外してから閉じる
+    config.close_fn = SessionCloseHandler;
+    // /history/<n>
+    config.uri_match_fn = httpd_uri_match_wildcard;
+
+    s_BootId = esp_random();
 
     /* Empty handle to esp_http_server */
     httpd_handle_t server = NULL;
@@ -34,14 +123,50 @@ httpd_handle_t StartWebServer()
     if( httpd_start(&server, &config) == ESP_OK ){
         /* Register URI handlers */
         httpd_register_uri_handler( server, &s_URI_CapturedImagePage );
+        httpd_register_uri_handler( server, &s_URI_CapturedImageHead );
+        httpd_register_uri_handler( server, &s_URI_HistoryPage );
+        httpd_register_uri_handler( server, &s_URI_MetricsPage );
+        httpd_register_uri_handler( server, &s_URI_StreamPage );
+        MJPEGStreamer::Instance().Start( server );
     }
     /* If server failed to start, handle will be NULL */
     return server;
 }
 
+void StopWebServer( httpd_handle_t server )
+{
+    if( server == nullptr ){
+        return;
+    }
+
+    MJPEGStreamer::Instance().Stop();
+    httpd_stop( server );
+}
+
 static esp_err_t CaptureGetHandler( httpd_req_t* req )
 {
-    CameraFrameBuffer fb = Camera::Instance().FrameBuffer();
+    CaptureParams params;
+    if( !GetCaptureParams( req, &params ) ){
+        return httpd_resp_send_err( req, HTTPD_400_BAD_REQUEST, "Unknown size" );
+    }
+
+    // 最後のフレームが鮮度の範囲内で相手も持っているなら、撮影もフレームの取得もせずに返す
+    if( params.Conditional ){
+        CameraFrameInfo info;
+        uint32_t age_ms = 0;
+        char etag[sizeof(FrameHeaders::ETag)];
+        if( CaptureCoordinator::Instance().LatestInfo( &info, &age_ms ) && age_ms <= params.MaxAgeMs ){
+            FormatETag( info, params.Scale, etag, sizeof(etag) );
+            if( IsNotModified( req, etag ) ){
+                FrameHeaders headers;
+                SetFrameHeaders( req, info, params.Scale, &headers );
+                return SendNotModified( req );
+            }
+        }
+    }
+
+    // 同時に来た要求や配信中のフレームと撮影をまとめる
+    CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( params.MaxAgeMs );
     esp_err_t res = ESP_OK;
 
     if( !fb.IsValid() ){
@@ -50,18 +175,41 @@ static esp_err_t CaptureGetHandler( httpd_req_t* req )
         return ESP_FAIL;
     }
 
+    FrameHeaders headers;
+    SetFrameHeaders( req, fb.Info(), params.Scale, &headers );
+    if( IsNotModified( req, headers.ETag ) ){
+        return SendNotModified( req );
+    }
+
+    // 縮小版はフレームにキャッシュされるので、同じフレームへの 2 回目以降の要求では作り直さない
+    const CameraFrameDerivative* derivative = nullptr;
+    if( params.Scale != FrameScale::Full ){
+        derivative = fb.Derivative( params.Scale );
+        if( derivative == nullptr ){
+            ESP_LOGE( "CAMServer", "Failed to scale frame. size=%s", FrameScaleName( params.Scale ) );
+            httpd_resp_send_500( req );
+            return ESP_FAIL;
+        }
+    }
+
     res = httpd_resp_set_type( req, "image/jpeg" );
     if( res == ESP_OK ){
         res = httpd_resp_set_hdr( req, "Content-Disposition", "inline; filename=capture.jpg" );
     }
 
     if( res == ESP_OK ){
-        if( fb.Format() == PIXFORMAT_JPEG ){
+        if( derivative ){
+            SetFrameLength( req, derivative->Length, &headers );
+            res = httpd_resp_send( req, (const char *)derivative->Buffer, derivative->Length );
+        } else if( fb.Format() == PIXFORMAT_JPEG ){
+            SetFrameLength( req, fb.Length(), &headers );
             res = httpd_resp_send(req, (const char *)fb.Buffer(), fb.Length() );
         } else {
-            jpg_chunking_t jchunk = { req, 0 };
-            res = frame2jpg_cb( fb.RawPtr(), 80, JpgEncodeStream, &jchunk ) ? ESP_OK : ESP_FAIL;
-            httpd_resp_send_chunk( req, NULL, 0 );
+            ChunkedResponseWriter writer( req, sk_ChunkBufferSize );
+            res = frame2jpg_cb( fb.RawPtr(), 80, JpgEncodeStream, &writer ) ? ESP_OK : ESP_FAIL;
+            if( !writer.Finish() && res == ESP_OK ){
+                res = ESP_FAIL;
+            }
         }
     }
 
@@ -70,14 +218,252 @@ static esp_err_t CaptureGetHandler( httpd_req_t* req )
 
 static size_t JpgEncodeStream( void * arg, size_t index, const void* data, size_t len )
 {
-    jpg_chunking_t *j = (jpg_chunking_t *)arg;
-    if(!index){
-        j->len = 0;
-    }
-    if(httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK){
+    ChunkedResponseWriter* writer = reinterpret_cast<ChunkedResponseWriter*>(arg);
+    if( !writer->Write( data, len ) ){
         return 0;
     }
-    j->len += len;
     return len;
 }
 
+static esp_err_t CaptureHeadHandler( httpd_req_t* req )
+{
+    CaptureParams params;
+    if( !GetCaptureParams( req, &params ) ){
+        return httpd_resp_send_err( req, HTTPD_400_BAD_REQUEST, "Unknown size" );
+    }
+
+    // 撮影はせず、最後に取得したフレームの情報だけを返す
+    CameraFrameInfo info;
+    if( !CaptureCoordinator::Instance().LatestInfo( &info ) ){
+        httpd_resp_set_status( req, "404 Not Found" );
+        return httpd_resp_send( req, nullptr, 0 );
+    }
+
+    FrameHeaders headers;
+    SetFrameHeaders( req, info, params.Scale, &headers );
+    if( IsNotModified( req, headers.ETag ) ){
+        return SendNotModified( req );
+    }
+
+    // 縮小版の大きさは作るまで、JPEG 以外は送る時にエンコードするまで分からない
+    if( params.Scale == FrameScale::Full && info.Format == PIXFORMAT_JPEG ){
+        SetFrameLength( req, info.Length, &headers );
+    }
+
+    httpd_resp_set_type( req, "image/jpeg" );
+    return httpd_resp_send( req, nullptr, 0 );
+}
+
+static esp_err_t HistoryGetHandler( httpd_req_t* req )
+{
+    // /history/<n> の n は 0 が最新で、大きいほど古い。省略すると一覧を返す。
+    const char* index = req->uri + sizeof(sk_HistoryPrefix) - 1;
+    if( *index == '\0' || *index == '?' ){
+        return HistoryListHandler( req );
+    }
+
+    char* end = nullptr;
+    unsigned long age = strtoul( index, &end, 10 );
+    if( end == index || (*end != '\0' && *end != '?') ){
+        return httpd_resp_send_err( req, HTTPD_400_BAD_REQUEST, "Invalid index" );
+    }
+
+    HistoryFrame frame;
+    if( !FrameHistory::Instance().Get( age, &frame ) ){
+        return httpd_resp_send_404( req );
+    }
+
+    FrameHeaders headers;
+    SetFrameHeaders( req, frame.Info(), FrameScale::Full, &headers );
+    if( IsNotModified( req, headers.ETag ) ){
+        return SendNotModified( req );
+    }
+    SetFrameLength( req, frame.Length(), &headers );
+
+    // リングバッファから直接送る。frame を保持している間は上書きされない。
+    httpd_resp_set_type( req, "image/jpeg" );
+    return httpd_resp_send( req, (const char *)frame.Buffer(), frame.Length() );
+}
+
+static esp_err_t HistoryListHandler( httpd_req_t* req )
+{
+    CameraFrameInfo infos[sk_HistoryListMax];
+    size_t count = FrameHistory::Instance().GetInfo( infos, sk_HistoryListMax );
+
+    httpd_resp_set_type( req, "application/json" );
+    httpd_resp_set_hdr( req, "Cache-Control", "no-cache" );
+
+    ChunkedResponseWriter writer( req, sk_ChunkBufferSize );
+    char line[128];
+    writer.Write( "[", 1 );
+    for( size_t age = 0; age < count; ++age ){
+        const CameraFrameInfo& info = infos[age];
+        int n = snprintf( line, sizeof(line), "%s{\"age\":%u,\"sequence\":%u,\"timestamp\":%ld.%06ld,\"length\":%u}",
+                          (age > 0) ? "," : "", static_cast<unsigned>(age), static_cast<unsigned>(info.Sequence),
+                          static_cast<long>(info.Timestamp.tv_sec), static_cast<long>(info.Timestamp.tv_usec),
+                          static_cast<unsigned>(info.Length) );
+        writer.Write( line, n );
+    }
+    writer.Write( "]", 1 );
+
+    return writer.Finish() ? ESP_OK : ESP_FAIL;
+}
+
+static void FormatETag( const CameraFrameInfo& info, FrameScale scale, char* etag, size_t size )
+{
+    // 縮小版は別の表現なので、大きさも ETag に含める
+    if( scale == FrameScale::Full ){
+        snprintf( etag, size, "\"%08x-%u\"",
+                  static_cast<unsigned>(s_BootId), static_cast<unsigned>(info.Sequence) );
+    } else {
+        snprintf( etag, size, "\"%08x-%u-%s\"",
+                  static_cast<unsigned>(s_BootId), static_cast<unsigned>(info.Sequence), FrameScaleName( scale ) );
+    }
+}
+
+static void SetFrameHeaders( httpd_req_t* req, const CameraFrameInfo& info, FrameScale scale, FrameHeaders* headers )
+{
+    FormatETag( info, scale, headers->ETag, sizeof(headers->ETag) );
+
+    struct tm tm_info;
+    time_t sec = info.Timestamp.tv_sec;
+    gmtime_r( &sec, &tm_info );
+    strftime( headers->LastModified, sizeof(headers->LastModified), "%a, %d %b %Y %H:%M:%S GMT", &tm_info );
+
+    snprintf( headers->Sequence, sizeof(headers->Sequence), "%u", static_cast<unsigned>(info.Sequence) );
+    snprintf( headers->Timestamp, sizeof(headers->Timestamp), "%ld.%06ld",
+              static_cast<long>(info.Timestamp.tv_sec), static_cast<long>(info.Timestamp.tv_usec) );
+
+    httpd_resp_set_hdr( req, "ETag", headers->ETag );
+    httpd_resp_set_hdr( req, "Last-Modified", headers->LastModified );
+    httpd_resp_set_hdr( req, "Cache-Control", "no-cache" );
+    httpd_resp_set_hdr( req, "X-Frame-Sequence", headers->Sequence );
+    httpd_resp_set_hdr( req, "X-Frame-Timestamp", headers->Timestamp );
+}
+
+static void SetFrameLength( httpd_req_t* req, size_t length, FrameHeaders* headers )
+{
+    snprintf( headers->Length, sizeof(headers->Length), "%u", static_cast<unsigned>(length) );
+    httpd_resp_set_hdr( req, "X-Frame-Length", headers->Length );
+}
+
+static bool IsNotModified( httpd_req_t* req, const char* etag )
+{
+    char value[128];
+    size_t length = httpd_req_get_hdr_value_len( req, "If-None-Match" );
+    if( length == 0 || length >= sizeof(value) ){
+        return false;
+    }
+    if( httpd_req_get_hdr_value_str( req, "If-None-Match", value, sizeof(value) ) != ESP_OK ){
+        return false;
+    }
+
+    return strcmp( value, "*" ) == 0 || strstr( value, etag ) != nullptr;
+}
+
+static esp_err_t SendNotModified( httpd_req_t* req )
+{
+    httpd_resp_set_status( req, "304 Not Modified" );
+    return httpd_resp_send( req, nullptr, 0 );
+}
+
+static bool GetCaptureParams( httpd_req_t* req, CaptureParams* params )
+{
+    params->Conditional = httpd_req_get_hdr_value_len( req, "If-None-Match" ) > 0;
+    params->MaxAgeMs    = params->Conditional ? sk_ConditionalMaxAgeMs : sk_CaptureMaxAgeMs;
+    params->Scale       = FrameScale::Full;
+
+    char query[64];
+    if( httpd_req_get_url_query_str( req, query, sizeof(query) ) != ESP_OK ){
+        return true;
+    }
+
+    // ?max_age_ms= でフレームの鮮度を指定できる。大きくすれば撮影せずに最後のフレームを返す。
+    char value[12];
+    if( httpd_query_key_value( query, "max_age_ms", value, sizeof(value) ) == ESP_OK ){
+        params->MaxAgeMs = strtoul( value, nullptr, 10 );
+    }
+
+    // ?size=half|quarter|eighth で縮小版を返す
+    if( httpd_query_key_value( query, "size", value, sizeof(value) ) == ESP_OK ){
+        return ParseFrameScale( value, &params->Scale );
+    }
+
+    return true;
+}
+
+static esp_err_t MetricsGetHandler( httpd_req_t* req )
+{
+    httpd_resp_set_type( req, "text/plain; version=0.0.4" );
+    httpd_resp_set_hdr( req, "Cache-Control", "no-cache" );
+
+    ChunkedResponseWriter writer( req, sk_ChunkBufferSize );
+    Metrics::ExportPrometheus( WriteMetrics, &writer );
+
+    // 各モジュールが持っている回数もまとめて出す
+    CaptureCoordinator::Statistics capture = CaptureCoordinator::Instance().GetStatistics();
+    WriteCounter( &writer, "esp32cam_capture_grabs_total", capture.Captures );
+    WriteCounter( &writer, "esp32cam_capture_shared_total", capture.Shared );
+    WriteCounter( &writer, "esp32cam_capture_failures_total", capture.Failures );
+
+    DNSResolverCache::Statistics dns = DNSResolverCache::Instance().GetStatistics();
+    WriteCounter( &writer, "esp32cam_dns_cache_hits_total", dns.Hits );
+    WriteCounter( &writer, "esp32cam_dns_cache_misses_total", dns.Misses );
+    WriteCounter( &writer, "esp32cam_dns_stale_served_total", dns.StaleServed );
+
+    AWS_IoT_ClientWrapper::PublishStatistics publish = AWS_IoT_ClientWrapper::Instance().GetPublishStatistics();
+    WriteCounter( &writer, "esp32cam_mqtt_published_total", publish.Sent );
+    WriteCounter( &writer, "esp32cam_mqtt_publish_failures_total", publish.Failed );
+    WriteCounter( &writer, "esp32cam_mqtt_coalesced_total", publish.Coalesced );
+    WriteCounter( &writer, "esp32cam_mqtt_dropped_total", publish.Dropped );
+    WriteCounter( &writer, "esp32cam_mqtt_disconnects_total", publish.Disconnects );
+
+    FrameHistory::Statistics history = FrameHistory::Instance().GetStatistics();
+    WriteCounter( &writer, "esp32cam_history_recorded_total", history.Recorded );
+    WriteCounter( &writer, "esp32cam_history_dropped_total", history.Dropped );
+
+    return writer.Finish() ? ESP_OK : ESP_FAIL;
+}
+
+static bool WriteMetrics( void* arg, const char* data, size_t length )
+{
+    return reinterpret_cast<ChunkedResponseWriter*>(arg)->Write( data, length );
+}
+
+static void WriteCounter( ChunkedResponseWriter* writer, const char* name, uint32_t value )
+{
+    char line[128];
+    int n = snprintf( line, sizeof(line), "# TYPE %s counter\n%s %u\n", name, name, static_cast<unsigned>(value) );
+    if( n > 0 && static_cast<size_t>(n) < sizeof(line) ){
+        writer->Write( line, n );
+    }
+}
+
+static esp_err_t StreamGetHandler( httpd_req_t* req )
+{
+    MJPEGStreamer& streamer = MJPEGStreamer::Instance();
+    int sock = httpd_req_to_sockfd( req );
+
+    if( !streamer.AddClient( sock ) ){
+        ESP_LOGW( "CAMServer", "Too many stream clients." );
+        httpd_resp_set_status( req, "503 Service Unavailable" );
+        httpd_resp_send( req, nullptr, 0 );
+        return ESP_OK;
+    }
+
+    // レスポンスヘッダだけ送り、以降のフレームは配信タスクが同じソケットへ送る
+    const char* header = MJPEGStreamer::ResponseHeader();
+    if( httpd_send( req, header, strlen( header ) ) < 0 ){
+        streamer.RemoveClient( sock );
+        return ESP_FAIL;
+    }
+    streamer.ActivateClient( sock );
+
+    return ESP_OK;
+}
+
+static void SessionCloseHandler( httpd_handle_t server, int sockfd )
+{
+    MJPEGStreamer::Instance().RemoveClient( sockfd );
+    close( sockfd );
+}
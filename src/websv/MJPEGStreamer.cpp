@@ -0,0 +1,519 @@
+
+#include "MJPEGStreamer.hpp"
+#include "CaptureCoordinator.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+
+static const char sk_PartTrailer[] = "\r\n";
+static const size_t sk_PartTrailerLength = sizeof(sk_PartTrailer) - 1;
+static const int sk_EncodeQuality = 80;
+
+//
+// struct MJPEGStreamer::Frame implemantation
+//
+
+MJPEGStreamer::Frame::Frame( CameraFrameBuffer&& source )
+    : Source( std::move( source ) ),
+      Converted( nullptr ),
+      Data( nullptr ),
+      Length( 0 ),
+      PartHeaderLength( 0 ),
+      Sequence( 0 ),
+      RefCount( 1 )
+{}
+
+MJPEGStreamer::Frame::~Frame()
+{
+    if( Converted ){
+        free( Converted );
+    }
+}
+
+
+//
+// class MJPEGStreamer implemantation
+//
+
+MJPEGStreamer::MJPEGStreamer()
+    : m_Server( nullptr ),
+      m_Task( nullptr ),
+      m_Running( false ),
+      m_Clients(),
+      m_Latest( nullptr ),
+      m_Sequence( 0 )
+{
+    for( Client& client : m_Clients ){
+        client.Socket  = -1;
+        client.Sending = nullptr;
+    }
+    m_Mutex = xSemaphoreCreateMutex();
+}
+
+MJPEGStreamer::~MJPEGStreamer()
+{}
+
+MJPEGStreamer& MJPEGStreamer::Instance()
+{
+    static MJPEGStreamer s_Instance;
+    return s_Instance;
+}
+
+const char* MJPEGStreamer::ResponseHeader()
+{
+    static char s_Header[192] = {};
+    if( s_Header[0] == '\0' ){
+        snprintf( s_Header, sizeof(s_Header),
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: multipart/x-mixed-replace;boundary=%s\r\n"
+                  "Cache-Control: no-cache\r\n"
+                  "Access-Control-Allow-Origin: *\r\n\r\n", sk_Boundary );
+    }
+    return s_Header;
+}
+
+bool MJPEGStreamer::Start( httpd_handle_t server )
+{
+    if( m_Running || server == nullptr ){
+        return false;
+    }
+
+    m_Server  = server;
+    m_Running = true;
+    if( xTaskCreatePinnedToCore( StreamTask, "MJPEGStream", sk_TaskStackSize, this, sk_TaskPriority, &m_Task, sk_TaskCoreId ) != pdPASS ){
+        ESP_LOGE( sk_Tag, "Failed to create stream task." );
+        m_Running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void MJPEGStreamer::Stop()
+{
+    if( !m_Running ){
+        return;
+    }
+
+    // タスクは次のループで自分を削除する
+    m_Running = false;
+    xTaskNotifyGive( m_Task );
+}
+
+bool MJPEGStreamer::AddClient( int sock )
+{
+    if( !lock() ){
+        return false;
+    }
+
+    bool result = false;
+    for( Client& client : m_Clients ){
+        if( client.Socket < 0 ){
+            client.Socket        = sock;
+            client.Active        = false;
+            client.Closing       = false;
+            client.Sending       = nullptr;
+            client.Offset        = 0;
+            client.LastSequence  = 0;
+            client.SentFrames    = 0;
+            client.DroppedFrames = 0;
+            client.ConnectedAt   = xTaskGetTickCount();
+            result = true;
+            break;
+        }
+    }
+
+    unlock();
+    return result;
+}
+
+void MJPEGStreamer::ActivateClient( int sock )
+{
+    if( !lock() ){
+        return;
+    }
+
+    for( Client& client : m_Clients ){
+        if( client.Socket == sock ){
+            client.Active = true;
+            ESP_LOGI( sk_Tag, "Client fd=%d joined.", sock );
+        }
+    }
+
+    unlock();
+
+    if( m_Task ){
+        xTaskNotifyGive( m_Task );
+    }
+}
+
+void MJPEGStreamer::RemoveClient( int sock )
+{
+    if( !lock() ){
+        return;
+    }
+
+    for( Client& client : m_Clients ){
+        if( client.Socket == sock ){
+            if( client.Active ){
+                report( client );
+            }
+            release( client.Sending );
+            client.Sending = nullptr;
+            client.Socket  = -1;
+            client.Active  = false;
+        }
+    }
+
+    unlock();
+}
+
+size_t MJPEGStreamer::GetClientStatistics( ClientStatistics* stats, size_t max_count ) const
+{
+    if( !lock() ){
+        return 0;
+    }
+
+    size_t count = 0;
+    portTickType now = xTaskGetTickCount();
+    for( const Client& client : m_Clients ){
+        if( count >= max_count ){
+            break;
+        }
+        if( client.Socket < 0 || !client.Active ){
+            continue;
+        }
+
+        uint32_t elapsed_ms = (now - client.ConnectedAt) * portTICK_PERIOD_MS;
+        ClientStatistics& stat = stats[count++];
+        stat.Socket        = client.Socket;
+        stat.SentFrames    = client.SentFrames;
+        stat.DroppedFrames = client.DroppedFrames;
+        stat.FramesPerSec  = (elapsed_ms > 0) ? (client.SentFrames * 1000.0f / elapsed_ms) : 0.0f;
+    }
+
+    unlock();
+    return count;
+}
+
+void MJPEGStreamer::StreamTask( void* param )
+{
+    MJPEGStreamer* instance = reinterpret_cast<MJPEGStreamer*>(param);
+    instance->run();
+
+    instance->m_Task = nullptr;
+    vTaskDelete( nullptr );
+}
+
+void MJPEGStreamer::run()
+{
+    portTickType last_report = xTaskGetTickCount();
+
+    while( m_Running ){
+        bool active = false;
+        bool grab = false;
+        if( lock() ){
+            active = hasActiveClient();
+            grab   = active && canGrab();
+            if( m_Latest && (!active || (grab && m_Latest->RefCount == 1)) ){
+                // 全員が送り終えたフレームは、次を取得する前にカメラへ返しておく
+                release( m_Latest );
+                m_Latest = nullptr;
+            }
+            unlock();
+        }
+
+        if( !active ){
+            ulTaskNotifyTake( pdTRUE, sk_IdleWaitPeriodMs );
+            continue;
+        }
+
+        if( grab ){
+            Frame* frame = grabFrame();
+            if( frame == nullptr ){
+                vTaskDelay( 100 / portTICK_PERIOD_MS );
+                continue;
+            }
+            publish( frame );
+        }
+
+        pump( sk_PumpPeriodMs );
+
+        portTickType now = xTaskGetTickCount();
+        if( (now - last_report) >= sk_ReportPeriodMs && lock() ){
+            for( const Client& client : m_Clients ){
+                if( client.Socket >= 0 && client.Active ){
+                    report( client );
+                }
+            }
+            unlock();
+            last_report = now;
+        }
+    }
+
+    if( lock() ){
+        release( m_Latest );
+        m_Latest = nullptr;
+        unlock();
+    }
+}
+
+MJPEGStreamer::Frame* MJPEGStreamer::grabFrame()
+{
+    // 配信中のフレームは /capture 等の要求とも共有される
+    CameraFrameBuffer fb = CaptureCoordinator::Instance().Acquire( 0 );
+    if( !fb.IsValid() ){
+        ESP_LOGE( sk_Tag, "Camera capture failed." );
+        return nullptr;
+    }
+
+    Frame* frame = new (std::nothrow) Frame( std::move( fb ) );
+    if( frame == nullptr ){
+        return nullptr;
+    }
+
+    if( frame->Source.Format() == PIXFORMAT_JPEG ){
+        frame->Data   = frame->Source.Buffer();
+        frame->Length = frame->Source.Length();
+    }
+    else {
+        // 全クライアントで共有するので、エンコードは 1 度だけ
+        size_t length = 0;
+        if( !frame2jpg( frame->Source.RawPtr(), sk_EncodeQuality, &frame->Converted, &length ) ){
+            ESP_LOGE( sk_Tag, "JPEG compression failed." );
+            delete frame;
+            return nullptr;
+        }
+        frame->Source.Release();
+        frame->Data   = frame->Converted;
+        frame->Length = length;
+    }
+
+    frame->Sequence = ++m_Sequence;
+    int n = snprintf( frame->PartHeader, sizeof(frame->PartHeader),
+                      "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n",
+                      sk_Boundary, static_cast<unsigned>(frame->Length) );
+    frame->PartHeaderLength = static_cast<size_t>(n);
+
+    return frame;
+}
+
+bool MJPEGStreamer::canGrab() const
+{
+    // 取得中を含めて配信タスクが保持するフレームを 2 枚までにして、カメラのバッファを使い切らないようにする。
+    // 遅いクライアントが古いフレームを送っている間でも、他のクライアントが最新を送り終えていれば次を取得できる。
+    const Frame* referenced = nullptr;
+    for( const Client& client : m_Clients ){
+        if( client.Socket < 0 || client.Sending == nullptr ){
+            continue;
+        }
+        if( referenced != nullptr && referenced != client.Sending ){
+            return false;
+        }
+        referenced = client.Sending;
+    }
+    return true;
+}
+
+bool MJPEGStreamer::hasActiveClient() const
+{
+    for( const Client& client : m_Clients ){
+        if( client.Socket >= 0 && client.Active && !client.Closing ){
+            return true;
+        }
+    }
+    return false;
+}
+
+void MJPEGStreamer::publish( Frame* frame )
+{
+    if( !lock() ){
+        release( frame );
+        return;
+    }
+
+    release( m_Latest );
+    m_Latest = frame;
+
+    for( Client& client : m_Clients ){
+        if( client.Socket >= 0 && client.Active && !client.Closing && client.Sending == nullptr ){
+            startFrame( client, frame );
+        }
+    }
+
+    unlock();
+}
+
+void MJPEGStreamer::pump( portTickType period )
+{
+    portTickType start = xTaskGetTickCount();
+
+    while( m_Running ){
+        fd_set write_fds;
+        FD_ZERO( &write_fds );
+        int max_fd = -1;
+
+        bool idle = false;
+        if( !lock() ){
+            return;
+        }
+        for( const Client& client : m_Clients ){
+            if( client.Socket < 0 || !client.Active || client.Closing ){
+                continue;
+            }
+            if( client.Sending == nullptr ){
+                idle = true;
+            }
+            else {
+                FD_SET( client.Socket, &write_fds );
+                if( client.Socket > max_fd ){
+                    max_fd = client.Socket;
+                }
+            }
+        }
+        bool grab = idle && canGrab();
+        unlock();
+
+        // 送り終えたクライアントがいれば、遅いクライアントを待たずに次のフレームへ
+        if( max_fd < 0 || grab ){
+            return;
+        }
+
+        portTickType elapsed = xTaskGetTickCount() - start;
+        if( elapsed >= period ){
+            return;
+        }
+        uint32_t remain_ms = (period - elapsed) * portTICK_PERIOD_MS;
+        struct timeval timeout;
+        timeout.tv_sec  = remain_ms / 1000;
+        timeout.tv_usec = (remain_ms % 1000) * 1000;
+
+        int ready = select( max_fd + 1, nullptr, &write_fds, nullptr, &timeout );
+        if( ready <= 0 ){
+            // タイムアウトか、待っている間に閉じられたソケットがある
+            continue;
+        }
+
+        if( !lock() ){
+            return;
+        }
+        for( Client& client : m_Clients ){
+            if( client.Socket >= 0 && client.Sending != nullptr && !client.Closing && FD_ISSET( client.Socket, &write_fds ) ){
+                sendSome( client );
+            }
+        }
+        unlock();
+    }
+}
+
+void MJPEGStreamer::sendSome( Client& client )
+{
+    const Frame* frame = client.Sending;
+
+    const uint8_t* parts[3] = {
+        reinterpret_cast<const uint8_t*>(frame->PartHeader), frame->Data, reinterpret_cast<const uint8_t*>(sk_PartTrailer)
+    };
+    const size_t lengths[3] = { frame->PartHeaderLength, frame->Length, sk_PartTrailerLength };
+
+    struct iovec iov[3];
+    int iovcnt = 0;
+    size_t skip = client.Offset;
+    for( int i = 0; i < 3; ++i ){
+        if( skip >= lengths[i] ){
+            skip -= lengths[i];
+            continue;
+        }
+        iov[iovcnt].iov_base = const_cast<uint8_t*>(parts[i] + skip);
+        iov[iovcnt].iov_len  = lengths[i] - skip;
+        ++iovcnt;
+        skip = 0;
+    }
+
+    struct msghdr msg = {};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t n = sendmsg( client.Socket, &msg, MSG_DONTWAIT );
+    if( n < 0 ){
+        if( errno == EAGAIN || errno == EWOULDBLOCK ){
+            return;
+        }
+
+        // 切断は httpd に任せ、close_fn から RemoveClient() される
+        ESP_LOGI( sk_Tag, "Client fd=%d send failed errno=%d", client.Socket, errno );
+        client.Closing = true;
+        release( client.Sending );
+        client.Sending = nullptr;
+        httpd_sess_trigger_close( m_Server, client.Socket );
+        return;
+    }
+
+    client.Offset += static_cast<size_t>(n);
+    if( client.Offset >= frame->PartHeaderLength + frame->Length + sk_PartTrailerLength ){
+        finishFrame( client );
+    }
+}
+
+void MJPEGStreamer::finishFrame( Client& client )
+{
+    ++client.SentFrames;
+    client.LastSequence = client.Sending->Sequence;
+    release( client.Sending );
+    client.Sending = nullptr;
+
+    // 送っている間に新しいフレームが来ていれば、間を飛ばして最新を送る
+    if( m_Latest != nullptr && m_Latest->Sequence > client.LastSequence ){
+        startFrame( client, m_Latest );
+    }
+}
+
+void MJPEGStreamer::startFrame( Client& client, Frame* frame )
+{
+    if( client.LastSequence != 0 && frame->Sequence > client.LastSequence + 1 ){
+        client.DroppedFrames += frame->Sequence - client.LastSequence - 1;
+    }
+
+    retain( frame );
+    client.Sending = frame;
+    client.Offset  = 0;
+}
+
+void MJPEGStreamer::report( const Client& client ) const
+{
+    uint32_t elapsed_ms = (xTaskGetTickCount() - client.ConnectedAt) * portTICK_PERIOD_MS;
+    float fps = (elapsed_ms > 0) ? (client.SentFrames * 1000.0f / elapsed_ms) : 0.0f;
+    ESP_LOGI( sk_Tag, "Client fd=%d: sent=%u dropped=%u (%.1f fps)",
+              client.Socket, static_cast<unsigned>(client.SentFrames), static_cast<unsigned>(client.DroppedFrames), fps );
+}
+
+void MJPEGStreamer::retain( Frame* frame )
+{
+    if( frame ){
+        ++frame->RefCount;
+    }
+}
+
+void MJPEGStreamer::release( Frame* frame )
+{
+    if( frame && --frame->RefCount == 0 ){
+        delete frame;
+    }
+}
+
+bool MJPEGStreamer::lock() const
+{
+    return xSemaphoreTake( m_Mutex, ( portTickType )sk_MutexTakeWaitPeriodMs );
+}
+
+void MJPEGStreamer::unlock() const
+{
+    if( xSemaphoreGive( m_Mutex ) != pdTRUE ){
+        // IT MUST BE BUG
+        abort();
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef     MJPEG_STREAMER_HPP_INCLUDED
+#define     MJPEG_STREAMER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_http_server.h"
+
+#include "Camera.hpp"
+
+//
+// /stream の multipart/x-mixed-replace 配信
+//
+// 1 つの配信タスクがフレームを取得し、1 度だけ JPEG にしたものを全クライアントへ送る。
+// 送信はノンブロッキングで行い、送り終わっていないクライアントは次のフレームを飛ばして最新に追いつく。
+// クライアントとフレームの参照カウントは m_Mutex で保護する。
+//
+class MJPEGStreamer
+{
+public:
+
+    struct ClientStatistics
+    {
+        int      Socket;
+        uint32_t SentFrames;
+        uint32_t DroppedFrames;
+        float    FramesPerSec;
+    };
+
+    static inline constexpr char sk_Tag[] = "MJPEG";
+    static inline constexpr char sk_Boundary[] = "123456789000000000000987654321";
+
+public:
+
+    // DO NOT COPY
+    MJPEGStreamer( const MJPEGStreamer& ) = delete;
+    MJPEGStreamer& operator=( const MJPEGStreamer& ) = delete;
+
+    static MJPEGStreamer& Instance();
+
+    bool Start( httpd_handle_t server );
+    void Stop();
+
+    // ハンドラからレスポンスヘッダを送る前に登録し、送れたら Activate する
+    bool AddClient( int sock );
+    void ActivateClient( int sock );
+    void RemoveClient( int sock );
+
+    size_t GetClientStatistics( ClientStatistics* stats, size_t max_count ) const;
+
+    static const char* ResponseHeader();
+
+private:
+
+    MJPEGStreamer();
+    ~MJPEGStreamer() noexcept;
+
+    static const int    sk_MaxClients = 4;
+    static const size_t sk_PartHeaderSize = 128;
+    static const uint32_t sk_TaskStackSize = 4096;
+    static const UBaseType_t sk_TaskPriority = tskIDLE_PRIORITY + 4;
+    static const BaseType_t sk_TaskCoreId = 1;
+    static const portTickType sk_PumpPeriodMs = (50 / portTICK_PERIOD_MS);
+    static const portTickType sk_IdleWaitPeriodMs = (1000 / portTICK_PERIOD_MS);
+    static const portTickType sk_ReportPeriodMs = (10000 / portTICK_PERIOD_MS);
+    static const portTickType sk_MutexTakeWaitPeriodMs = (100 / portTICK_PERIOD_MS);
+
+    struct Frame
+    {
+        explicit Frame( CameraFrameBuffer&& source );
+        ~Frame() noexcept;
+
+        CameraFrameBuffer Source;           // JPEG の場合はそのまま送る
+        uint8_t*          Converted;        // JPEG 以外は 1 度だけエンコードした結果
+        const uint8_t*    Data;
+        size_t            Length;
+        char              PartHeader[sk_PartHeaderSize];
+        size_t            PartHeaderLength;
+        uint32_t          Sequence;
+        uint32_t          RefCount;
+    };
+
+    struct Client
+    {
+        int         Socket;                 // -1 なら空き
+        bool        Active;
+        bool        Closing;
+        Frame*      Sending;
+        size_t      Offset;
+        uint32_t    LastSequence;
+        uint32_t    SentFrames;
+        uint32_t    DroppedFrames;
+        portTickType ConnectedAt;
+    };
+
+    static void StreamTask( void* param );
+    void run();
+
+    Frame* grabFrame();
+    bool canGrab() const;
+    bool hasActiveClient() const;
+    void publish( Frame* frame );
+    void pump( portTickType period );
+    void sendSome( Client& client );
+    void finishFrame( Client& client );
+    void startFrame( Client& client, Frame* frame );
+    void report( const Client& client ) const;
+
+    static void retain( Frame* frame );
+    static void release( Frame* frame );
+
+    bool lock() const;
+    void unlock() const;
+
+    httpd_handle_t   m_Server;
+    TaskHandle_t     m_Task;
+    volatile bool    m_Running;
+    Client           m_Clients[sk_MaxClients];
+    Frame*           m_Latest;
+    uint32_t         m_Sequence;
+    xSemaphoreHandle m_Mutex;
+};
+
+#endif    // MJPEG_STREAMER_HPP_INCLUDED
@@ -0,0 +1,55 @@
+#include "ButtonDebouncer.hpp"
+
+ButtonDebouncer::ButtonDebouncer( bool active_level )
+    : m_ActiveLevel( active_level ),
+      m_Pressed( false ),
+      m_Locked( false )
+{}
+
+bool ButtonDebouncer::OnEdge( bool level, bool* pressed )
+{
+    *pressed = false;
+    if( m_Locked ){
+        return false;
+    }
+
+    // 跳ね返りの最初のエッジで判定するので、押してから通知までにタイマーを待たない
+    update( level, pressed );
+    m_Locked = true;
+    return true;
+}
+
+bool ButtonDebouncer::OnSettled( bool level, bool* pressed )
+{
+    *pressed = false;
+    m_Locked = false;
+
+    // ロックアウト中にエッジを取りこぼしていれば、ここで追いつく
+    if( update( level, pressed ) ){
+        m_Locked = true;
+        return true;
+    }
+    return false;
+}
+
+bool ButtonDebouncer::IsPressed() const
+{
+    return m_Pressed;
+}
+
+bool ButtonDebouncer::IsLocked() const
+{
+    return m_Locked;
+}
+
+bool ButtonDebouncer::update( bool level, bool* pressed )
+{
+    bool active = (level == m_ActiveLevel);
+    if( active == m_Pressed ){
+        return false;
+    }
+
+    m_Pressed = active;
+    *pressed  = active;
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef     BUTTON_DEBOUNCER_HPP_INCLUDED
+#define     BUTTON_DEBOUNCER_HPP_INCLUDED
+
+//
+// ボタンのチャタリング除去
+//
+// 最初のエッジで即座に判定し、その後はロックアウト期間が終わるまでエッジを無視する。
+// 期間が終わった時点のレベルで状態を確定し、その間に変わっていれば改めてロックアウトする。
+// GPIO やタイマーには依存しないので、呼び出し側がレベルを与えればホストでも動かせる。
+//
+class ButtonDebouncer
+{
+public:
+
+    explicit ButtonDebouncer( bool active_level );
+
+    // エッジ割り込みから呼ぶ。true を返したらロックアウトを開始する。
+    // 押された場合は *pressed が true になる。
+    bool OnEdge( bool level, bool* pressed );
+
+    // ロックアウト期間の終了時に呼ぶ。true を返したら、もう 1 度ロックアウトを開始する。
+    bool OnSettled( bool level, bool* pressed );
+
+    bool IsPressed() const;
+    bool IsLocked() const;
+
+private:
+
+    bool update( bool level, bool* pressed );
+
+    bool m_ActiveLevel;
+    bool m_Pressed;
+    bool m_Locked;
+};
+
+#endif    // BUTTON_DEBOUNCER_HPP_INCLUDED
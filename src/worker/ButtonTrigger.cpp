@@ -0,0 +1,114 @@
+#include "ButtonTrigger.hpp"
+#include "TriggerQueue.hpp"
+
+#include "esp_log.h"
+
+ButtonTrigger::ButtonTrigger()
+    : m_Config(),
+      m_Debouncer( true ),
+      m_Timer( nullptr ),
+      m_Lock( portMUX_INITIALIZER_UNLOCKED )
+{}
+
+ButtonTrigger::~ButtonTrigger()
+{}
+
+ButtonTrigger& ButtonTrigger::Instance()
+{
+    static ButtonTrigger s_Instance;
+    return s_Instance;
+}
+
+bool ButtonTrigger::Start( const Config& config )
+{
+    if( m_Timer ){
+        return false;
+    }
+
+    m_Config    = config;
+    m_Debouncer = ButtonDebouncer( config.ActiveLevel );
+
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback        = SettleTimer;
+    timer_args.arg             = this;
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name            = "ButtonSettle";
+    if( esp_timer_create( &timer_args, &m_Timer ) != ESP_OK ){
+        ESP_LOGE( sk_Tag, "Failed to create debounce timer." );
+        return false;
+    }
+
+    gpio_config_t io_conf;
+    //interrupt on both edges
+    io_conf.intr_type = GPIO_INTR_ANYEDGE;
+    //set as input mode
+    io_conf.mode = GPIO_MODE_INPUT;
+    //bit mask of the pins that you want to set
+    io_conf.pin_bit_mask = (1ULL << config.Pin);
+    //disable pull-down mode
+    io_conf.pull_down_en = (gpio_pulldown_t)(0);
+    //disable pull-up mode
+    io_conf.pull_up_en = (gpio_pullup_t)(0);
+    //configure GPIO with the given settings
+    gpio_config(&io_conf);
+
+    // 他で登録済みの場合は ESP_ERR_INVALID_STATE が返る
+    esp_err_t err = gpio_install_isr_service( 0 );
+    if( err != ESP_OK && err != ESP_ERR_INVALID_STATE ){
+        ESP_LOGE( sk_Tag, "Failed to install GPIO ISR service. (%s)", esp_err_to_name( err ) );
+        return false;
+    }
+    if( gpio_isr_handler_add( config.Pin, EdgeISR, this ) != ESP_OK ){
+        ESP_LOGE( sk_Tag, "Failed to add GPIO ISR handler." );
+        return false;
+    }
+
+    return true;
+}
+
+void ButtonTrigger::EdgeISR( void* arg )
+{
+    ButtonTrigger* instance = reinterpret_cast<ButtonTrigger*>(arg);
+    bool level = gpio_get_level( instance->m_Config.Pin ) != 0;
+
+    bool pressed = false;
+    portENTER_CRITICAL_ISR( &instance->m_Lock );
+    bool lock = instance->m_Debouncer.OnEdge( level, &pressed );
+    portEXIT_CRITICAL_ISR( &instance->m_Lock );
+
+    if( lock ){
+        // 跳ね返りの間は割り込みを止めておき、タイマーで解除する
+        gpio_intr_disable( instance->m_Config.Pin );
+        esp_timer_start_once( instance->m_Timer, instance->m_Config.DebounceMs * 1000 );
+    }
+
+    if( pressed ){
+        BaseType_t woken = pdFALSE;
+        TriggerQueue::Instance().PostFromISR( TriggerQueue::Source::Button, &woken );
+        if( woken == pdTRUE ){
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+void ButtonTrigger::SettleTimer( void* arg )
+{
+    ButtonTrigger* instance = reinterpret_cast<ButtonTrigger*>(arg);
+    bool level = gpio_get_level( instance->m_Config.Pin ) != 0;
+
+    bool pressed = false;
+    portENTER_CRITICAL( &instance->m_Lock );
+    bool relock = instance->m_Debouncer.OnSettled( level, &pressed );
+    portEXIT_CRITICAL( &instance->m_Lock );
+
+    if( pressed ){
+        TriggerQueue::Instance().Post( TriggerQueue::Source::Button );
+    }
+
+    if( relock ){
+        esp_timer_start_once( instance->m_Timer, instance->m_Config.DebounceMs * 1000 );
+    }
+    else {
+        gpio_intr_enable( instance->m_Config.Pin );
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef     BUTTON_TRIGGER_HPP_INCLUDED
+#define     BUTTON_TRIGGER_HPP_INCLUDED
+
+#include <cstdint>
+
+#include "freertos/FreeRTOS.h"
+
+#include "driver/gpio.h"
+#include "esp_timer.h"
+
+#include "ButtonDebouncer.hpp"
+
+//
+// ボタンの割り込みから TriggerQueue へ積む
+//
+// エッジ割り込みで即座に判定し、ロックアウトの間は割り込みを止めて esp_timer で解除する。
+// 押されていない間は割り込みもタイマーも動かないので、定期的な起床は無い。
+//
+class ButtonTrigger
+{
+public:
+
+    struct Config
+    {
+        gpio_num_t Pin;
+        bool       ActiveLevel;             // 押された時のレベル
+        uint32_t   DebounceMs;
+    };
+
+    static inline constexpr char sk_Tag[] = "Button";
+
+public:
+
+    // DO NOT COPY
+    ButtonTrigger( const ButtonTrigger& ) = delete;
+    ButtonTrigger& operator=( const ButtonTrigger& ) = delete;
+
+    static ButtonTrigger& Instance();
+
+    bool Start( const Config& config );
+
+private:
+
+    ButtonTrigger();
+    ~ButtonTrigger() noexcept;
+
+    static void EdgeISR( void* arg );
+    static void SettleTimer( void* arg );
+
+    Config             m_Config;
+    ButtonDebouncer    m_Debouncer;
+    esp_timer_handle_t m_Timer;
+    portMUX_TYPE       m_Lock;
+};
+
+#endif    // BUTTON_TRIGGER_HPP_INCLUDED
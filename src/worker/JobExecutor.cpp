@@ -0,0 +1,111 @@
+
+#include "JobExecutor.hpp"
+
+#include <cstdio>
+
+#include "esp_log.h"
+
+JobExecutor::JobExecutor()
+    : m_Initialized( false ),
+      m_Queues(),
+      m_JobCount( nullptr )
+{}
+
+JobExecutor::~JobExecutor()
+{}
+
+JobExecutor& JobExecutor::Instance()
+{
+    static JobExecutor s_Instance;
+    return s_Instance;
+}
+
+bool JobExecutor::Initialize( const Config& config )
+{
+    JobExecutor& instance = JobExecutor::Instance();
+
+    if( instance.m_Initialized ){
+        return false;
+    }
+    if( config.WorkerCount == 0 || config.QueueDepth == 0 ){
+        return false;
+    }
+
+    for( int i = 0; i < sk_PriorityCount; ++i ){
+        instance.m_Queues[i] = xQueueCreate( config.QueueDepth, sizeof(Job) );
+        if( instance.m_Queues[i] == nullptr ){
+            ESP_LOGE( sk_Tag, "Failed to create job queue." );
+            return false;
+        }
+    }
+    instance.m_JobCount = xSemaphoreCreateCounting( config.QueueDepth * sk_PriorityCount, 0 );
+    if( instance.m_JobCount == nullptr ){
+        ESP_LOGE( sk_Tag, "Failed to create job semaphore." );
+        return false;
+    }
+
+    for( uint32_t i = 0; i < config.WorkerCount; ++i ){
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf( name, sizeof(name), "JobWorker%u", static_cast<unsigned>(i) );
+
+        if( xTaskCreatePinnedToCore( WorkerTask, name, config.StackSize, &instance, config.TaskPriority, nullptr, config.CoreId ) != pdPASS ){
+            ESP_LOGE( sk_Tag, "Failed to create worker task %u.", static_cast<unsigned>(i) );
+            return false;
+        }
+    }
+
+    instance.m_Initialized = true;
+    return true;
+}
+
+bool JobExecutor::Submit( const Job& job, Priority priority )
+{
+    if( !m_Initialized || job.Function == nullptr ){
+        return false;
+    }
+
+    int index = static_cast<int>(priority);
+    if( xQueueSend( m_Queues[index], &job, 0 ) != pdTRUE ){
+        ESP_LOGW( sk_Tag, "Job queue is full. priority=%d", index );
+        return false;
+    }
+    xSemaphoreGive( m_JobCount );
+
+    return true;
+}
+
+uint32_t JobExecutor::PendingJobCount() const
+{
+    if( !m_Initialized ){
+        return 0;
+    }
+
+    return uxSemaphoreGetCount( m_JobCount );
+}
+
+void JobExecutor::WorkerTask( void* param )
+{
+    JobExecutor* instance = reinterpret_cast<JobExecutor*>(param);
+    Job job;
+
+    while( 1 ){
+        if( xSemaphoreTake( instance->m_JobCount, portMAX_DELAY ) != pdTRUE ){
+            continue;
+        }
+        if( instance->takeJob( &job ) ){
+            job.Function( job.Argument );
+        }
+    }
+}
+
+bool JobExecutor::takeJob( Job* job )
+{
+    // 高い優先度のキューから取り出す
+    for( int i = 0; i < sk_PriorityCount; ++i ){
+        if( xQueueReceive( m_Queues[i], job, 0 ) == pdTRUE ){
+            return true;
+        }
+    }
+
+    return false;
+}
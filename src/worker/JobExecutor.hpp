@@ -0,0 +1,73 @@
+#ifndef     JOB_EXECUTOR_HPP_INCLUDED
+#define     JOB_EXECUTOR_HPP_INCLUDED
+
+#include <cstdint>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+//
+// 時間のかかる処理を MQTT タスク等から切り離して実行するワーカータスク群
+//
+// ジョブは優先度毎の固定長キューに積まれ、高い優先度のキューから順に取り出される。
+// ジョブの引数の所有権はジョブ関数に移る。Submit() が失敗した場合は呼び出し側で解放すること。
+//
+class JobExecutor
+{
+public:
+
+    enum class Priority
+    {
+        High = 0,
+        Normal,
+        Low,
+    };
+
+    using JobFunction = void (*)( void* arg );
+    struct Job
+    {
+        JobFunction Function;
+        void*       Argument;
+    };
+
+    struct Config
+    {
+        uint32_t    WorkerCount;
+        BaseType_t  CoreId;             // tskNO_AFFINITY で固定しない
+        uint32_t    StackSize;
+        UBaseType_t TaskPriority;
+        uint32_t    QueueDepth;         // 優先度毎のキュー長
+    };
+
+    static inline constexpr char sk_Tag[] = "JobExecutor";
+
+public:
+
+    // DO NOT COPY
+    JobExecutor( const JobExecutor& ) = delete;
+    JobExecutor& operator=( const JobExecutor& ) = delete;
+
+    static JobExecutor& Instance();
+    static bool Initialize( const Config& config );
+
+    bool Submit( const Job& job, Priority priority = Priority::Normal );
+    uint32_t PendingJobCount() const;
+
+private:
+
+    JobExecutor();
+    ~JobExecutor() noexcept;
+
+    static constexpr int sk_PriorityCount = 3;
+
+    static void WorkerTask( void* param );
+    bool takeJob( Job* job );
+
+    bool             m_Initialized;
+    QueueHandle_t    m_Queues[sk_PriorityCount];
+    xSemaphoreHandle m_JobCount;
+};
+
+#endif    // JOB_EXECUTOR_HPP_INCLUDED
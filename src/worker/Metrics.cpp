@@ -0,0 +1,202 @@
+#include "Metrics.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    const char* const sk_StageNames[] = {
+        "camera_grab",
+        "dns_lookup",
+        "tcp_connect",
+        "upload_send",
+        "upload_response",
+        "mqtt_yield",
+        "mqtt_publish",
+    };
+    static_assert( sizeof(sk_StageNames) / sizeof(sk_StageNames[0]) == static_cast<size_t>(MetricStage::Count), "stage names mismatch" );
+
+    // MQTT のペイロードに収めるための短い名前
+    const char* const sk_StageShortNames[] = {
+        "grab", "dns", "conn", "send", "resp", "yield", "pub",
+    };
+    static_assert( sizeof(sk_StageShortNames) / sizeof(sk_StageShortNames[0]) == static_cast<size_t>(MetricStage::Count), "stage names mismatch" );
+
+    const size_t sk_LineSize = 128;
+
+    class PrometheusFormatter
+    {
+    public:
+
+        PrometheusFormatter( Metrics::ExportWriter writer, void* arg )
+            : m_Writer( writer ),
+              m_Arg( arg ),
+              m_Result( true )
+        {}
+
+        void Text( const char* text )
+        {
+            if( m_Result ){
+                m_Result = m_Writer( m_Arg, text, strlen( text ) );
+            }
+        }
+
+        template <typename... Args>
+        void Line( const char* format, Args... args )
+        {
+            if( !m_Result ){
+                return;
+            }
+            char line[sk_LineSize];
+            int length = snprintf( line, sizeof(line), format, args... );
+            if( length < 0 || static_cast<size_t>(length) >= sizeof(line) ){
+                m_Result = false;
+                return;
+            }
+            m_Result = m_Writer( m_Arg, line, static_cast<size_t>(length) );
+        }
+
+        bool Result() const
+        {
+            return m_Result;
+        }
+
+    private:
+
+        Metrics::ExportWriter m_Writer;
+        void*                 m_Arg;
+        bool                  m_Result;
+    };
+}
+
+//
+// class LatencyHistogram implemantation
+//
+
+LatencyHistogram::LatencyHistogram()
+    : m_SumLow( 0 ),
+      m_SumHigh( 0 ),
+      m_Failures( 0 )
+{
+    for( size_t i = 0; i < sk_BucketCount; ++i ){
+        m_Buckets[i].store( 0, std::memory_order_relaxed );
+    }
+}
+
+void LatencyHistogram::Read( Snapshot* snapshot ) const
+{
+    // 記録中に読むと各値の間で数件ずれることがあるが、監視用なので許容する
+    snapshot->Count = 0;
+    for( size_t i = 0; i < sk_BucketCount; ++i ){
+        snapshot->Buckets[i] = m_Buckets[i].load( std::memory_order_relaxed );
+        snapshot->Count += snapshot->Buckets[i];
+    }
+
+    uint32_t high = m_SumHigh.load( std::memory_order_relaxed );
+    uint32_t low  = m_SumLow.load( std::memory_order_relaxed );
+    snapshot->SumUs    = (static_cast<uint64_t>(high) << 32) | low;
+    snapshot->Failures = m_Failures.load( std::memory_order_relaxed );
+}
+
+uint32_t LatencyHistogram::BucketUpperBoundUs( size_t index )
+{
+    if( index >= sk_BucketCount - 1 ){
+        return UINT32_MAX;
+    }
+    return 1u << (sk_FirstBucketShift + index);
+}
+
+uint32_t LatencyHistogram::Percentile( const Snapshot& snapshot, uint32_t permille )
+{
+    if( snapshot.Count == 0 ){
+        return 0;
+    }
+
+    uint64_t target = (static_cast<uint64_t>(snapshot.Count) * permille + 999) / 1000;
+    uint64_t cumulative = 0;
+    for( size_t i = 0; i < sk_BucketCount; ++i ){
+        cumulative += snapshot.Buckets[i];
+        if( cumulative >= target ){
+            return BucketUpperBoundUs( i );
+        }
+    }
+    return UINT32_MAX;
+}
+
+
+//
+// class Metrics implemantation
+//
+
+LatencyHistogram Metrics::s_Histograms[static_cast<size_t>(MetricStage::Count)];
+
+LatencyHistogram& Metrics::Stage( MetricStage stage )
+{
+    return s_Histograms[static_cast<size_t>(stage)];
+}
+
+const char* Metrics::StageName( MetricStage stage )
+{
+    size_t index = static_cast<size_t>(stage);
+    return (index < static_cast<size_t>(MetricStage::Count)) ? sk_StageNames[index] : "unknown";
+}
+
+bool Metrics::ExportPrometheus( ExportWriter writer, void* arg )
+{
+    PrometheusFormatter out( writer, arg );
+    const size_t stage_count = static_cast<size_t>(MetricStage::Count);
+
+    out.Text( "# HELP esp32cam_stage_latency_seconds Latency of each processing stage.\n" );
+    out.Text( "# TYPE esp32cam_stage_latency_seconds histogram\n" );
+    for( size_t s = 0; s < stage_count; ++s ){
+        LatencyHistogram::Snapshot snapshot;
+        s_Histograms[s].Read( &snapshot );
+
+        // Prometheus のバケットは累積
+        uint32_t cumulative = 0;
+        for( size_t i = 0; i < LatencyHistogram::sk_BucketCount - 1; ++i ){
+            cumulative += snapshot.Buckets[i];
+            uint32_t bound = LatencyHistogram::BucketUpperBoundUs( i );
+            out.Line( "esp32cam_stage_latency_seconds_bucket{stage=\"%s\",le=\"%u.%06u\"} %u\n",
+                      sk_StageNames[s], static_cast<unsigned>(bound / 1000000), static_cast<unsigned>(bound % 1000000),
+                      static_cast<unsigned>(cumulative) );
+        }
+        out.Line( "esp32cam_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n",
+                  sk_StageNames[s], static_cast<unsigned>(snapshot.Count) );
+        out.Line( "esp32cam_stage_latency_seconds_sum{stage=\"%s\"} %llu.%06u\n",
+                  sk_StageNames[s], static_cast<unsigned long long>(snapshot.SumUs / 1000000),
+                  static_cast<unsigned>(snapshot.SumUs % 1000000) );
+        out.Line( "esp32cam_stage_latency_seconds_count{stage=\"%s\"} %u\n",
+                  sk_StageNames[s], static_cast<unsigned>(snapshot.Count) );
+    }
+
+    out.Text( "# HELP esp32cam_stage_failures_total Failed operations of each processing stage.\n" );
+    out.Text( "# TYPE esp32cam_stage_failures_total counter\n" );
+    for( size_t s = 0; s < stage_count; ++s ){
+        LatencyHistogram::Snapshot snapshot;
+        s_Histograms[s].Read( &snapshot );
+        out.Line( "esp32cam_stage_failures_total{stage=\"%s\"} %u\n",
+                  sk_StageNames[s], static_cast<unsigned>(snapshot.Failures) );
+    }
+
+    return out.Result();
+}
+
+void Metrics::WriteSummary( TelemetryWriter* writer )
+{
+    for( size_t s = 0; s < static_cast<size_t>(MetricStage::Count); ++s ){
+        LatencyHistogram::Snapshot snapshot;
+        s_Histograms[s].Read( &snapshot );
+        uint32_t p90 = LatencyHistogram::Percentile( snapshot, 900 );
+        if( p90 == UINT32_MAX ){
+            // 上限なしのバケットは、最後の有限の上限で代用する
+            p90 = LatencyHistogram::BucketUpperBoundUs( LatencyHistogram::sk_BucketCount - 2 );
+        }
+
+        writer->Key( sk_StageShortNames[s] );
+        writer->BeginArray();
+        writer->Value( snapshot.Count );
+        writer->Value( p90 );
+        writer->EndArray();
+    }
+}
@@ -0,0 +1,159 @@
+#ifndef     METRICS_HPP_INCLUDED
+#define     METRICS_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "esp_timer.h"
+
+#include "TelemetryWriter.hpp"
+
+//
+// 処理段階ごとの所要時間
+//
+enum class MetricStage : uint8_t
+{
+    CameraGrab = 0,         // センサーからのフレーム取得
+    DNSLookup,              // getaddrinfo()
+    TCPConnect,             // アップロード先への connect()
+    UploadSend,             // リクエストとボディの送信
+    UploadResponse,         // レスポンスの受信
+    MQTTYield,              // aws_iot_mqtt_yield()
+    MQTTPublish,            // aws_iot_mqtt_publish()
+    Count
+};
+
+//
+// 対数間隔の固定バケットによるヒストグラム
+//
+// バケットの上限は 64us から 2 倍ずつで、最後は上限なし。
+// 記録はアトミック加算だけで、ロックも確保もしないので、どのタスクからでも呼べる。
+//
+class LatencyHistogram
+{
+public:
+
+    static const size_t   sk_BucketCount = 20;
+    static const uint32_t sk_FirstBucketShift = 6;          // 2^6 = 64us
+
+    struct Snapshot
+    {
+        uint32_t Buckets[sk_BucketCount];       // 累積していない個数
+        uint32_t Count;
+        uint64_t SumUs;
+        uint32_t Failures;
+    };
+
+public:
+
+    LatencyHistogram();
+
+    // DO NOT COPY
+    LatencyHistogram( const LatencyHistogram& ) = delete;
+    LatencyHistogram& operator=( const LatencyHistogram& ) = delete;
+
+    // 計測の度に呼ばれるので、ヘッダに置いてインライン化する
+    void Record( uint32_t us )
+    {
+        m_Buckets[bucketIndex( us )].fetch_add( 1, std::memory_order_relaxed );
+
+        // 64bit のアトミックはロックになるので、32bit の下位が溢れた時だけ上位に繰り上げる
+        uint32_t low = m_SumLow.fetch_add( us, std::memory_order_relaxed );
+        if( low + us < low ){
+            m_SumHigh.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+
+    void RecordFailure()
+    {
+        m_Failures.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    void Read( Snapshot* snapshot ) const;
+
+    // 最後のバケットは上限なしなので UINT32_MAX
+    static uint32_t BucketUpperBoundUs( size_t index );
+    // permille (‰) の値が入るバケットの上限
+    static uint32_t Percentile( const Snapshot& snapshot, uint32_t permille );
+
+private:
+
+    static size_t bucketIndex( uint32_t us )
+    {
+        if( us <= (1u << sk_FirstBucketShift) ){
+            return 0;
+        }
+        // ceil(log2(us)) - 6
+        size_t index = (32 - __builtin_clz( us - 1 )) - sk_FirstBucketShift;
+        return (index < sk_BucketCount - 1) ? index : sk_BucketCount - 1;
+    }
+
+    std::atomic<uint32_t> m_Buckets[sk_BucketCount];
+    std::atomic<uint32_t> m_SumLow;
+    std::atomic<uint32_t> m_SumHigh;
+    std::atomic<uint32_t> m_Failures;
+};
+
+//
+// 全段階のヒストグラムと Prometheus 形式での出力
+//
+class Metrics
+{
+public:
+
+    // 出力先。false を返すと出力を中断する。
+    using ExportWriter = bool (*)( void* arg, const char* data, size_t length );
+
+    static LatencyHistogram& Stage( MetricStage stage );
+    static const char* StageName( MetricStage stage );
+
+    static bool ExportPrometheus( ExportWriter writer, void* arg );
+
+    // MQTT 用の要約。開いている object に、段階毎の [件数, 90 パーセンタイル (us)] を書く。
+    static void WriteSummary( TelemetryWriter* writer );
+
+private:
+
+    static LatencyHistogram s_Histograms[static_cast<size_t>(MetricStage::Count)];
+};
+
+//
+// スコープを抜けた時に所要時間を記録する
+//
+class StageTimer
+{
+public:
+
+    explicit StageTimer( MetricStage stage )
+        : m_Stage( stage ),
+          m_Start( esp_timer_get_time() ),
+          m_Failed( false )
+    {}
+
+    ~StageTimer() noexcept
+    {
+        LatencyHistogram& histogram = Metrics::Stage( m_Stage );
+        histogram.Record( static_cast<uint32_t>(esp_timer_get_time() - m_Start) );
+        if( m_Failed ){
+            histogram.RecordFailure();
+        }
+    }
+
+    // DO NOT COPY
+    StageTimer( const StageTimer& ) = delete;
+    StageTimer& operator=( const StageTimer& ) = delete;
+
+    void Failed()
+    {
+        m_Failed = true;
+    }
+
+private:
+
+    MetricStage m_Stage;
+    int64_t     m_Start;
+    bool        m_Failed;
+};
+
+#endif    // METRICS_HPP_INCLUDED
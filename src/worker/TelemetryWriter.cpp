@@ -0,0 +1,232 @@
+#include "TelemetryWriter.hpp"
+
+#include <cstring>
+
+namespace
+{
+    // CBOR の major type
+    const uint8_t sk_CborUnsigned  = 0;
+    const uint8_t sk_CborNegative  = 1;
+    const uint8_t sk_CborText      = 3;
+    const uint8_t sk_CborArrayIndefinite = 0x9F;
+    const uint8_t sk_CborMapIndefinite   = 0xBF;
+    const uint8_t sk_CborBreak     = 0xFF;
+    const uint8_t sk_CborFalse     = 0xF4;
+    const uint8_t sk_CborTrue      = 0xF5;
+}
+
+TelemetryWriter::TelemetryWriter( uint8_t* buffer, size_t capacity, Format format )
+    : m_Buffer( buffer ),
+      m_Capacity( buffer ? capacity : 0 ),
+      m_Length( 0 ),
+      m_Format( format ),
+      m_Overflowed( false ),
+      m_NeedComma( false ),
+      m_AfterKey( false )
+{}
+
+void TelemetryWriter::BeginObject()
+{
+    beginValue();
+    put( (m_Format == Format::JSON) ? '{' : sk_CborMapIndefinite );
+    m_NeedComma = false;
+}
+
+void TelemetryWriter::EndObject()
+{
+    put( (m_Format == Format::JSON) ? '}' : sk_CborBreak );
+    m_NeedComma = true;
+}
+
+void TelemetryWriter::BeginArray()
+{
+    beginValue();
+    put( (m_Format == Format::JSON) ? '[' : sk_CborArrayIndefinite );
+    m_NeedComma = false;
+}
+
+void TelemetryWriter::EndArray()
+{
+    put( (m_Format == Format::JSON) ? ']' : sk_CborBreak );
+    m_NeedComma = true;
+}
+
+void TelemetryWriter::Key( std::string_view name )
+{
+    if( m_Format == Format::JSON ){
+        separate();
+        put( '"' );
+        put( name.data(), name.size() );
+        put( '"' );
+        put( ':' );
+        m_AfterKey = true;
+    }
+    else {
+        putHead( sk_CborText, static_cast<uint32_t>(name.size()) );
+        put( name.data(), name.size() );
+    }
+}
+
+void TelemetryWriter::Value( uint32_t value )
+{
+    beginValue();
+    if( m_Format == Format::JSON ){
+        putDecimal( value );
+    }
+    else {
+        putHead( sk_CborUnsigned, value );
+    }
+    m_NeedComma = true;
+}
+
+void TelemetryWriter::Value( int32_t value )
+{
+    if( value >= 0 ){
+        Value( static_cast<uint32_t>(value) );
+        return;
+    }
+
+    beginValue();
+    // INT32_MIN でも溢れないよう、-1 - value で絶対値 - 1 を得る
+    uint32_t magnitude = static_cast<uint32_t>(-1 - value);
+    if( m_Format == Format::JSON ){
+        put( '-' );
+        putDecimal( magnitude + 1 );
+    }
+    else {
+        putHead( sk_CborNegative, magnitude );
+    }
+    m_NeedComma = true;
+}
+
+void TelemetryWriter::Value( bool value )
+{
+    beginValue();
+    if( m_Format == Format::JSON ){
+        if( value ){
+            put( "true", 4 );
+        }
+        else {
+            put( "false", 5 );
+        }
+    }
+    else {
+        put( value ? sk_CborTrue : sk_CborFalse );
+    }
+    m_NeedComma = true;
+}
+
+void TelemetryWriter::Value( std::string_view str )
+{
+    beginValue();
+    if( m_Format == Format::JSON ){
+        put( '"' );
+        putEscaped( str );
+        put( '"' );
+    }
+    else {
+        putHead( sk_CborText, static_cast<uint32_t>(str.size()) );
+        put( str.data(), str.size() );
+    }
+    m_NeedComma = true;
+}
+
+TelemetryWriter::Format TelemetryWriter::GetFormat() const
+{
+    return m_Format;
+}
+
+bool TelemetryWriter::IsOverflowed() const
+{
+    return m_Overflowed;
+}
+
+size_t TelemetryWriter::PayloadLength() const
+{
+    return m_Overflowed ? m_Capacity + 1 : m_Length;
+}
+
+void TelemetryWriter::beginValue()
+{
+    if( m_Format == Format::JSON && !m_AfterKey ){
+        separate();
+    }
+    m_AfterKey = false;
+}
+
+void TelemetryWriter::separate()
+{
+    if( m_NeedComma ){
+        put( ',' );
+        m_NeedComma = false;
+    }
+}
+
+void TelemetryWriter::putHead( uint8_t major, uint32_t value )
+{
+    uint8_t type = static_cast<uint8_t>(major << 5);
+    if( value < 24 ){
+        put( static_cast<uint8_t>(type | value) );
+    }
+    else if( value <= 0xFF ){
+        put( static_cast<uint8_t>(type | 24) );
+        put( static_cast<uint8_t>(value) );
+    }
+    else if( value <= 0xFFFF ){
+        put( static_cast<uint8_t>(type | 25) );
+        put( static_cast<uint8_t>(value >> 8) );
+        put( static_cast<uint8_t>(value) );
+    }
+    else {
+        put( static_cast<uint8_t>(type | 26) );
+        put( static_cast<uint8_t>(value >> 24) );
+        put( static_cast<uint8_t>(value >> 16) );
+        put( static_cast<uint8_t>(value >> 8) );
+        put( static_cast<uint8_t>(value) );
+    }
+}
+
+void TelemetryWriter::putDecimal( uint32_t value )
+{
+    char digits[10];
+    size_t count = 0;
+    do {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while( value != 0 );
+
+    while( count > 0 ){
+        put( static_cast<uint8_t>(digits[--count]) );
+    }
+}
+
+void TelemetryWriter::putEscaped( std::string_view str )
+{
+    static const char sk_Hex[] = "0123456789abcdef";
+
+    for( char c : str ){
+        uint8_t u = static_cast<uint8_t>(c);
+        if( c == '"' || c == '\\' ){
+            put( '\\' );
+            put( u );
+        }
+        else if( u < 0x20 ){
+            put( "\\u00", 4 );
+            put( static_cast<uint8_t>(sk_Hex[u >> 4]) );
+            put( static_cast<uint8_t>(sk_Hex[u & 0x0F]) );
+        }
+        else {
+            put( u );
+        }
+    }
+}
+
+void TelemetryWriter::put( const void* data, size_t length )
+{
+    if( m_Overflowed || length > m_Capacity - m_Length ){
+        m_Overflowed = true;
+        return;
+    }
+    memcpy( m_Buffer + m_Length, data, length );
+    m_Length += length;
+}
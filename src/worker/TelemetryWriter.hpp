@@ -0,0 +1,169 @@
+#ifndef     TELEMETRY_WRITER_HPP_INCLUDED
+#define     TELEMETRY_WRITER_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+//
+// JSON / CBOR で符号化済みのフィールド名
+// 文字列リテラルから constexpr で構築すればコンパイル時に計算される。
+// 名前はエスケープしないので、英数字と '_' 程度に限ること。
+//
+template <size_t N>
+class TelemetryKey
+{
+public:
+
+    static_assert( N > 1 && N - 1 < 256, "Key length must be 1..255" );
+
+    constexpr TelemetryKey( const char (&name)[N] )
+        : m_Json(),
+          m_Cbor(),
+          m_CborLength( 0 )
+    {
+        // "name":
+        m_Json[0] = '"';
+        for( size_t i = 0; i < N - 1; ++i ){
+            m_Json[i + 1] = name[i];
+        }
+        m_Json[N]     = '"';
+        m_Json[N + 1] = ':';
+
+        // テキスト文字列 (major type 3)
+        size_t head = 0;
+        if( N - 1 < 24 ){
+            m_Cbor[head++] = static_cast<uint8_t>(0x60 | (N - 1));
+        }
+        else {
+            m_Cbor[head++] = 0x78;
+            m_Cbor[head++] = static_cast<uint8_t>(N - 1);
+        }
+        for( size_t i = 0; i < N - 1; ++i ){
+            m_Cbor[head + i] = static_cast<uint8_t>(name[i]);
+        }
+        m_CborLength = head + N - 1;
+    }
+
+    constexpr const char* Json() const { return m_Json; }
+    constexpr size_t JsonLength() const { return N + 2; }
+    constexpr const uint8_t* Cbor() const { return m_Cbor; }
+    constexpr size_t CborLength() const { return m_CborLength; }
+
+private:
+
+    char    m_Json[N + 2];
+    uint8_t m_Cbor[N + 1];
+    size_t  m_CborLength;
+};
+
+//
+// 呼び出し側のバッファへ直接書き込む JSON / CBOR シリアライザ
+//
+// 確保もコピーもしないので、Publish() のペイロードライターから送信キューのスロットへそのまま書ける。
+// バッファが足りなくなった時点で以降の書き込みは捨て、PayloadLength() が容量を超える値を返す。
+// CBOR の object / array は長さ不定形式で書くので、要素数を先に数える必要はない。
+//
+class TelemetryWriter
+{
+public:
+
+    enum class Format : uint8_t
+    {
+        JSON,
+        CBOR,
+    };
+
+public:
+
+    TelemetryWriter( uint8_t* buffer, size_t capacity, Format format = Format::JSON );
+
+    // DO NOT COPY
+    TelemetryWriter( const TelemetryWriter& ) = delete;
+    TelemetryWriter& operator=( const TelemetryWriter& ) = delete;
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+
+    template <size_t N>
+    void Key( const TelemetryKey<N>& key )
+    {
+        if( m_Format == Format::JSON ){
+            separate();
+            put( key.Json(), key.JsonLength() );
+            m_AfterKey = true;
+        }
+        else {
+            put( key.Cbor(), key.CborLength() );
+        }
+    }
+    // 実行時に決まる名前。エスケープはしない。
+    void Key( std::string_view name );
+
+    void Value( uint32_t value );
+    void Value( int32_t value );
+    void Value( bool value );
+    void Value( std::string_view str );
+    void Value( const char* str )
+    {
+        Value( std::string_view( str ) );
+    }
+
+    template <size_t N, typename T>
+    void Field( const TelemetryKey<N>& key, T value )
+    {
+        Key( key );
+        Value( value );
+    }
+
+    template <size_t N>
+    void BeginObject( const TelemetryKey<N>& key )
+    {
+        Key( key );
+        BeginObject();
+    }
+
+    template <size_t N>
+    void BeginArray( const TelemetryKey<N>& key )
+    {
+        Key( key );
+        BeginArray();
+    }
+
+    Format GetFormat() const;
+    bool IsOverflowed() const;
+    // 書き込んだ長さ。溢れた場合は容量を超える値を返す。
+    size_t PayloadLength() const;
+
+private:
+
+    void beginValue();
+    void separate();
+    void putHead( uint8_t major, uint32_t value );
+    void putDecimal( uint32_t value );
+    void putEscaped( std::string_view str );
+
+    void put( uint8_t c )
+    {
+        if( !m_Overflowed && m_Length < m_Capacity ){
+            m_Buffer[m_Length++] = c;
+        }
+        else {
+            m_Overflowed = true;
+        }
+    }
+
+    void put( const void* data, size_t length );
+
+    uint8_t* m_Buffer;
+    size_t   m_Capacity;
+    size_t   m_Length;
+    Format   m_Format;
+    bool     m_Overflowed;
+    bool     m_NeedComma;       // JSON: 同じ階層に前の要素がある
+    bool     m_AfterKey;        // JSON: 直前がキー
+};
+
+#endif    // TELEMETRY_WRITER_HPP_INCLUDED
@@ -0,0 +1,97 @@
+#include "TriggerQueue.hpp"
+
+#include "esp_timer.h"
+#include "esp_log.h"
+
+TriggerQueue::TriggerQueue()
+    : m_Initialized( false ),
+      m_Config(),
+      m_Queue( nullptr )
+{}
+
+TriggerQueue::~TriggerQueue()
+{}
+
+TriggerQueue& TriggerQueue::Instance()
+{
+    static TriggerQueue s_Instance;
+    return s_Instance;
+}
+
+bool TriggerQueue::Initialize( const Config& config )
+{
+    TriggerQueue& instance = TriggerQueue::Instance();
+
+    if( instance.m_Initialized ){
+        return false;
+    }
+    if( config.QueueDepth == 0 || config.Handler == nullptr ){
+        return false;
+    }
+
+    instance.m_Queue = xQueueCreate( config.QueueDepth, sizeof(Trigger) );
+    if( instance.m_Queue == nullptr ){
+        ESP_LOGE( sk_Tag, "Failed to create trigger queue." );
+        return false;
+    }
+    instance.m_Config = config;
+
+    if( xTaskCreatePinnedToCore( TriggerTask, "Trigger", config.StackSize, &instance, config.TaskPriority, nullptr, config.CoreId ) != pdPASS ){
+        ESP_LOGE( sk_Tag, "Failed to create trigger task." );
+        return false;
+    }
+
+    instance.m_Initialized = true;
+    return true;
+}
+
+bool TriggerQueue::Post( Source source )
+{
+    if( !m_Initialized ){
+        return false;
+    }
+
+    Trigger trigger = { source, esp_timer_get_time() };
+    if( xQueueSend( m_Queue, &trigger, 0 ) != pdTRUE ){
+        ESP_LOGW( sk_Tag, "Trigger queue is full. source=%s", SourceName( source ) );
+        return false;
+    }
+    return true;
+}
+
+bool TriggerQueue::PostFromISR( Source source, BaseType_t* woken )
+{
+    if( !m_Initialized ){
+        return false;
+    }
+
+    // 割り込み中はログを出せないので、溢れた分は黙って捨てる
+    Trigger trigger = { source, esp_timer_get_time() };
+    return xQueueSendFromISR( m_Queue, &trigger, woken ) == pdTRUE;
+}
+
+const char* TriggerQueue::SourceName( Source source )
+{
+    switch( source ){
+    case Source::Button:    return "button";
+    case Source::Motion:    return "motion";
+    }
+    return "unknown";
+}
+
+void TriggerQueue::TriggerTask( void* param )
+{
+    TriggerQueue* instance = reinterpret_cast<TriggerQueue*>(param);
+
+    while( 1 ){
+        Trigger trigger;
+        if( xQueueReceive( instance->m_Queue, &trigger, portMAX_DELAY ) != pdTRUE ){
+            continue;
+        }
+
+        int64_t latency_us = esp_timer_get_time() - trigger.TimestampUs;
+        ESP_LOGI( sk_Tag, "Triggered by %s. latency=%lldus", SourceName( trigger.From ), static_cast<long long>(latency_us) );
+
+        instance->m_Config.Handler( instance->m_Config.HandlerArg, trigger );
+    }
+}
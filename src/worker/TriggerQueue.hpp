@@ -0,0 +1,72 @@
+#ifndef     TRIGGER_QUEUE_HPP_INCLUDED
+#define     TRIGGER_QUEUE_HPP_INCLUDED
+
+#include <cstdint>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+//
+// 撮影のきっかけ (ボタン、動体検知) を 1 つのタスクで順に処理する
+//
+// 割り込みからも積めるので、ボタンを押してからハンドラが動くまでにポーリングの待ちが無い。
+//
+class TriggerQueue
+{
+public:
+
+    enum class Source : uint8_t
+    {
+        Button = 0,
+        Motion,
+    };
+
+    struct Trigger
+    {
+        Source  From;
+        int64_t TimestampUs;            // 積んだ時刻 (esp_timer_get_time)
+    };
+
+    using TriggerHandler = void (*)( void* arg, const Trigger& trigger );
+
+    struct Config
+    {
+        uint32_t       QueueDepth;
+        uint32_t       StackSize;
+        UBaseType_t    TaskPriority;
+        BaseType_t     CoreId;
+        TriggerHandler Handler;
+        void*          HandlerArg;
+    };
+
+    static inline constexpr char sk_Tag[] = "Trigger";
+
+public:
+
+    // DO NOT COPY
+    TriggerQueue( const TriggerQueue& ) = delete;
+    TriggerQueue& operator=( const TriggerQueue& ) = delete;
+
+    static TriggerQueue& Instance();
+    static bool Initialize( const Config& config );
+
+    bool Post( Source source );
+    // *woken が pdTRUE になったら、割り込みの最後で portYIELD_FROM_ISR() すること
+    bool PostFromISR( Source source, BaseType_t* woken );
+
+    static const char* SourceName( Source source );
+
+private:
+
+    TriggerQueue();
+    ~TriggerQueue() noexcept;
+
+    static void TriggerTask( void* param );
+
+    bool          m_Initialized;
+    Config        m_Config;
+    QueueHandle_t m_Queue;
+};
+
+#endif    // TRIGGER_QUEUE_HPP_INCLUDED